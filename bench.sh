@@ -0,0 +1,114 @@
+#!/bin/bash
+
+# Configuration
+INTERPRETER="./clox-release"       # Path to the optimized interpreter executable
+BENCH_DIR="bench"                  # Directory containing the benchmark workloads
+BASELINE="$BENCH_DIR/baseline.json" # Saved results to compare against
+RUNS="${BENCH_RUNS:-5}"            # Number of runs per workload
+SAVE="${BENCH_SAVE:-0}"            # Set to 1 to overwrite the baseline
+
+# --- End of Configuration ---
+
+TIMEFORMAT=%R
+
+# Peak RSS is measured with time(1) when available (GNU: KiB, BSD: bytes)
+if /usr/bin/time -f %M true > /dev/null 2>&1; then
+    RSS_MODE="gnu"
+elif /usr/bin/time -l true > /dev/null 2>&1; then
+    RSS_MODE="bsd"
+else
+    RSS_MODE="none"
+fi
+
+# Prints the peak RSS of running the workload $1 in KiB, or "n/a"
+peak_rss() {
+    case "$RSS_MODE" in
+    gnu)
+        /usr/bin/time -f %M "$INTERPRETER" "$1" 2>&1 > /dev/null | tail -n 1
+        ;;
+    bsd)
+        /usr/bin/time -l "$INTERPRETER" "$1" 2>&1 > /dev/null |
+            awk '/maximum resident set size/ { print int($1 / 1024) }'
+        ;;
+    *)
+        echo "n/a"
+        ;;
+    esac
+}
+
+# Prints the field $2 of workload $1 from the baseline, or nothing
+baseline_field() {
+    [ -f "$BASELINE" ] || return
+    grep "\"$1\":" "$BASELINE" |
+        sed -n "s/.*\"$2\": *\([0-9.]*\).*/\1/p"
+}
+
+if [ ! -x "$INTERPRETER" ]; then
+    echo "Missing $INTERPRETER, build it with 'make release'."
+    exit 1
+fi
+
+declare -a results=()
+declare -a failures=()
+
+printf "%-16s %10s %10s %10s %10s %9s\n" \
+    "workload" "median(s)" "min(s)" "rss(KiB)" "base(s)" "change"
+
+for workload in "$BENCH_DIR"/*.lox; do
+    name=$(basename "$workload" .lox)
+    times=()
+    status=0
+
+    # A workload that fails would be timed until its error, not compared
+    for ((run = 0; run < RUNS && status == 0; run++)); do
+        elapsed=$( { time "$INTERPRETER" "$workload" > /dev/null 2>&1; } 2>&1 )
+        status=$?
+        times+=("$elapsed")
+    done
+    if [ "$status" -ne 0 ]; then
+        printf "%-16s %s\n" "$name" "FAILED (exit status $status)"
+        failures+=("$name")
+        continue
+    fi
+
+    sorted=($(printf "%s\n" "${times[@]}" | sort -n))
+    min="${sorted[0]}"
+    median="${sorted[$((RUNS / 2))]}"
+    rss=$(peak_rss "$workload")
+
+    base=$(baseline_field "$name" median)
+    change=""
+    if [ -n "$base" ]; then
+        change=$(awk -v now="$median" -v base="$base" \
+            'BEGIN { if (base > 0) printf "%+.1f%%", (now - base) * 100 / base }')
+    fi
+
+    printf "%-16s %10s %10s %10s %10s %9s\n" \
+        "$name" "$median" "$min" "$rss" "${base:--}" "${change:--}"
+
+    [ "$rss" = "n/a" ] && rss="null"
+    results+=("  \"$name\": { \"median\": $median, \"min\": $min, \"rss_kib\": $rss }")
+done
+
+if [ ${#failures[@]} -gt 0 ]; then
+    echo "Failed workloads: ${failures[*]}, run them to see the errors."
+    [ "$SAVE" = "1" ] && echo "Baseline not saved."
+    exit 1
+fi
+
+if [ "$SAVE" = "1" ]; then
+    {
+        echo "{"
+        for ((i = 0; i < ${#results[@]}; i++)); do
+            if ((i + 1 < ${#results[@]})); then
+                echo "${results[$i]},"
+            else
+                echo "${results[$i]}"
+            fi
+        done
+        echo "}"
+    } > "$BASELINE"
+    echo "Baseline saved to '$BASELINE'."
+elif [ ! -f "$BASELINE" ]; then
+    echo "No baseline found, save one with 'make bench-baseline'."
+fi
@@ -0,0 +1,55 @@
+#!/bin/bash
+
+# Configuration
+INTERPRETER="./clox-release"       # Path to the optimized interpreter executable
+SCRIPTS="${JOBS_SCRIPTS:-400}"     # Number of small scripts in the batch
+MAX_JOBS="${JOBS_MAX:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 4)}"
+
+# --- End of Configuration ---
+
+TIMEFORMAT=%R
+
+if [ ! -x "$INTERPRETER" ]; then
+    echo "Missing $INTERPRETER, build it with 'make release'."
+    exit 1
+fi
+
+batch_dir=$(mktemp -d)
+trap 'rm -rf "$batch_dir"' EXIT
+
+# A batch of small independent scripts, similar to what batch jobs run
+for ((i = 0; i < SCRIPTS; i++)); do
+    cat > "$batch_dir/script-$i.lox" <<EOF
+fun fib(n) = n < 2 ? n : fib(n - 1) + fib(n - 2)
+var name = "script-" + "$i";
+var total = 0;
+for (var j = 0; j < 2000; j = j + 1) {
+    total = total + j * $i;
+}
+print name;
+print fib(18) + total;
+EOF
+done
+
+# Throughput in scripts per second for an elapsed time of $1 seconds
+throughput() {
+    awk -v s="$SCRIPTS" -v t="$1" 'BEGIN { printf "%.1f", (t > 0 ? s / t : 0) }'
+}
+
+printf "%-18s %10s %12s %9s\n" "mode" "time(s)" "scripts/s" "speedup"
+
+elapsed=$( { time for script in "$batch_dir"/*.lox; do
+    "$INTERPRETER" "$script" > /dev/null 2>&1; done; } 2>&1 )
+printf "%-18s %10s %12s %9s\n" "process per file" "$elapsed" \
+    "$(throughput "$elapsed")" "-"
+
+base=""
+for ((jobs = 1; jobs <= MAX_JOBS; jobs++)); do
+    elapsed=$( { time "$INTERPRETER" --jobs="$jobs" "$batch_dir"/*.lox \
+        > /dev/null 2>&1; } 2>&1 )
+    [ -z "$base" ] && base="$elapsed"
+    speedup=$(awk -v base="$base" -v now="$elapsed" \
+        'BEGIN { printf "%.2fx", (now > 0 ? base / now : 0) }')
+    printf "%-18s %10s %12s %9s\n" "--jobs=$jobs" "$elapsed" \
+        "$(throughput "$elapsed")" "$speedup"
+done
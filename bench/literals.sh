@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Configuration
+INTERPRETER="./clox-release"       # Path to the optimized interpreter executable
+ROWS="${LITERALS_ROWS:-200000}"    # Rows of the generated numeric table
+RUNS="${BENCH_RUNS:-5}"            # Number of runs
+
+# --- End of Configuration ---
+
+TIMEFORMAT=%R
+
+if [ ! -x "$INTERPRETER" ]; then
+    echo "Missing $INTERPRETER, build it with 'make release'."
+    exit 1
+fi
+
+table=$(mktemp)
+trap 'rm -f "$table"' EXIT
+
+# A generated table of integers and decimals inside a function that is never
+# called, so the time is spent scanning and compiling the literals
+awk -v rows="$ROWS" 'BEGIN {
+    srand(1);
+    print "fun table() {";
+    print "    var row;";
+    for (i = 0; i < rows; i++)
+        printf "    row = %d + %.2f + %.6f + %d.%d;\n", int(rand() * 100000),
+            rand() * 1000, rand(), i, int(rand() * 1000);
+    print "}";
+    print "print \"compiled\";";
+}' > "$table"
+
+times=()
+for ((run = 0; run < RUNS; run++)); do
+    times+=("$( { time "$INTERPRETER" "$table" > /dev/null 2>&1; } 2>&1 )")
+done
+sorted=($(printf "%s\n" "${times[@]}" | sort -n))
+
+printf "%-10s %10s %10s %12s\n" "literals" "median(s)" "min(s)" "literals/s"
+printf "%-10s %10s %10s %12s\n" "$((ROWS * 4))" "${sorted[$((RUNS / 2))]}" \
+    "${sorted[0]}" "$(awk -v n="$((ROWS * 4))" -v t="${sorted[$((RUNS / 2))]}" \
+        'BEGIN { printf "%.0f", (t > 0 ? n / t : 0) }')"
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+# Configuration
+INTERPRETER="./clox-release"       # Path to the optimized interpreter executable
+MESSAGES="${PIPELINE_MESSAGES:-100000}" # Messages pushed through the pipeline
+CAPACITY="${PIPELINE_CAPACITY:-64}"     # Capacity of each channel
+MAX_STAGES="${PIPELINE_MAX:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 4)}"
+
+# --- End of Configuration ---
+
+TIMEFORMAT=%R
+
+if [ ! -x "$INTERPRETER" ]; then
+    echo "Missing $INTERPRETER, build it with 'make release'."
+    exit 1
+fi
+
+pipeline_dir=$(mktemp -d)
+trap 'rm -rf "$pipeline_dir"' EXIT
+
+# producer -> N transformers -> consumer. Every transformer forwards a "done"
+# marker once the input is closed, the consumer stops after N markers. Every
+# script needs its own worker thread since they block on each other.
+cat > "$pipeline_dir/0-producer.lox" <<EOF
+var input = channel("input", $CAPACITY);
+for (var i = 0; i < $MESSAGES; i = i + 1) {
+    send(input, i);
+}
+close(input);
+EOF
+
+cat > "$pipeline_dir/1-transformer.lox" <<EOF
+var input = channel("input", $CAPACITY);
+var output = channel("output", $CAPACITY);
+var message = receive(input);
+while (message != nil) {
+    send(output, message * 2);
+    message = receive(input);
+}
+send(output, "done");
+EOF
+
+write_consumer() {
+    cat > "$pipeline_dir/2-consumer.lox" <<EOF
+var output = channel("output", $CAPACITY);
+var done = 0;
+var count = 0;
+while (done < $1) {
+    var message = receive(output);
+    if (message == "done") {
+        done = done + 1;
+    } else {
+        count = count + 1;
+    }
+}
+print count;
+EOF
+}
+
+printf "%-14s %10s %14s\n" "transformers" "time(s)" "messages/s"
+
+for ((stages = 1; stages <= MAX_STAGES; stages++)); do
+    write_consumer "$stages"
+    scripts=("$pipeline_dir/0-producer.lox")
+    for ((i = 0; i < stages; i++)); do
+        scripts+=("$pipeline_dir/1-transformer.lox")
+    done
+    scripts+=("$pipeline_dir/2-consumer.lox")
+
+    elapsed=$( { time "$INTERPRETER" --jobs=$((stages + 2)) "${scripts[@]}" \
+        > "$pipeline_dir/out" 2>&1; } 2>&1 )
+    if [ "$(tail -n 1 "$pipeline_dir/out")" != "$MESSAGES" ]; then
+        echo "Pipeline with $stages transformers lost messages:"
+        tail -n 5 "$pipeline_dir/out"
+        exit 1
+    fi
+    rate=$(awk -v m="$MESSAGES" -v t="$elapsed" \
+        'BEGIN { printf "%.0f", (t > 0 ? m / t : 0) }')
+    printf "%-14s %10s %14s\n" "$stages" "$elapsed" "$rate"
+done
@@ -0,0 +1,145 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "scanner.h"
+
+/*
+ * Scanner throughput benchmark. Every workload is a generated source of
+ * about SOURCE_SIZE bytes that is scanned until at least MIN_BYTES were
+ * processed, the result is reported in MB/s. The line of the EOF token is
+ * checked against the number of lines generated, so a fast path that
+ * miscounts newlines fails loudly.
+ */
+
+#define SOURCE_SIZE (4 << 20)
+#define MIN_BYTES (256 << 20)
+
+struct workload {
+	const char *name;
+	const char *const *lines;
+	int32_t line_count;
+};
+
+static const char *const mixed_lines[] = {
+	"fun fibonacci(n) = n < 2 ? n : fibonacci(n - 1) + fibonacci(n - 2)",
+	"var greeting = \"Hello, \" + name + \"!\";",
+	"    // Walk the table and sum up every value",
+	"    for (var index = 0; index < length; index = index + 1) {",
+	"        total = total + values(index) * 1.5;",
+	"    }",
+	"print some_rather_long_identifier_name_for_testing;",
+	"",
+};
+
+static const char *const comment_lines[] = {
+	"// A comment line that is long enough to make skipping it matter",
+	"        // Indented comments are just as common in generated code",
+	"",
+};
+
+static const char *const string_lines[] = {
+	"print \"A string literal that is long enough to make scanning it "
+	"matter\";",
+	"var s = \"short\";",
+};
+
+static const char *const identifier_lines[] = {
+	"alpha beta gamma delta epsilon zeta eta theta iota kappa lambda",
+	"a_rather_long_identifier_name another_long_identifier_name_here",
+};
+
+#define WORKLOAD(name, lines) \
+	{ name, lines, (int32_t)(sizeof(lines) / sizeof(lines[0])) }
+
+static const struct workload workloads[] = {
+	WORKLOAD("mixed", mixed_lines),
+	WORKLOAD("comments", comment_lines),
+	WORKLOAD("strings", string_lines),
+	WORKLOAD("identifiers", identifier_lines),
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * make_source() - Repeat the lines of @workload up to about SOURCE_SIZE.
+ * @lines: Set to the number of lines of the source.
+ */
+static char *make_source(const struct workload *workload, size_t *length,
+			 int32_t *lines)
+{
+	char *source = malloc(SOURCE_SIZE + 256);
+	const char *line;
+	size_t line_length;
+	int32_t i = 0;
+
+	if (source == NULL)
+		exit(1);
+
+	*length = 0;
+	*lines = 0;
+	while (*length < SOURCE_SIZE) {
+		line = workload->lines[i++ % workload->line_count];
+		line_length = strlen(line);
+		memcpy(source + *length, line, line_length);
+		*length += line_length;
+		source[(*length)++] = '\n';
+		(*lines)++;
+	}
+	source[*length] = '\0';
+	return source;
+}
+
+static void bench_workload(const struct workload *workload)
+{
+	struct scanner scanner;
+	struct token token;
+	size_t length, scanned = 0;
+	int64_t tokens = 0;
+	int32_t lines;
+	char *source = make_source(workload, &length, &lines);
+	double start = now_ns(), elapsed;
+
+	while (scanned < MIN_BYTES) {
+		init_scanner(&scanner, source, length);
+		do {
+			token = scan_token(&scanner);
+			tokens++;
+		} while (token.token_type != TOKEN_EOF &&
+			 token.token_type != TOKEN_ERROR);
+
+		if (token.token_type == TOKEN_ERROR ||
+		    token.line != lines + 1) {
+			fprintf(stderr, "%s: failed at line %d of %d\n",
+				workload->name, token.line,
+				lines + 1);
+			exit(1);
+		}
+		scanned += length;
+	}
+	elapsed = now_ns() - start;
+
+	printf("%-12s %10.1f %12.1f\n", workload->name,
+	       (double)scanned / 1e6 / (elapsed / 1e9),
+	       (double)tokens / 1e6 / (elapsed / 1e9));
+	free(source);
+}
+
+int main(void)
+{
+	size_t i;
+
+	printf("%-12s %10s %12s\n", "workload", "MB/s", "Mtokens/s");
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		bench_workload(&workloads[i]);
+	return 0;
+}
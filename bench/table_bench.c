@@ -0,0 +1,319 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+/*
+ * Microbenchmark for struct table. Every measurement is repeated until at
+ * least MIN_OPS operations were timed and reported in nanoseconds per
+ * operation. Probe lengths are counted by walking the table from the home
+ * bucket of a key, so they reflect exactly what find_entry() does.
+ */
+
+#define MIN_OPS (1 << 20)
+#define MAX_PROBE_BUCKET 8
+
+static const int32_t sizes[] = { 16, 256, 4096, 65536, 262144 };
+static const int32_t key_lengths[] = { 6, 16, 64 };
+static const int32_t hit_percents[] = { 100, 50, 0 };
+
+static uint64_t random_state = 0x9e3779b97f4a7c15u;
+static struct vm vm;
+static struct table seen;
+
+static uint64_t next_random(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * make_keys() - Create @count distinct interned strings of length @length.
+ */
+static struct object_string **make_keys(int32_t count, int32_t length)
+{
+	struct object_string **keys = malloc(sizeof(*keys) * count), *key;
+	char *buffer = malloc(length + 1);
+	int32_t i, j;
+
+	if (keys == NULL || buffer == NULL)
+		exit(1);
+
+	for (i = 0; i < count;) {
+		for (j = 0; j < length; j++)
+			buffer[j] = 'a' + next_random() % 26;
+		buffer[length] = '\0';
+		key = copy_string(&vm, buffer, length);
+		// Reject duplicates so every key gets its own entry
+		if (!table_set(&vm, &seen, key, CONS_NIL))
+			continue;
+		keys[i++] = key;
+	}
+
+	free(buffer);
+	return keys;
+}
+
+static int32_t repeats_for(int32_t count)
+{
+	int32_t repeats = MIN_OPS / count;
+	return repeats < 1 ? 1 : repeats;
+}
+
+static void fill_table(struct table *table, struct object_string **keys,
+		       int32_t count)
+{
+	int32_t i;
+
+	for (i = 0; i < count; i++)
+		table_set(&vm, table, keys[i], CONS_NUMBER(i));
+}
+
+static double bench_set(struct object_string **keys, int32_t count)
+{
+	struct table table;
+	int32_t repeats = repeats_for(count), r;
+	double start, elapsed = 0;
+
+	for (r = 0; r < repeats; r++) {
+		init_table(&table);
+		start = now_ns();
+		fill_table(&table, keys, count);
+		elapsed += now_ns() - start;
+		free_table(&vm, &table);
+	}
+
+	return elapsed / ((double)repeats * count);
+}
+
+/**
+ * bench_get() - Time table_get() with @hit_percent percent of the lookups
+ * using keys that are in @table and the rest using @misses.
+ */
+static double bench_get(struct table *table, struct object_string **keys,
+			struct object_string **misses, int32_t count,
+			int32_t hit_percent)
+{
+	struct object_string **lookups = malloc(sizeof(*lookups) * count);
+	int32_t repeats = repeats_for(count), r, i, found = 0;
+	value_t value;
+	double start, elapsed;
+
+	if (lookups == NULL)
+		exit(1);
+	for (i = 0; i < count; i++)
+		lookups[i] = (int32_t)(next_random() % 100) < hit_percent ?
+				     keys[i] :
+				     misses[i];
+
+	start = now_ns();
+	for (r = 0; r < repeats; r++)
+		for (i = 0; i < count; i++)
+			found += table_get(table, lookups[i], &value);
+	elapsed = now_ns() - start;
+
+	free(lookups);
+	if (found < 0) // keep the lookups alive
+		printf("unreachable\n");
+	return elapsed / ((double)repeats * count);
+}
+
+static double bench_find_string(struct table *strings,
+				struct object_string **keys, int32_t count)
+{
+	int32_t repeats = repeats_for(count), r, i, found = 0;
+	double start, elapsed;
+
+	start = now_ns();
+	for (r = 0; r < repeats; r++)
+		for (i = 0; i < count; i++)
+			found += table_find_string(strings, keys[i]->characters,
+						   keys[i]->length,
+						   keys[i]->hash) != NULL;
+	elapsed = now_ns() - start;
+
+	if (found < 0) // keep the lookups alive
+		printf("unreachable\n");
+	return elapsed / ((double)repeats * count);
+}
+
+/**
+ * bench_churn() - Replace keys of a full table with other keys.
+ * @pool: The @count keys in @table followed by @count keys that are not.
+ * @present: Which keys of @pool are currently in @table.
+ *
+ * Every step deletes a random key of the table and inserts a random key
+ * that is not in it, which leaves tombstones behind the way a long lived
+ * table would. Each delete and each insert counts as one operation.
+ */
+static double bench_churn(struct table *table, struct object_string **pool,
+			  bool *present, int32_t count)
+{
+	int32_t repeats = repeats_for(count), steps = count / 4, r, i, k;
+	double start, elapsed;
+
+	if (steps == 0)
+		steps = 1;
+
+	start = now_ns();
+	for (r = 0; r < repeats; r++) {
+		for (i = 0; i < steps; i++) {
+			do
+				k = (int32_t)(next_random() % (2 * count));
+			while (!present[k]);
+			table_delete(table, pool[k]);
+			present[k] = false;
+
+			do
+				k = (int32_t)(next_random() % (2 * count));
+			while (present[k]);
+			table_set(&vm, table, pool[k], CONS_NUMBER(k));
+			present[k] = true;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	return elapsed / ((double)repeats * steps * 2);
+}
+
+static void probe_histogram(struct table *table, struct object_string **keys,
+			    int32_t count, bool hits, int32_t *histogram)
+{
+	struct entry *entry;
+	int32_t i, bucket, probes;
+
+	memset(histogram, 0, sizeof(int32_t) * (MAX_PROBE_BUCKET + 1));
+	if (table->capacity == 0)
+		return;
+
+	for (i = 0; i < count; i++) {
+		bucket = keys[i]->hash % table->capacity;
+		for (probes = 1;; probes++) {
+			entry = &table->entries[bucket];
+			if (hits ? entry->key == keys[i] :
+				   entry->key == NULL && IS_NIL(entry->value))
+				break;
+			bucket = (bucket + 1) % table->capacity;
+		}
+		histogram[probes > MAX_PROBE_BUCKET ? MAX_PROBE_BUCKET :
+						      probes - 1]++;
+	}
+}
+
+static void print_histogram(const char *label, int32_t *histogram,
+			    int32_t count)
+{
+	int32_t i;
+
+	printf("    %-12s", label);
+	for (i = 0; i <= MAX_PROBE_BUCKET; i++)
+		printf(" %6.2f%%", 100.0 * histogram[i] / count);
+	printf("\n");
+}
+
+static void print_histogram_header(void)
+{
+	int32_t i;
+
+	printf("    %-12s", "probes");
+	for (i = 1; i <= MAX_PROBE_BUCKET; i++)
+		printf(" %7d", i);
+	printf(" %6d+\n", MAX_PROBE_BUCKET + 1);
+}
+
+static void bench_size(int32_t count, int32_t key_length)
+{
+	struct object_string **pool = malloc(sizeof(*pool) * count * 2),
+			     **keys = make_keys(count, key_length),
+			     **spares = make_keys(count, key_length),
+			     **misses = make_keys(count, key_length);
+	bool *present = malloc(sizeof(*present) * count * 2);
+	struct table table, strings;
+	int32_t histogram[MAX_PROBE_BUCKET + 1], i, j;
+
+	if (pool == NULL || present == NULL)
+		exit(1);
+
+	printf("size %d, key length %d\n", count, key_length);
+
+	printf("  table_set          %8.2f ns/op\n", bench_set(keys, count));
+
+	init_table(&table);
+	fill_table(&table, keys, count);
+	printf("  load factor        %8.2f\n",
+	       (double)table.count / table.capacity);
+	for (i = 0; i < (int32_t)(sizeof(hit_percents) / sizeof(int32_t));
+	     i++)
+		printf("  table_get %3d%% hit %8.2f ns/op\n", hit_percents[i],
+		       bench_get(&table, keys, misses, count, hit_percents[i]));
+
+	init_table(&strings);
+	fill_table(&strings, keys, count);
+	printf("  table_find_string  %8.2f ns/op\n",
+	       bench_find_string(&strings, keys, count));
+	free_table(&vm, &strings);
+
+	print_histogram_header();
+	probe_histogram(&table, keys, count, true, histogram);
+	print_histogram("hit", histogram, count);
+	probe_histogram(&table, misses, count, false, histogram);
+	print_histogram("miss", histogram, count);
+
+	for (i = 0; i < count; i++) {
+		pool[i] = keys[i];
+		present[i] = true;
+		pool[count + i] = spares[i];
+		present[count + i] = false;
+	}
+	printf("  delete+set churn   %8.2f ns/op\n",
+	       bench_churn(&table, pool, present, count));
+	printf("  load factor        %8.2f (tombstones included)\n",
+	       (double)table.count / table.capacity);
+	for (i = 0, j = 0; i < 2 * count; i++)
+		if (present[i])
+			keys[j++] = pool[i];
+	probe_histogram(&table, keys, count, true, histogram);
+	print_histogram("hit churned", histogram, count);
+	probe_histogram(&table, misses, count, false, histogram);
+	print_histogram("miss churned", histogram, count);
+
+	free_table(&vm, &table);
+	free(pool);
+	free(present);
+	free(keys);
+	free(spares);
+	free(misses);
+}
+
+int main(void)
+{
+	int32_t i, j;
+
+	init_vm(&vm);
+	init_table(&seen);
+
+	for (i = 0; i < (int32_t)(sizeof(key_lengths) / sizeof(int32_t)); i++)
+		for (j = 0; j < (int32_t)(sizeof(sizes) / sizeof(int32_t)); j++)
+			bench_size(sizes[j], key_lengths[i]);
+
+	free_table(&vm, &seen);
+	free_vm(&vm);
+	return 0;
+}
@@ -0,0 +1,258 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <string.h>
+
+#include "common.h"
+#include "channel.h"
+#include "object.h"
+#include "vm.h"
+
+#define CHANNEL_INITIAL_SIZE 8
+
+/*
+ * Channels are shared by all VMs of the process and looked up by name, so
+ * isolates never exchange pointers into each other's heaps. A channel lives
+ * until free_channels() since messages may still be queued after every VM
+ * that opened it is gone.
+ */
+struct channel {
+	char *name;
+	int32_t length;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct message *messages;
+	int32_t capacity;
+	int32_t size;
+	int32_t head;
+	int32_t count;
+	bool closed;
+	struct channel *next;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct channel *channels;
+
+static struct channel *create_channel(const char *name, int32_t length,
+				      int32_t capacity)
+{
+	struct channel *channel = malloc(sizeof(*channel));
+
+	if (channel == NULL)
+		exit(1);
+	channel->name = malloc(length + 1);
+	channel->size = capacity == CHANNEL_UNBOUNDED ? CHANNEL_INITIAL_SIZE :
+							 capacity;
+	channel->messages = malloc(sizeof(struct message) * channel->size);
+	if (channel->name == NULL || channel->messages == NULL)
+		exit(1);
+	memcpy(channel->name, name, length);
+	channel->name[length] = '\0';
+	channel->length = length;
+	pthread_mutex_init(&channel->lock, NULL);
+	pthread_cond_init(&channel->not_empty, NULL);
+	pthread_cond_init(&channel->not_full, NULL);
+	channel->capacity = capacity;
+	channel->head = 0;
+	channel->count = 0;
+	channel->closed = false;
+	return channel;
+}
+
+/**
+ * open_channel() - Find the channel called @name or create it.
+ * @capacity: Number of messages the channel buffers before send blocks, or
+ * CHANNEL_UNBOUNDED. Only used when the channel is created.
+ */
+struct channel *open_channel(const char *name, int32_t length,
+			     int32_t capacity)
+{
+	struct channel *channel;
+
+	pthread_mutex_lock(&registry_lock);
+	for (channel = channels; channel != NULL; channel = channel->next)
+		if (channel->length == length &&
+		    memcmp(channel->name, name, length) == 0)
+			break;
+	if (channel == NULL) {
+		channel = create_channel(name, length, capacity);
+		channel->next = channels;
+		channels = channel;
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	return channel;
+}
+
+const char *channel_name(struct channel *channel)
+{
+	return channel->name;
+}
+
+/**
+ * NOTE: Must only be called once no VM uses channels anymore.
+ */
+void free_channels(void)
+{
+	struct channel *channel;
+
+	pthread_mutex_lock(&registry_lock);
+	while (channels != NULL) {
+		channel = channels;
+		channels = channel->next;
+		for (; channel->count > 0; channel->count--) {
+			free_message(&channel->messages[channel->head]);
+			channel->head = (channel->head + 1) % channel->size;
+		}
+		pthread_cond_destroy(&channel->not_full);
+		pthread_cond_destroy(&channel->not_empty);
+		pthread_mutex_destroy(&channel->lock);
+		free(channel->messages);
+		free(channel->name);
+		free(channel);
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/**
+ * pack_message() - Detach @value from the heap of its VM.
+ *
+ * Return: false if @value can't be sent, which is the case for every
+ * object but strings.
+ */
+bool pack_message(value_t value, struct message *message)
+{
+	struct object_string *str;
+
+	message->value = value;
+	message->characters = NULL;
+	if (!IS_OBJECT(value))
+		return true;
+	if (!IS_STRING(value))
+		return false;
+
+	str = AS_OBJ_STRING(value);
+	message->characters = malloc(str->length + 1);
+	if (message->characters == NULL)
+		exit(1);
+	memcpy(message->characters, str->characters, str->length + 1);
+	message->length = str->length;
+	message->hash = str->hash;
+	return true;
+}
+
+/**
+ * unpack_message() - Turn @message into a value of @vm.
+ *
+ * The hash computed by the sender is reused, so a string that is already
+ * interned in @vm costs a single lookup, and the characters of a new one
+ * are handed to @vm without another copy.
+ */
+value_t unpack_message(struct vm *vm, struct message *message)
+{
+	struct object_string *str;
+
+	if (message->characters == NULL)
+		return message->value;
+
+	str = adopt_string(vm, message->characters, message->length,
+			   message->hash);
+	message->characters = NULL;
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	return CONS_OBJECT(str);
+#pragma clang diagnostic pop
+}
+
+void free_message(struct message *message)
+{
+	free(message->characters);
+	message->characters = NULL;
+}
+
+static void grow_messages(struct channel *channel)
+{
+	struct message *messages =
+		malloc(sizeof(struct message) * channel->size * 2);
+	int32_t i;
+
+	if (messages == NULL)
+		exit(1);
+	for (i = 0; i < channel->count; i++)
+		messages[i] = channel->messages[(channel->head + i) %
+						channel->size];
+	free(channel->messages);
+	channel->messages = messages;
+	channel->size *= 2;
+	channel->head = 0;
+}
+
+/**
+ * channel_send() - Queue @message on @channel.
+ *
+ * Blocks while a bounded channel is full, which throttles producers to the
+ * pace of their consumers. The channel owns @message afterwards.
+ *
+ * Return: false if the channel is closed, @message is left untouched then.
+ */
+bool channel_send(struct channel *channel, struct message *message)
+{
+	pthread_mutex_lock(&channel->lock);
+	while (channel->capacity != CHANNEL_UNBOUNDED &&
+	       channel->count == channel->capacity && !channel->closed)
+		pthread_cond_wait(&channel->not_full, &channel->lock);
+	if (channel->closed) {
+		pthread_mutex_unlock(&channel->lock);
+		return false;
+	}
+
+	if (channel->count == channel->size)
+		grow_messages(channel);
+	channel->messages[(channel->head + channel->count) % channel->size] =
+		*message;
+	channel->count++;
+	pthread_cond_signal(&channel->not_empty);
+	pthread_mutex_unlock(&channel->lock);
+	return true;
+}
+
+/**
+ * channel_receive() - Take the oldest message from @channel.
+ *
+ * Blocks while the channel is empty and open, the thread can't run other
+ * scripts meanwhile.
+ *
+ * Return: false once the channel is closed and drained.
+ */
+bool channel_receive(struct channel *channel, struct message *message)
+{
+	pthread_mutex_lock(&channel->lock);
+	while (channel->count == 0 && !channel->closed)
+		pthread_cond_wait(&channel->not_empty, &channel->lock);
+	if (channel->count == 0) {
+		pthread_mutex_unlock(&channel->lock);
+		return false;
+	}
+
+	*message = channel->messages[channel->head];
+	channel->head = (channel->head + 1) % channel->size;
+	channel->count--;
+	pthread_cond_signal(&channel->not_full);
+	pthread_mutex_unlock(&channel->lock);
+	return true;
+}
+
+/**
+ * close_channel() - Refuse further messages and wake up every waiter.
+ *
+ * Messages already queued can still be received.
+ */
+void close_channel(struct channel *channel)
+{
+	pthread_mutex_lock(&channel->lock);
+	channel->closed = true;
+	pthread_cond_broadcast(&channel->not_empty);
+	pthread_cond_broadcast(&channel->not_full);
+	pthread_mutex_unlock(&channel->lock);
+}
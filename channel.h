@@ -0,0 +1,37 @@
+#ifndef clox_channel_h
+#define clox_channel_h
+
+#include "common.h"
+#include "value.h"
+
+#define CHANNEL_UNBOUNDED 0
+
+/*
+ * A message holds a value detached from the heap of any VM so it can move
+ * between isolates. Numbers, booleans and nil are stored in @value, strings
+ * carry their characters together with their hash.
+ */
+struct message {
+	value_t value;
+	char *characters;
+	int32_t length;
+	uint32_t hash;
+};
+
+struct vm;
+struct channel;
+
+struct channel *open_channel(const char *name, int32_t length,
+			     int32_t capacity);
+const char *channel_name(struct channel *channel);
+void free_channels(void);
+
+bool pack_message(value_t value, struct message *message);
+value_t unpack_message(struct vm *vm, struct message *message);
+void free_message(struct message *message);
+
+bool channel_send(struct channel *channel, struct message *message);
+bool channel_receive(struct channel *channel, struct message *message);
+void close_channel(struct channel *channel);
+
+#endif
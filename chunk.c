@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -17,7 +18,8 @@ void init_line_array(struct line_array *line_array)
 /**
  * NOTE: The @line_array must be properly initialized before calling this function.
  */
-void write_line_array(struct line_array *line_array, int32_t line)
+void write_line_array(struct vm *vm, struct line_array *line_array,
+		      int32_t line)
 {
 	int32_t len = line_array->length, old_capacity;
 
@@ -29,9 +31,10 @@ void write_line_array(struct line_array *line_array, int32_t line)
 	if (line_array->capacity < len + 1) {
 		old_capacity = line_array->capacity;
 		line_array->capacity = GROW_CAPACITY(old_capacity);
-		line_array->lines = GROW_ARRAY(struct line_info,
-					       line_array->lines, old_capacity,
-					       line_array->capacity);
+		line_array->lines =
+			GROW_ARRAY(vm, MEMORY_LINES, struct line_info,
+				   line_array->lines, old_capacity,
+				   line_array->capacity);
 	}
 
 	line_array->lines[len] = (struct line_info){ .line = line, .run = 1 };
@@ -53,9 +56,10 @@ int32_t read_line(struct line_array *line_array, int32_t instruction)
 	return -1;
 }
 
-void free_line_array(struct line_array *line_array)
+void free_line_array(struct vm *vm, struct line_array *line_array)
 {
-	FREE_ARRAY(struct line_info, line_array->lines, line_array->capacity);
+	FREE_ARRAY(vm, MEMORY_LINES, struct line_info, line_array->lines,
+		   line_array->capacity);
 	init_line_array(line_array);
 }
 
@@ -69,36 +73,78 @@ void init_chunk(struct chunk *chunk)
 	chunk->code = NULL;
 	init_line_array(&chunk->lines);
 	init_value_array(&chunk->constants);
+	chunk->sites = NULL;
+	chunk->site_count = 0;
+	chunk->site_capacity = 0;
+	chunk->calls = NULL;
+	chunk->call_count = 0;
+	chunk->call_capacity = 0;
+#ifdef PROFILE_EXECUTION
+	chunk->exec_counts = NULL;
+	chunk->exec_cycles = NULL;
+#endif
 }
 
 /**
  * NOTE: The @chunk must be properly initialized before calling this function.
  */
-void write_chunk(struct chunk *chunk, uint8_t byte, int32_t line)
+void write_chunk(struct vm *vm, struct chunk *chunk, uint8_t byte,
+		 int32_t line)
 {
 	int32_t old_capacity;
 
 	if (chunk->capacity < chunk->length + 1) {
 		old_capacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(old_capacity);
-		chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity,
-					 chunk->capacity);
+		chunk->code = GROW_ARRAY(vm, MEMORY_CODE, uint8_t, chunk->code,
+					 old_capacity, chunk->capacity);
 	}
 
 	chunk->code[chunk->length] = byte;
 	chunk->length++;
 
-	write_line_array(&chunk->lines, line);
+	write_line_array(vm, &chunk->lines, line);
 }
 
-int32_t add_constant(struct chunk *chunk, value_t value)
+/**
+ * delete_code() - Remove @length bytes of code from offset @start on, with
+ * their lines.
+ *
+ * The compiler uses this to replace code it has just emitted. Jumps over
+ * the removed code must not have been patched yet, the constants the code
+ * referenced stay in the table.
+ */
+void delete_code(struct chunk *chunk, int32_t start, int32_t length)
+{
+	struct line_array *lines = &chunk->lines;
+	int32_t end = start + length, offset = 0, first, last, i, kept = 0;
+
+	memmove(chunk->code + start, chunk->code + end, chunk->length - end);
+	chunk->length -= length;
+
+	for (i = 0; i < lines->length; i++) {
+		first = offset > start ? offset : start;
+		last = offset + lines->lines[i].run < end ?
+			       offset + lines->lines[i].run :
+			       end;
+		offset += lines->lines[i].run;
+		if (last > first)
+			lines->lines[i].run -= last - first;
+		if (lines->lines[i].run > 0)
+			lines->lines[kept++] = lines->lines[i];
+	}
+	lines->length = kept;
+}
+
+int32_t add_constant(struct vm *vm, struct chunk *chunk, value_t value)
 {
-	write_value_array(&chunk->constants, value);
+	write_value_array(vm, &chunk->constants, value);
 	return chunk->constants.length - 1;
 }
 
 /**
  * write_constant() - Write constant to a chunk with appropriate opcode.
+ * @vm: VM owning the chunk.
  * @chunk: Pointer to the chunk where the constant to be written.
  * @opcode: Opcode which will be used to reference the constant.
  * @value: Constant to be written.
@@ -113,31 +159,84 @@ int32_t add_constant(struct chunk *chunk, value_t value)
  *
  * NOTE: @opcode must be OP_CONSTANT or OP_CLOSURE.
  */
-void write_constant(struct chunk *chunk, uint8_t opcode, value_t value,
-		    int32_t line)
+void write_constant(struct vm *vm, struct chunk *chunk, uint8_t opcode,
+		    value_t value, int32_t line)
 {
 	int32_t constant;
 
-	constant = add_constant(chunk, value);
+	constant = add_constant(vm, chunk, value);
 	if (constant < (1 << 8)) {
-		write_chunk(chunk, opcode, line);
-		write_chunk(chunk, constant, line);
+		write_chunk(vm, chunk, opcode, line);
+		write_chunk(vm, chunk, constant, line);
 	} else if (constant < (1 << 24)) {
-		write_chunk(chunk, opcode + 1, line);
+		write_chunk(vm, chunk, opcode + 1, line);
 		// Big endian
-		write_chunk(chunk, (constant >> 16) & 0xFF, line);
-		write_chunk(chunk, (constant >> 8) & 0xFF, line);
-		write_chunk(chunk, constant & 0xFF, line);
+		write_chunk(vm, chunk, (constant >> 16) & 0xFF, line);
+		write_chunk(vm, chunk, (constant >> 8) & 0xFF, line);
+		write_chunk(vm, chunk, constant & 0xFF, line);
 	} else {
 		printf("Too many constants.");
 		exit(1);
 	}
 }
 
-void free_chunk(struct chunk *chunk)
+/**
+ * add_property_site() - Add an empty inline cache for an access to the
+ * property @name.
+ *
+ * Return: The index of the site.
+ */
+int32_t add_property_site(struct vm *vm, struct chunk *chunk,
+			  struct object_string *name)
+{
+	int32_t old_capacity;
+
+	if (chunk->site_capacity < chunk->site_count + 1) {
+		old_capacity = chunk->site_capacity;
+		chunk->site_capacity = GROW_CAPACITY(old_capacity);
+		chunk->sites = GROW_ARRAY(vm, MEMORY_CODE,
+					  struct property_site, chunk->sites,
+					  old_capacity, chunk->site_capacity);
+	}
+	chunk->sites[chunk->site_count].name = name;
+	chunk->sites[chunk->site_count].count = 0;
+	return chunk->site_count++;
+}
+
+/**
+ * add_call_site() - Add an empty inline cache for a call.
+ *
+ * Return: The index of the site.
+ */
+int32_t add_call_site(struct vm *vm, struct chunk *chunk)
+{
+	int32_t old_capacity;
+
+	if (chunk->call_capacity < chunk->call_count + 1) {
+		old_capacity = chunk->call_capacity;
+		chunk->call_capacity = GROW_CAPACITY(old_capacity);
+		chunk->calls = GROW_ARRAY(vm, MEMORY_CODE, struct call_site,
+					  chunk->calls, old_capacity,
+					  chunk->call_capacity);
+	}
+	chunk->calls[chunk->call_count].function = NULL;
+	chunk->calls[chunk->call_count].native = NULL;
+	return chunk->call_count++;
+}
+
+void free_chunk(struct vm *vm, struct chunk *chunk)
 {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	free_value_array(&chunk->constants);
-	free_line_array(&chunk->lines);
+	FREE_ARRAY(vm, MEMORY_CODE, uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY(vm, MEMORY_CODE, struct property_site, chunk->sites,
+		   chunk->site_capacity);
+	FREE_ARRAY(vm, MEMORY_CODE, struct call_site, chunk->calls,
+		   chunk->call_capacity);
+	free_value_array(vm, &chunk->constants);
+	free_line_array(vm, &chunk->lines);
+#ifdef PROFILE_EXECUTION
+	// Profiler counters are not VM memory, see profile.c
+	free(chunk->exec_counts);
+	free(chunk->exec_cycles);
+#endif
 	init_chunk(chunk);
 }
@@ -22,6 +22,8 @@ enum op_code {
 	OP_PRINT,
 	OP_POP,
 	OP_POPN,
+	OP_PICK,
+	OP_NIP,
 	OP_DEFINE_GLOBAL,
 	OP_DEFINE_GLOBAL_LONG,
 	OP_GET_GLOBAL,
@@ -34,12 +36,25 @@ enum op_code {
 	OP_JUMP,
 	OP_LOOP,
 	OP_CALL,
+	OP_CALL_CURRIED,
 	OP_CLOSURE,
 	OP_CLOSURE_LONG,
 	OP_GET_UPVALUE,
 	OP_SET_UPVALUE,
 	OP_CLOSE_UPVALUE,
 	OP_RETURN,
+	OP_YIELD,
+	OP_ARRAY,
+	OP_GET_INDEX,
+	OP_SET_INDEX,
+	OP_CLASS,
+	OP_METHOD,
+	OP_INHERIT,
+	OP_GET_PROPERTY,
+	OP_SET_PROPERTY,
+	OP_GET_SUPER,
+	OP_INVOKE,
+	OP_SUPER_INVOKE,
 };
 
 struct line_info {
@@ -53,10 +68,54 @@ struct line_array {
 	struct line_info *lines;
 };
 
+#define PROPERTY_CACHE_SIZE 4
+
+struct shape;
+struct object_closure;
+struct object_string;
+
+/*
+ * What a property access found on instances of @shape: the field at @slot,
+ * or @method if @slot is -1. A store that had to add the field records the
+ * shape the instance moves to as @transition.
+ */
+struct property_cache_entry {
+	struct shape *shape;
+	struct shape *transition;
+	int32_t slot;
+	struct object_closure *method;
+};
+
+/*
+ * The inline cache of one property access in the code. It caches the
+ * first PROPERTY_CACHE_SIZE shapes the access sees, a site that sees more
+ * is megamorphic and looks up every further shape again.
+ */
+struct property_site {
+	struct object_string *name;
+	int32_t count;
+	struct property_cache_entry entries[PROPERTY_CACHE_SIZE];
+};
+
+struct object;
+struct object_function;
+
+/*
+ * The inline cache of one call in the code: the function of the closure or
+ * the native it called last, NULL for any other callee.
+ */
+struct call_site {
+	struct object_function *function;
+	struct object *native;
+};
+
+struct vm;
+
 void init_line_array(struct line_array *line_array);
-void write_line_array(struct line_array *line_array, int32_t line);
+void write_line_array(struct vm *vm, struct line_array *line_array,
+		      int32_t line);
 int32_t read_line(struct line_array *line_array, int32_t instruction);
-void free_line_array(struct line_array *line_array);
+void free_line_array(struct vm *vm, struct line_array *line_array);
 
 struct chunk {
 	int32_t length;
@@ -64,13 +123,29 @@ struct chunk {
 	uint8_t *code;
 	struct line_array lines;
 	struct value_array constants;
+	struct property_site *sites;
+	int32_t site_count;
+	int32_t site_capacity;
+	struct call_site *calls;
+	int32_t call_count;
+	int32_t call_capacity;
+#ifdef PROFILE_EXECUTION
+	// Per-offset execution counters, allocated on first execution
+	uint64_t *exec_counts;
+	uint64_t *exec_cycles;
+#endif
 };
 
 void init_chunk(struct chunk *chunk);
-void write_chunk(struct chunk *chunk, uint8_t byte, int32_t line);
-int32_t add_constant(struct chunk *chunk, value_t value);
-void write_constant(struct chunk *chunk, uint8_t opcode, value_t value,
-		    int32_t line);
-void free_chunk(struct chunk *chunk);
+void write_chunk(struct vm *vm, struct chunk *chunk, uint8_t byte,
+		 int32_t line);
+void delete_code(struct chunk *chunk, int32_t start, int32_t length);
+int32_t add_constant(struct vm *vm, struct chunk *chunk, value_t value);
+void write_constant(struct vm *vm, struct chunk *chunk, uint8_t opcode,
+		    value_t value, int32_t line);
+int32_t add_property_site(struct vm *vm, struct chunk *chunk,
+			  struct object_string *name);
+int32_t add_call_site(struct vm *vm, struct chunk *chunk);
+void free_chunk(struct vm *vm, struct chunk *chunk);
 
 #endif
@@ -4,10 +4,14 @@
 //#define DEBUG_TRACE_EXECUTION
 //#define DEBUG_DUMP_CODE
 //#define DEBUG_CONST_TABLE_EXTRA
+//#define PROFILE_EXECUTION
 
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
 
+// Lays out the hot path of a branch the compiler can't tell apart
+#define likely(x) __builtin_expect(!!(x), 1)
+
 #endif
@@ -1,4 +1,5 @@
 #include <_stdio.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -6,6 +7,7 @@
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
 #include "object.h"
 #include "scanner.h"
 #include "value.h"
@@ -14,9 +16,57 @@
 #endif
 
 // parser utility
+struct compiler;
+struct class_compiler;
+
+/*
+ * The load of a let function found by the prefix rule that just ran: the
+ * code from @start to @end of the function being compiled by @compiler.
+ */
+struct inline_callee {
+	struct compiler *compiler;
+	struct object_function *function;
+	int32_t start;
+	int32_t end;
+};
+
+/*
+ * The tokens of the curried part of a function, see uncurry(). Scanned
+ * tokens are appended while @recording is positive, while @replaying they
+ * are read back from @position on instead. @failed is set by errors in a
+ * replay, which are not reported.
+ */
+struct token_tape {
+	struct token *tokens;
+	int32_t length;
+	int32_t capacity;
+	int32_t recording;
+	int32_t position;
+	bool replaying;
+	bool failed;
+};
+
+/*
+ * All state of one compilation. Nested function declarations push a new
+ * struct compiler onto @compiler, so a parser can be used by one thread
+ * while other threads compile other sources into other VMs.
+ *
+ * @constants collects the let globals of this source like vm->constants,
+ * they are only added to the VM's once the source compiled. @operand_start
+ * is the offset of the code of the left operand while an infix rule runs.
+ * @callee is the last load of a let function that a call may inline.
+ */
 struct parser {
+	struct vm *vm;
+	struct scanner *scanner;
+	struct compiler *compiler;
+	struct class_compiler *class_compiler;
+	struct table constants;
 	struct token previous;
 	struct token current;
+	int32_t operand_start;
+	struct inline_callee callee;
+	struct token_tape tape;
 	bool had_error;
 	bool panic_mode;
 };
@@ -33,12 +83,12 @@ enum precedence {
 	PREC_TERM,			// + -
 	PREC_FACTOR,			// * /
 	PREC_UNARY,			// - !
-	PREC_CALL,			// . ()
+	PREC_CALL,			// . () []
 	PREC_PRIMARY,
 };
 // clang-format on
 
-typedef void (*parse_fn_t)(bool can_assign);
+typedef void (*parse_fn_t)(struct parser *parser, bool can_assign);
 
 struct parse_rule {
 	parse_fn_t prefix;
@@ -46,80 +96,116 @@ struct parse_rule {
 	enum precedence precedence;
 };
 
-struct parser parser;
-
-static void error_at(struct token *token, const char *message)
+static void error_at(struct parser *parser, struct token *token,
+		     const char *message)
 {
-	if (parser.panic_mode)
+	if (parser->tape.replaying) {
+		parser->tape.failed = true;
+		return;
+	}
+	if (parser->panic_mode)
 		return;
 
-	parser.panic_mode = true;
+	parser->panic_mode = true;
 
-	fprintf(stderr, "[line %d] Error", token->line);
+	fprintf(parser->vm->err, "[line %d] Error", token->line);
 
 	if (token->token_type == TOKEN_EOF)
-		fprintf(stderr, " at end");
+		fprintf(parser->vm->err, " at end");
 	else if (token->token_type != TOKEN_ERROR)
-		fprintf(stderr, " at '%.*s'", token->length, token->start);
+		fprintf(parser->vm->err, " at '%.*s'", token->length,
+			token->start);
 
-	fprintf(stderr, ": %s\n", message);
-	parser.had_error = true;
+	fprintf(parser->vm->err, ": %s\n", message);
+	parser->had_error = true;
 }
 
-static void error(const char *message)
+static void error(struct parser *parser, const char *message)
 {
-	error_at(&parser.previous, message);
+	error_at(parser, &parser->previous, message);
 }
 
-static void error_at_current(const char *message)
+static void error_at_current(struct parser *parser, const char *message)
 {
-	error_at(&parser.current, message);
+	error_at(parser, &parser->current, message);
 }
 
-static void advance(void)
+static void record_token(struct parser *parser, struct token token)
 {
-	parser.previous = parser.current;
+	struct token_tape *tape = &parser->tape;
+	int32_t old_capacity;
+
+	if (tape->length == tape->capacity) {
+		old_capacity = tape->capacity;
+		tape->capacity = GROW_CAPACITY(old_capacity);
+		tape->tokens = GROW_ARRAY(parser->vm, MEMORY_CODE, struct token,
+					  tape->tokens, old_capacity,
+					  tape->capacity);
+	}
+	tape->tokens[tape->length++] = token;
+}
+
+static void advance(struct parser *parser)
+{
+	struct token_tape *tape = &parser->tape;
+
+	parser->previous = parser->current;
+
+	if (tape->replaying) {
+		// A replay that parses differently ends at the end of the tape
+		if (tape->position < tape->length) {
+			parser->current = tape->tokens[tape->position++];
+		} else {
+			tape->failed = true;
+			parser->current.token_type = TOKEN_EOF;
+		}
+		return;
+	}
 
 	for (;;) {
-		parser.current = scan_token();
-		if (parser.current.token_type != TOKEN_ERROR)
+		parser->current = scan_token(parser->scanner);
+		if (parser->current.token_type != TOKEN_ERROR)
 			break;
 
-		error_at_current(parser.current.start);
+		error_at_current(parser, parser->current.start);
 	}
+	if (tape->recording > 0)
+		record_token(parser, parser->current);
 }
 
-static void consume(enum token_type token_type, const char *message)
+static void consume(struct parser *parser, enum token_type token_type,
+		    const char *message)
 {
-	if (parser.current.token_type != token_type)
-		error_at_current(message);
+	if (parser->current.token_type != token_type)
+		error_at_current(parser, message);
 
-	advance();
+	advance(parser);
 }
 
-static bool check(enum token_type token_type)
+static bool check(struct parser *parser, enum token_type token_type)
 {
-	return parser.current.token_type == token_type;
+	return parser->current.token_type == token_type;
 }
 
-static bool match(enum token_type token_type)
+static bool match(struct parser *parser, enum token_type token_type)
 {
-	if (!check(token_type))
+	if (!check(parser, token_type))
 		return false;
-	advance();
+	advance(parser);
 	return true;
 }
 
-static void synchronize(void)
+static void synchronize(struct parser *parser)
 {
-	parser.panic_mode = false;
+	parser->panic_mode = false;
 
-	while (parser.current.token_type != TOKEN_EOF) {
-		if (parser.previous.token_type == TOKEN_SEMICOLON)
+	while (parser->current.token_type != TOKEN_EOF) {
+		if (parser->previous.token_type == TOKEN_SEMICOLON)
 			return;
-		switch (parser.current.token_type) {
+		switch (parser->current.token_type) {
 		case TOKEN_CLASS: /* fall through */
 		case TOKEN_FUN: /* fall through */
+		case TOKEN_LET: /* fall through */
 		case TOKEN_VAR: /* fall through */
 		case TOKEN_FOR: /* fall through */
 		case TOKEN_IF: /* fall through */
@@ -128,15 +214,21 @@ static void synchronize(void)
 		case TOKEN_RETURN: /* fall through */
 			return;
 		default:
-			advance();
+			advance(parser);
 		}
 	}
 }
 
+/*
+ * A local bound with let is @is_constant, @value is its value if the
+ * compiler knew it and nil otherwise.
+ */
 struct local {
 	struct token name;
 	int depth;
 	bool is_captured;
+	bool is_constant;
+	value_t value;
 };
 
 struct upvalue {
@@ -148,6 +240,8 @@ enum function_type {
 	TYPE_FUNCTION,
 	TYPE_SCRIPT,
 	TYPE_LAMBDA,
+	TYPE_METHOD,
+	TYPE_INITIALIZER,
 };
 
 struct compiler {
@@ -160,152 +254,264 @@ struct compiler {
 	int scope_depth;
 };
 
-struct compiler *current = NULL;
-uint32_t lambda_count = 0;
+struct class_compiler {
+	struct class_compiler *enclosing;
+	bool has_superclass;
+};
 
-static void init_compiler(struct compiler *compiler, enum function_type type)
+static void init_compiler(struct parser *parser, struct compiler *compiler,
+			  enum function_type type)
 {
 	struct local *local;
 
-	compiler->enclosing = current;
+	compiler->enclosing = parser->compiler;
 	compiler->function = NULL;
 	compiler->type = type;
 	compiler->local_count = 0;
 	compiler->scope_depth = 0;
-	compiler->function = new_function();
-	current = compiler;
+	compiler->function = new_function(parser->vm);
+	parser->compiler = compiler;
 	if (type == TYPE_LAMBDA) {
 		char *name_buf;
 		const int32_t len =
-			asprintf(&name_buf, "lambda %d", ++lambda_count);
-		current->function->name = take_string(name_buf, len);
+			asprintf(&name_buf, "lambda %d",
+				 ++parser->vm->lambda_count);
+		compiler->function->name = copy_string(parser->vm, name_buf,
+						       len);
+		free(name_buf);
 	} else if (type != TYPE_SCRIPT) {
-		current->function->name = copy_string(parser.previous.start,
-						      parser.previous.length);
+		compiler->function->name = copy_string(parser->vm,
+						       parser->previous.start,
+						       parser->previous.length);
 	}
 
-	local = &current->locals[current->local_count++];
+	// Slot zero holds the receiver in methods and the callee otherwise
+	local = &compiler->locals[compiler->local_count++];
 	local->depth = 0;
-	local->name.length = 0;
-	local->name.start = "";
+	if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+		local->name.length = 4;
+		local->name.start = "this";
+	} else {
+		local->name.length = 0;
+		local->name.start = "";
+	}
 	local->is_captured = false;
+	local->is_constant = false;
+	local->value = CONS_NIL;
 }
 
 // byte emit helpers
-static struct chunk *current_chunk(void)
+static struct chunk *current_chunk(struct parser *parser)
+{
+	return &parser->compiler->function->chunk;
+}
+
+static void emit_byte(struct parser *parser, uint8_t byte)
 {
-	return &current->function->chunk;
+	write_chunk(parser->vm, current_chunk(parser), byte,
+		    parser->previous.line);
 }
 
-static void emit_byte(uint8_t byte)
+static void emit_bytes(struct parser *parser, uint8_t byte1, uint8_t byte2)
 {
-	write_chunk(current_chunk(), byte, parser.previous.line);
+	emit_byte(parser, byte1);
+	emit_byte(parser, byte2);
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2)
+static void emit_constant(struct parser *parser, value_t value)
 {
-	emit_byte(byte1);
-	emit_byte(byte2);
+	write_constant(parser->vm, current_chunk(parser), OP_CONSTANT, value,
+		       parser->previous.line);
 }
 
-static void emit_constant(value_t value)
+/**
+ * emit_value() - Emit the load of a value known at compile time.
+ */
+static void emit_value(struct parser *parser, value_t value)
 {
-	write_constant(current_chunk(), OP_CONSTANT, value,
-		       parser.previous.line);
+	if (IS_NIL(value))
+		emit_byte(parser, OP_NIL);
+	else if (IS_BOOLEAN(value))
+		emit_byte(parser, AS_BOOLEAN(value) ? OP_TRUE : OP_FALSE);
+	else
+		emit_constant(parser, value);
 }
 
-static void emit_closure(value_t value)
+/**
+ * constant_value() - Find out if the code from offset @start on is the
+ * load of a value known at compile time.
+ * @value: Receives the value.
+ *
+ * Return: false if it is any other code.
+ */
+static bool constant_value(struct parser *parser, int32_t start,
+			   value_t *value)
 {
-	write_constant(current_chunk(), OP_CLOSURE, value,
-		       parser.previous.line);
+	struct chunk *chunk = current_chunk(parser);
+	uint8_t *code = chunk->code + start;
+
+	switch (chunk->length - start) {
+	case 1:
+		if (code[0] == OP_NIL)
+			*value = CONS_NIL;
+		else if (code[0] == OP_TRUE || code[0] == OP_FALSE)
+			*value = CONS_BOOLEAN(code[0] == OP_TRUE);
+		else
+			return false;
+		return true;
+	case 2:
+		if (code[0] != OP_CONSTANT)
+			return false;
+		*value = chunk->constants.values[code[1]];
+		return true;
+	case 4:
+		if (code[0] != OP_CONSTANT_LONG)
+			return false;
+		*value = chunk->constants.values[(code[1] << 16) |
+						 (code[2] << 8) | code[3]];
+		return true;
+	default:
+		return false;
+	}
 }
 
-static void emit_return(void)
+/**
+ * discard_load() - Drop the load of a constant at offset @start, which is
+ * the last code emitted.
+ *
+ * The constant is dropped as well if it was the last one added, which is
+ * the case for literals.
+ */
+static void discard_load(struct parser *parser, int32_t start)
 {
-	emit_byte(OP_NIL);
-	emit_byte(OP_RETURN);
+	struct chunk *chunk = current_chunk(parser);
+	uint8_t *code = chunk->code + start;
+	int32_t constant = -1;
+
+	if (code[0] == OP_CONSTANT)
+		constant = code[1];
+	else if (code[0] == OP_CONSTANT_LONG)
+		constant = (code[1] << 16) | (code[2] << 8) | code[3];
+	if (constant != -1 && constant == chunk->constants.length - 1)
+		chunk->constants.length--;
+	delete_code(chunk, start, chunk->length - start);
 }
 
-static uint32_t emit_jump(uint8_t jump)
+static void emit_closure(struct parser *parser, value_t value)
 {
-	emit_byte(jump);
-	emit_bytes(0xff, 0xff);
-	return current_chunk()->length - 2;
+	write_constant(parser->vm, current_chunk(parser), OP_CLOSURE, value,
+		       parser->previous.line);
 }
 
-static void emit_loop(uint32_t loop_start)
+static void emit_return(struct parser *parser)
+{
+	if (parser->compiler->type == TYPE_INITIALIZER)
+		emit_bytes(parser, OP_GET_LOCAL, 0);
+	else
+		emit_byte(parser, OP_NIL);
+	emit_byte(parser, OP_RETURN);
+}
+
+/**
+ * emit_long_operand() - Emit @op with a 24-bit constant index.
+ *
+ * Used by instructions that run once per definition, where a single form
+ * is simpler than a short and a long one.
+ */
+static void emit_long_operand(struct parser *parser, uint8_t op,
+			      uint32_t constant)
+{
+	if (constant >= 1 << 24) {
+		error(parser, "Too many constants in one chunk.");
+		return;
+	}
+	emit_byte(parser, op);
+	emit_bytes(parser, (uint8_t)(constant >> 16), (uint8_t)(constant >> 8));
+	emit_byte(parser, (uint8_t)constant);
+}
+
+static uint32_t emit_jump(struct parser *parser, uint8_t jump)
+{
+	emit_byte(parser, jump);
+	emit_bytes(parser, 0xff, 0xff);
+	return current_chunk(parser)->length - 2;
+}
+
+static void emit_loop(struct parser *parser, uint32_t loop_start)
 {
 	int32_t offset;
 
-	emit_byte(OP_LOOP);
+	emit_byte(parser, OP_LOOP);
 
-	offset = current_chunk()->length - loop_start + 2;
+	offset = current_chunk(parser)->length - loop_start + 2;
 	if (offset > UINT16_MAX)
-		error("Loop body too large.");
-	emit_bytes((offset >> 8) & 0xff, offset & 0xff);
+		error(parser, "Loop body too large.");
+	emit_bytes(parser, (offset >> 8) & 0xff, offset & 0xff);
 }
 
 // compiler utilities
-static void begin_scope(void)
+static void begin_scope(struct parser *parser)
 {
-	current->scope_depth++;
+	parser->compiler->scope_depth++;
 }
 
-static void end_scope(void)
+static void end_scope(struct parser *parser)
 {
+	struct compiler *current = parser->compiler;
+
 	current->scope_depth--;
 
 	while (current->local_count > 0 &&
 	       current->locals[current->local_count - 1].depth >
 		       current->scope_depth) {
 		if (current->locals[current->local_count - 1].is_captured)
-			emit_byte(OP_CLOSE_UPVALUE);
+			emit_byte(parser, OP_CLOSE_UPVALUE);
 		else
-			emit_byte(OP_POP);
+			emit_byte(parser, OP_POP);
 		current->local_count--;
 	}
 }
 
-static struct object_function *end_compiler(void)
+static struct object_function *end_compiler(struct parser *parser)
 {
 	struct object_function *function;
 
-	emit_return();
-	function = current->function;
+	emit_return(parser);
+	function = parser->compiler->function;
 
 #ifdef DEBUG_DUMP_CODE
-	if (!parser.had_error)
-		disassemble_chunk(current_chunk(),
+	if (!parser->had_error)
+		disassemble_chunk(current_chunk(parser),
 				  function->name != NULL ?
 					  function->name->characters :
 					  "<script>");
 #endif
 
-	current = current->enclosing;
+	parser->compiler = parser->compiler->enclosing;
 
 	return function;
 }
 
 // clox grammar
-static void expression(void);
-static void statement(void);
-static void declaration(void);
+static void expression(struct parser *parser);
+static void statement(struct parser *parser);
+static void declaration(struct parser *parser);
 static struct parse_rule *get_rule(enum token_type token_type);
-static void parse_precedence(enum precedence precedence);
+static void parse_precedence(struct parser *parser, enum precedence precedence);
 
-static void literal(bool can_assign)
+static void literal(struct parser *parser, bool can_assign)
 {
-	enum token_type literal = parser.previous.token_type;
+	enum token_type literal = parser->previous.token_type;
 
 	switch (literal) {
 	case TOKEN_NIL:
-		emit_byte(OP_NIL);
+		emit_byte(parser, OP_NIL);
 		break;
 	case TOKEN_TRUE:
-		emit_byte(OP_TRUE);
+		emit_byte(parser, OP_TRUE);
 		break;
 	case TOKEN_FALSE:
-		emit_byte(OP_FALSE);
+		emit_byte(parser, OP_FALSE);
 		break;
 	default: // UNREACHABLE
 		fprintf(stderr, "Unknown literal %d\n", literal);
@@ -313,31 +519,39 @@ static void literal(bool can_assign)
 	}
 }
 
-static void number(bool can_assign)
+static void number(struct parser *parser, bool can_assign)
 {
-	double value = strtod(parser.previous.start, NULL);
-
-	emit_constant(CONS_NUMBER(value));
+	double value = parse_number(parser->previous.start,
+				    parser->previous.length);
+	bool fraction = memchr(parser->previous.start, '.',
+			       parser->previous.length) != NULL;
+
+	// Literals without a fraction start out as integers
+	if (!fraction && value <= INTEGER_MAX)
+		emit_constant(parser, CONS_INTEGER((int64_t)value));
+	else
+		emit_constant(parser, CONS_NUMBER(value));
 }
 
-static void string(bool can_assign)
+static void string(struct parser *parser, bool can_assign)
 {
-	struct object_string *str = copy_string(parser.previous.start + 1,
-						parser.previous.length - 2);
+	struct object_string *str = copy_string(parser->vm,
+						parser->previous.start + 1,
+						parser->previous.length - 2);
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wincompatible-pointer-types"
-	emit_constant(CONS_OBJECT(str));
+	emit_constant(parser, CONS_OBJECT(str));
 #pragma clang diagnostic pop
 }
 
-static uint32_t identifier_constant(struct token *token)
+static uint32_t identifier_constant(struct parser *parser, struct token *token)
 {
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wincompatible-pointer-types"
-	return add_constant(
-		current_chunk(),
-		CONS_OBJECT(copy_string(token->start, token->length)));
+	return add_constant(parser->vm, current_chunk(parser),
+			    CONS_OBJECT(copy_string(parser->vm, token->start,
+						    token->length)));
 #pragma clang diagnostic pop
 }
 
@@ -351,7 +565,8 @@ static bool identifiers_equal(struct token *name1, struct token *name2)
 #pragma clang diagnostic pop
 }
 
-static int32_t resolve_local(struct compiler *compiler, struct token *name)
+static int32_t resolve_local(struct parser *parser, struct compiler *compiler,
+			     struct token *name)
 {
 	struct local *local;
 	int32_t i;
@@ -360,7 +575,8 @@ static int32_t resolve_local(struct compiler *compiler, struct token *name)
 		local = &compiler->locals[i];
 		if (identifiers_equal(&local->name, name)) {
 			if (local->depth == -1)
-				error("Can't read local variable in its own initializer.");
+				error(parser,
+				      "Can't read local variable in its own initializer.");
 			else
 				return i;
 		}
@@ -369,8 +585,8 @@ static int32_t resolve_local(struct compiler *compiler, struct token *name)
 	return -1;
 }
 
-static int32_t add_upvalue(struct compiler *compiler, uint8_t index,
-			   bool is_local)
+static int32_t add_upvalue(struct parser *parser, struct compiler *compiler,
+			   uint8_t index, bool is_local)
 {
 	int32_t upvalue_count = compiler->function->upvalue_count, i;
 
@@ -381,7 +597,7 @@ static int32_t add_upvalue(struct compiler *compiler, uint8_t index,
 	}
 
 	if (compiler->function->upvalue_count == 256) {
-		error("Too many closure variables in a function.");
+		error(parser, "Too many closure variables in a function.");
 		return 0;
 	}
 
@@ -390,72 +606,116 @@ static int32_t add_upvalue(struct compiler *compiler, uint8_t index,
 	return compiler->function->upvalue_count++;
 }
 
-static int32_t resolve_upvalue(struct compiler *compiler, struct token *name)
+static int32_t resolve_upvalue(struct parser *parser, struct compiler *compiler,
+			       struct token *name)
 {
 	int32_t local;
 
 	if (compiler->enclosing == NULL)
 		return -1;
 
-	local = resolve_local(compiler->enclosing, name);
+	local = resolve_local(parser, compiler->enclosing, name);
 	if (local != -1) {
 		compiler->enclosing->locals[local].is_captured = true;
-		return add_upvalue(compiler, (uint8_t)local, true);
+		return add_upvalue(parser, compiler, (uint8_t)local, true);
 	}
 
-	local = resolve_upvalue(compiler->enclosing, name);
+	local = resolve_upvalue(parser, compiler->enclosing, name);
 	if (local != -1)
-		return add_upvalue(compiler, (uint8_t)local, false);
+		return add_upvalue(parser, compiler, (uint8_t)local, false);
 
 	return -1;
 }
 
-static void named_variable(struct token token, bool can_assign)
+static bool global_constant(struct parser *parser, struct token *name,
+			    value_t *value)
 {
+	struct object_string *str = copy_string(parser->vm, name->start,
+						name->length);
+
+	return table_get(&parser->constants, str, value) ||
+	       table_get(&parser->vm->constants, str, value);
+}
+
+/**
+ * find_constant() - Find out if @name is bound with let where it is used.
+ * @value: Receives the value of the binding, nil if it isn't known.
+ *
+ * The innermost local of any enclosing function named @name decides, the
+ * let globals are only looked at if there is none.
+ */
+static bool find_constant(struct parser *parser, struct token *name,
+			  value_t *value)
+{
+	struct compiler *compiler;
+	struct local *local;
+	int32_t i;
+
+	for (compiler = parser->compiler; compiler != NULL;
+	     compiler = compiler->enclosing) {
+		for (i = compiler->local_count - 1; i >= 0; i--) {
+			local = &compiler->locals[i];
+			if (identifiers_equal(&local->name, name)) {
+				*value = local->value;
+				return local->is_constant;
+			}
+		}
+	}
+
+	return global_constant(parser, name, value);
+}
+
+static void access_variable(struct parser *parser, struct token token,
+			    bool can_assign)
+{
+	int32_t arg;
+
 	// This fills the constant table with identical strings even for set
 	// expressions. They point to same string but some of these entries are
 	// still unnecessary.
-	int32_t arg = resolve_local(current, &token);
+	arg = resolve_local(parser, parser->compiler, &token);
 
 	if (arg != -1) {
-		if (can_assign && match(TOKEN_EQUAL)) {
-			expression();
-			emit_bytes(OP_SET_LOCAL, (uint8_t)arg);
+		if (can_assign && match(parser, TOKEN_EQUAL)) {
+			expression(parser);
+			emit_bytes(parser, OP_SET_LOCAL, (uint8_t)arg);
 		} else {
-			emit_bytes(OP_GET_LOCAL, (uint8_t)arg);
+			emit_bytes(parser, OP_GET_LOCAL, (uint8_t)arg);
 		}
 		return;
 	}
 
-	arg = resolve_upvalue(current, &token);
+	arg = resolve_upvalue(parser, parser->compiler, &token);
 
 	if (arg != -1) {
-		if (can_assign && match(TOKEN_EQUAL)) {
-			expression();
-			emit_bytes(OP_SET_UPVALUE, (uint8_t)arg);
+		if (can_assign && match(parser, TOKEN_EQUAL)) {
+			expression(parser);
+			emit_bytes(parser, OP_SET_UPVALUE, (uint8_t)arg);
 		} else {
-			emit_bytes(OP_GET_UPVALUE, (uint8_t)arg);
+			emit_bytes(parser, OP_GET_UPVALUE, (uint8_t)arg);
 		}
 		return;
 	}
 
-	arg = identifier_constant(&token);
+	arg = identifier_constant(parser, &token);
 
 	if (arg < 1 << 8) {
-		if (can_assign && match(TOKEN_EQUAL)) {
-			expression();
-			emit_bytes(OP_SET_GLOBAL, (uint8_t)arg);
+		if (can_assign && match(parser, TOKEN_EQUAL)) {
+			expression(parser);
+			emit_bytes(parser, OP_SET_GLOBAL, (uint8_t)arg);
 		} else {
-			emit_bytes(OP_GET_GLOBAL, (uint8_t)arg);
+			emit_bytes(parser, OP_GET_GLOBAL, (uint8_t)arg);
 		}
 	} else if (arg < 1 << 24) {
-		if (match(TOKEN_EQUAL)) {
-			expression();
-			emit_bytes(OP_SET_GLOBAL_LONG, (uint8_t)(arg >> 16));
-			emit_bytes((uint8_t)(arg >> 8), (uint8_t)arg);
+		if (match(parser, TOKEN_EQUAL)) {
+			expression(parser);
+			emit_bytes(parser, OP_SET_GLOBAL_LONG,
+				   (uint8_t)(arg >> 16));
+			emit_bytes(parser, (uint8_t)(arg >> 8), (uint8_t)arg);
 		} else {
-			emit_bytes(OP_GET_GLOBAL_LONG, (uint8_t)(arg >> 16));
-			emit_bytes((uint8_t)(arg >> 8), (uint8_t)arg);
+			emit_bytes(parser, OP_GET_GLOBAL_LONG,
+				   (uint8_t)(arg >> 16));
+			emit_bytes(parser, (uint8_t)(arg >> 8), (uint8_t)arg);
 		}
 	} else {
 		fprintf(stderr, "Too many arg variables.");
@@ -463,29 +723,174 @@ static void named_variable(struct token token, bool can_assign)
 	}
 }
 
-static void variable(bool can_assign)
+static void named_variable(struct parser *parser, struct token token,
+			   bool can_assign)
+{
+	struct inline_callee callee = { 0 };
+	value_t value;
+
+	if (find_constant(parser, &token, &value)) {
+		if (can_assign && match(parser, TOKEN_EQUAL)) {
+			error(parser, "Cannot assign to a constant.");
+			return;
+		}
+		if (IS_FUNCTION(value)) {
+			// Still loaded, a call right after may inline it
+			callee.compiler = parser->compiler;
+			callee.function = AS_OBJ_FUNCTION(value);
+			callee.start = current_chunk(parser)->length;
+		} else if (!IS_NIL(value)) {
+			// A constant with a known value needs no variable
+			// access
+			emit_value(parser, value);
+			return;
+		}
+	}
+
+	access_variable(parser, token, can_assign);
+	if (callee.function != NULL) {
+		callee.end = current_chunk(parser)->length;
+		parser->callee = callee;
+	}
+}
+
+static void variable(struct parser *parser, bool can_assign)
 {
-	named_variable(parser.previous, can_assign);
+	named_variable(parser, parser->previous, can_assign);
 }
 
-static void grouping(bool can_assign)
+static void grouping(struct parser *parser, bool can_assign)
 {
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expected ')' after expression.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after expression.");
 }
 
-static void unary(bool can_assign)
+/**
+ * fold_number() - Box the folded result of integer or double arithmetic.
+ * @integers: Whether the operands were integers.
+ *
+ * The VM keeps results of integer arithmetic integers where they are exact
+ * and not -0, so does the compiler.
+ */
+static value_t fold_number(double result, bool integers)
 {
-	enum token_type operator = parser.previous.token_type;
+	if (integers && result >= INTEGER_MIN && result <= INTEGER_MAX &&
+	    result == (int64_t)result && !(result == 0 && signbit(result)))
+		return CONS_INTEGER((int64_t)result);
+	return CONS_NUMBER(result);
+}
+
+static struct object_string *fold_concatenate(struct parser *parser,
+					      struct object_string *a,
+					      struct object_string *b)
+{
+	int32_t length = a->length + b->length;
+	char *buffer = ALLOCATE(parser->vm, MEMORY_STRING, char, length + 1);
+
+	memcpy(buffer, a->characters, a->length);
+	memcpy(buffer + a->length, b->characters, b->length);
+	buffer[length] = '\0';
+	return take_string(parser->vm, buffer, length);
+}
+
+/**
+ * fold_binary() - Compute @a @operator @b at compile time.
+ * @result: Receives the result.
+ *
+ * Return: false if the operation fails at runtime, the VM reports that.
+ */
+static bool fold_binary(struct parser *parser, enum token_type operator,
+			value_t a, value_t b, value_t *result)
+{
+	bool integers = IS_INTEGER(a) && IS_INTEGER(b), equal;
+
+	if (IS_NUMBER(a) && IS_NUMBER(b))
+		equal = AS_NUMBER(a) == AS_NUMBER(b);
+	else if (a.value_type != b.value_type)
+		equal = false;
+	else if (IS_BOOLEAN(a))
+		equal = AS_BOOLEAN(a) == AS_BOOLEAN(b);
+	else
+		equal = IS_NIL(a) || AS_OBJECT(a) == AS_OBJECT(b);
 
-	parse_precedence(PREC_UNARY);
+	if (operator == TOKEN_EQUAL_EQUAL || operator == TOKEN_BANG_EQUAL) {
+		*result = CONS_BOOLEAN(operator == TOKEN_EQUAL_EQUAL ? equal :
+								      !equal);
+		return true;
+	}
+	if (operator == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+		*result = CONS_OBJECT(fold_concatenate(parser, AS_OBJ_STRING(a),
+						       AS_OBJ_STRING(b)));
+#pragma clang diagnostic pop
+		return true;
+	}
+	if (!IS_NUMBER(a) || !IS_NUMBER(b))
+		return false;
+
+	switch (operator) {
+	case TOKEN_PLUS:
+		*result = fold_number(AS_NUMBER(a) + AS_NUMBER(b), integers);
+		return true;
+	case TOKEN_MINUS:
+		*result = fold_number(AS_NUMBER(a) - AS_NUMBER(b), integers);
+		return true;
+	case TOKEN_STAR:
+		*result = fold_number(AS_NUMBER(a) * AS_NUMBER(b), integers);
+		return true;
+	case TOKEN_SLASH:
+		*result = CONS_NUMBER(AS_NUMBER(a) / AS_NUMBER(b));
+		return true;
+	case TOKEN_LESS:
+		*result = CONS_BOOLEAN(AS_NUMBER(a) < AS_NUMBER(b));
+		return true;
+	case TOKEN_GREATER:
+		*result = CONS_BOOLEAN(AS_NUMBER(a) > AS_NUMBER(b));
+		return true;
+	case TOKEN_LESS_EQUAL:
+		*result = CONS_BOOLEAN(!(AS_NUMBER(a) > AS_NUMBER(b)));
+		return true;
+	case TOKEN_GREATER_EQUAL:
+		*result = CONS_BOOLEAN(!(AS_NUMBER(a) < AS_NUMBER(b)));
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void unary(struct parser *parser, bool can_assign)
+{
+	enum token_type operator = parser->previous.token_type;
+	int32_t start = current_chunk(parser)->length;
+	value_t value;
+
+	parse_precedence(parser, PREC_UNARY);
+
+	// Fold the operator into a constant operand
+	if (constant_value(parser, start, &value)) {
+		if (operator == TOKEN_BANG) {
+			discard_load(parser, start);
+			emit_value(parser,
+				   CONS_BOOLEAN(IS_NIL(value) ||
+						(IS_BOOLEAN(value) &&
+						 !AS_BOOLEAN(value))));
+			return;
+		}
+		if (IS_NUMBER(value)) {
+			discard_load(parser, start);
+			emit_value(parser, fold_number(-AS_NUMBER(value),
+						       IS_INTEGER(value)));
+			return;
+		}
+	}
 
 	switch (operator) {
 	case TOKEN_BANG:
-		emit_byte(OP_NOT);
+		emit_byte(parser, OP_NOT);
 		break;
 	case TOKEN_MINUS:
-		emit_byte(OP_NEGATE);
+		emit_byte(parser, OP_NEGATE);
 		break;
 	default: // UNREACHABLE
 		fprintf(stderr, "Unknown unary operator: %d", operator);
@@ -493,43 +898,83 @@ static void unary(bool can_assign)
 	}
 }
 
-static void binary(bool can_assign)
+/**
+ * yield() - Compile a yield expression.
+ *
+ * The operand is optional and defaults to nil. The expression evaluates to
+ * the argument the coroutine is resumed with.
+ */
+static void yield(struct parser *parser, bool can_assign)
 {
-	enum token_type operator = parser.previous.token_type;
-	struct parse_rule *rule = get_rule(operator);
+	if (parser->compiler->type == TYPE_SCRIPT)
+		error(parser, "Cannot yield from top-level code.");
+
+	switch (parser->current.token_type) {
+	case TOKEN_SEMICOLON: /* fall through */
+	case TOKEN_RIGHT_PAREN: /* fall through */
+	case TOKEN_RIGHT_BRACE: /* fall through */
+	case TOKEN_COMMA: /* fall through */
+	case TOKEN_COLON: /* fall through */
+	case TOKEN_EOF:
+		emit_byte(parser, OP_NIL);
+		break;
+	default:
+		parse_precedence(parser, PREC_ASSIGNMENT);
+		break;
+	}
+	emit_byte(parser, OP_YIELD);
+}
 
-	parse_precedence(rule->precedence + 1);
+static void binary(struct parser *parser, bool can_assign)
+{
+	enum token_type operator = parser->previous.token_type;
+	struct parse_rule *rule = get_rule(operator);
+	int32_t start = parser->operand_start, right;
+	value_t a, b, result;
+	bool constant = constant_value(parser, start, &a);
+
+	right = current_chunk(parser)->length;
+	parse_precedence(parser, rule->precedence + 1);
+
+	// Fold operations on two constant operands
+	if (constant && constant_value(parser, right, &b) &&
+	    fold_binary(parser, operator, a, b, &result)) {
+		discard_load(parser, right);
+		discard_load(parser, start);
+		emit_value(parser, result);
+		return;
+	}
 
 	switch (operator) {
 	case TOKEN_PLUS:
-		emit_byte(OP_ADD);
+		emit_byte(parser, OP_ADD);
 		break;
 	case TOKEN_MINUS:
-		emit_byte(OP_SUB);
+		emit_byte(parser, OP_SUB);
 		break;
 	case TOKEN_STAR:
-		emit_byte(OP_MUL);
+		emit_byte(parser, OP_MUL);
 		break;
 	case TOKEN_SLASH:
-		emit_byte(OP_DIV);
+		emit_byte(parser, OP_DIV);
 		break;
 	case TOKEN_EQUAL_EQUAL:
-		emit_byte(OP_EQUAL);
+		emit_byte(parser, OP_EQUAL);
 		break;
 	case TOKEN_BANG_EQUAL:
-		emit_bytes(OP_EQUAL, OP_NOT);
+		emit_bytes(parser, OP_EQUAL, OP_NOT);
 		break;
 	case TOKEN_LESS:
-		emit_byte(OP_LESS);
+		emit_byte(parser, OP_LESS);
 		break;
 	case TOKEN_GREATER:
-		emit_byte(OP_GREATER);
+		emit_byte(parser, OP_GREATER);
 		break;
 	case TOKEN_LESS_EQUAL:
-		emit_bytes(OP_GREATER, OP_NOT);
+		emit_bytes(parser, OP_GREATER, OP_NOT);
 		break;
 	case TOKEN_GREATER_EQUAL:
-		emit_bytes(OP_LESS, OP_NOT);
+		emit_bytes(parser, OP_LESS, OP_NOT);
 		break;
 	default: // UNREACHABLE
 		fprintf(stderr, "Unknown binary operator: %d", operator);
@@ -537,262 +982,622 @@ static void binary(bool can_assign)
 	}
 }
 
-static void parse_precedence(enum precedence precedence)
+static void parse_precedence(struct parser *parser, enum precedence precedence)
 {
 	parse_fn_t rule_fn;
+	int32_t start = current_chunk(parser)->length;
 
-	advance();
-	rule_fn = get_rule(parser.previous.token_type)->prefix;
+	advance(parser);
+	parser->callee.function = NULL;
+	rule_fn = get_rule(parser->previous.token_type)->prefix;
 	if (rule_fn == NULL) {
-		error("Expected expression.");
+		error(parser, "Expected expression.");
 		return;
 	}
 
 	// Run prefix rule
 	bool can_assign = precedence <= PREC_ASSIGNMENT;
-	rule_fn(can_assign);
+	rule_fn(parser, can_assign);
 
-	while (precedence <= get_rule(parser.current.token_type)->precedence) {
-		advance();
-		rule_fn = get_rule(parser.previous.token_type)->infix;
+	while (precedence <= get_rule(parser->current.token_type)->precedence) {
+		advance(parser);
+		rule_fn = get_rule(parser->previous.token_type)->infix;
 		// Run infix rule
-		rule_fn(can_assign);
+		parser->operand_start = start;
+		rule_fn(parser, can_assign);
 	}
 
-	if (can_assign && match(TOKEN_EQUAL))
-		error("Invalid assignment target.");
+	if (can_assign && match(parser, TOKEN_EQUAL))
+		error(parser, "Invalid assignment target.");
 }
 
-static void print_statement(void)
+static void print_statement(struct parser *parser)
 {
-	expression();
-	consume(TOKEN_SEMICOLON, "Expected semicolon after print statement.");
-	emit_byte(OP_PRINT);
+	expression(parser);
+	consume(parser, TOKEN_SEMICOLON,
+		"Expected semicolon after print statement.");
+	emit_byte(parser, OP_PRINT);
 }
 
-static void expression_statement(void)
+static void expression_statement(struct parser *parser)
 {
-	expression();
-	consume(TOKEN_SEMICOLON,
+	expression(parser);
+	consume(parser, TOKEN_SEMICOLON,
 		"Expected semicolon after expression statement.");
-	emit_byte(OP_POP);
+	emit_byte(parser, OP_POP);
 }
 
-static void expression(void)
+static void expression(struct parser *parser)
 {
-	parse_precedence(PREC_ASSIGNMENT);
+	parse_precedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block(void)
+static void block(struct parser *parser)
 {
-	while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
-		declaration();
+	while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+		declaration(parser);
 
-	consume(TOKEN_RIGHT_BRACE, "Expected '}' after block.");
+	consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after block.");
 }
 
-static void patch_jump(uint32_t offset)
+static void patch_jump(struct parser *parser, uint32_t offset)
 {
-	int32_t relative = current_chunk()->length - offset - 2;
+	int32_t relative = current_chunk(parser)->length - offset - 2;
 
 	if (relative > UINT16_MAX)
-		error("Too much code to jump over.");
+		error(parser, "Too much code to jump over.");
 
-	current_chunk()->code[offset] = (relative >> 8) & 0xff;
-	current_chunk()->code[offset + 1] = relative & 0xff;
+	current_chunk(parser)->code[offset] = (relative >> 8) & 0xff;
+	current_chunk(parser)->code[offset + 1] = relative & 0xff;
 }
 
-static void if_statement(void)
+static void if_statement(struct parser *parser)
 {
 	uint32_t then_jump, else_jump;
 
-	consume(TOKEN_LEFT_PAREN, "Expected '(' before if condition.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expected ')' after if condition.");
+	consume(parser, TOKEN_LEFT_PAREN, "Expected '(' before if condition.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after if condition.");
 
-	then_jump = emit_jump(OP_JUMP_IF_FALSE);
-	emit_byte(OP_POP);
-	statement();
-	else_jump = emit_jump(OP_JUMP);
-	patch_jump(then_jump);
-	emit_byte(OP_POP);
+	then_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+	emit_byte(parser, OP_POP);
+	statement(parser);
+	else_jump = emit_jump(parser, OP_JUMP);
+	patch_jump(parser, then_jump);
+	emit_byte(parser, OP_POP);
 
-	if (match(TOKEN_ELSE))
-		statement();
+	if (match(parser, TOKEN_ELSE))
+		statement(parser);
 
-	patch_jump(else_jump);
+	patch_jump(parser, else_jump);
 }
 
-static void and_(bool can_assign)
+static void and_(struct parser *parser, bool can_assign)
 {
-	uint32_t end_jump = emit_jump(OP_JUMP_IF_FALSE);
-	emit_byte(OP_POP);
-	parse_precedence(PREC_AND);
-	patch_jump(end_jump);
+	uint32_t end_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+	emit_byte(parser, OP_POP);
+	parse_precedence(parser, PREC_AND);
+	patch_jump(parser, end_jump);
 }
 
-static void or_(bool can_assign)
+static void or_(struct parser *parser, bool can_assign)
 {
-	uint32_t else_jump = emit_jump(OP_JUMP_IF_FALSE),
-		 end_jump = emit_jump(OP_JUMP);
-	patch_jump(else_jump);
-	emit_byte(OP_POP);
-	parse_precedence(PREC_OR);
-	patch_jump(end_jump);
+	uint32_t else_jump = emit_jump(parser, OP_JUMP_IF_FALSE),
+		 end_jump = emit_jump(parser, OP_JUMP);
+	patch_jump(parser, else_jump);
+	emit_byte(parser, OP_POP);
+	parse_precedence(parser, PREC_OR);
+	patch_jump(parser, end_jump);
 }
 
-static void ternary(bool can_assign)
+static void ternary(struct parser *parser, bool can_assign)
 {
 	uint32_t else_jump, end_jump;
 
-	else_jump = emit_jump(OP_JUMP_IF_FALSE);
-	emit_byte(OP_POP);
-	parse_precedence(PREC_ASSIGNMENT);
-	end_jump = emit_jump(OP_JUMP);
-	consume(TOKEN_COLON,
+	else_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+	emit_byte(parser, OP_POP);
+	parse_precedence(parser, PREC_ASSIGNMENT);
+	end_jump = emit_jump(parser, OP_JUMP);
+	consume(parser, TOKEN_COLON,
 		"Expected ':' for else branch of ternary operator.");
-	patch_jump(else_jump);
-	emit_byte(OP_POP);
-	parse_precedence(PREC_TERNARY);
-	patch_jump(end_jump);
+	patch_jump(parser, else_jump);
+	emit_byte(parser, OP_POP);
+	parse_precedence(parser, PREC_TERNARY);
+	patch_jump(parser, end_jump);
 }
 
-static uint8_t argument_list(void)
+static uint8_t argument_list(struct parser *parser)
 {
 	uint8_t arg_count = 0;
 
-	if (!check(TOKEN_RIGHT_PAREN)) {
+	if (!check(parser, TOKEN_RIGHT_PAREN)) {
 		do {
-			expression();
+			expression(parser);
 			if (arg_count == 255)
-				error("Cannot call a function with more than 255 arguments.");
+				error(parser,
+				      "Cannot call a function with more than 255 arguments.");
 			arg_count++;
-		} while (match(TOKEN_COMMA));
+		} while (match(parser, TOKEN_COMMA));
 	}
-	consume(TOKEN_RIGHT_PAREN, "Expected ')' after argument list");
+	consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after argument list");
 
 	return arg_count;
 }
 
-static void call(bool can_assign)
+/*
+ * Calls to let functions whose body is a single expression of at most
+ * INLINE_MAX_LENGTH bytes are replaced by a copy of the body.
+ */
+#define INLINE_MAX_LENGTH 32
+
+/**
+ * inline_instruction() - Decode an instruction of a body to inline.
+ * @code: The instruction.
+ * @depth: The number of values the body pushed before the instruction, is
+ * updated with its stack effect.
+ * @arity: Arity of the function of the body.
+ *
+ * Return: The length of the instruction, 0 if it cannot be inlined.
+ */
+static int32_t inline_instruction(uint8_t *code, int32_t *depth,
+				  int32_t arity)
 {
-	uint8_t arg_count = argument_list();
-	emit_bytes(OP_CALL, arg_count);
+	switch (code[0]) {
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+		(*depth)++;
+		return 1;
+	case OP_NOT:
+	case OP_NEGATE:
+		return 1;
+	case OP_ADD:
+	case OP_SUB:
+	case OP_MUL:
+	case OP_DIV:
+	case OP_EQUAL:
+	case OP_LESS:
+	case OP_GREATER:
+	case OP_POP:
+	case OP_GET_INDEX:
+		(*depth)--;
+		return 1;
+	case OP_CONSTANT:
+	case OP_GET_GLOBAL:
+		(*depth)++;
+		return 2;
+	case OP_CONSTANT_LONG:
+	case OP_GET_GLOBAL_LONG:
+		(*depth)++;
+		return 4;
+	case OP_GET_LOCAL:
+		// Slot 0 is the callee, which an inlined call does not load
+		if (code[1] == 0 || code[1] > arity ||
+		    *depth + arity - code[1] > UINT8_MAX)
+			return 0;
+		(*depth)++;
+		return 2;
+	case OP_PICK:
+		if (code[1] >= *depth + arity)
+			return 0;
+		(*depth)++;
+		return 2;
+	case OP_NIP:
+		*depth -= code[1];
+		return 2;
+	case OP_ARRAY:
+		*depth -= code[1] - 1;
+		return 2;
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP:
+	case OP_GET_PROPERTY:
+		return 3;
+	case OP_CALL:
+		*depth -= code[1];
+		return 4;
+	case OP_INVOKE:
+		*depth -= code[3];
+		return 4;
+	default:
+		return 0;
+	}
 }
 
-static void while_statement(void)
+/**
+ * can_inline() - Check if calls to @function can be replaced by its body.
+ *
+ * The body must be straight expression code, which leaves one value on
+ * the stack and returns it.
+ */
+static bool can_inline(struct object_function *function)
+{
+	struct chunk *chunk = &function->chunk;
+	// Without the implicit OP_NIL, OP_RETURN the compiler adds
+	int32_t length = chunk->length - 3, offset = 0, depth = 0, size;
+
+	if (function->upvalue_count > 0 || length < 1 ||
+	    length > INLINE_MAX_LENGTH || chunk->code[length] != OP_RETURN)
+		return false;
+	while (offset < length) {
+		size = inline_instruction(chunk->code + offset, &depth,
+					  function->arity);
+		if (size == 0)
+			return false;
+		offset += size;
+	}
+	return offset == length && depth == 1;
+}
+
+/**
+ * emit_inline() - Emit the body of @function in place of a call to it.
+ *
+ * The arguments are on the stack where the call would find them, so the
+ * body reads its parameters with OP_PICK and OP_NIP drops them below the
+ * result. Constants and inline caches are added to the function being
+ * compiled, the code keeps the lines of the body so a runtime error in it
+ * still points at the expression that failed.
+ */
+static void emit_inline(struct parser *parser, struct object_function *function)
+{
+	struct chunk *body = &function->chunk, *chunk = current_chunk(parser);
+	value_t *constants = body->constants.values;
+	int32_t length = body->length - 3, offset = 0, depth = 0, size, line;
+	int32_t constant, site, i;
+	uint8_t code[4];
+
+	while (offset < length) {
+		memcpy(code, body->code + offset, sizeof(code));
+		switch (code[0]) {
+		case OP_CONSTANT:
+		case OP_GET_GLOBAL:
+			code[1] = (uint8_t)add_constant(parser->vm, chunk,
+							constants[code[1]]);
+			break;
+		case OP_CONSTANT_LONG:
+		case OP_GET_GLOBAL_LONG:
+			constant = (code[1] << 16) | (code[2] << 8) | code[3];
+			constant = add_constant(parser->vm, chunk,
+						constants[constant]);
+			code[1] = (uint8_t)(constant >> 16);
+			code[2] = (uint8_t)(constant >> 8);
+			code[3] = (uint8_t)constant;
+			break;
+		case OP_GET_LOCAL:
+			code[0] = OP_PICK;
+			code[1] = (uint8_t)(depth + function->arity - code[1]);
+			break;
+		case OP_CALL:
+			site = add_call_site(parser->vm, chunk);
+			if (site > UINT16_MAX)
+				error(parser,
+				      "Too many calls in one function.");
+			code[2] = (uint8_t)(site >> 8);
+			code[3] = (uint8_t)site;
+			break;
+		case OP_GET_PROPERTY:
+		case OP_INVOKE:
+			site = add_property_site(
+				parser->vm, chunk,
+				body->sites[(code[1] << 8) | code[2]].name);
+			if (site > UINT16_MAX)
+				error(parser,
+				      "Too many property accesses in one function.");
+			code[1] = (uint8_t)(site >> 8);
+			code[2] = (uint8_t)site;
+			break;
+		}
+
+		line = read_line(&body->lines, offset);
+		size = inline_instruction(body->code + offset, &depth,
+					  function->arity);
+		for (i = 0; i < size; i++)
+			write_chunk(parser->vm, chunk, code[i], line);
+		offset += size;
+	}
+	if (function->arity > 0)
+		emit_bytes(parser, OP_NIP, (uint8_t)function->arity);
+}
+
+/**
+ * emit_call_operands() - Emit the operands of a call with @arg_count
+ * arguments and a new call site.
+ */
+static void emit_call_operands(struct parser *parser, uint8_t arg_count)
+{
+	int32_t site = add_call_site(parser->vm, current_chunk(parser));
+
+	if (site > UINT16_MAX)
+		error(parser, "Too many calls in one function.");
+	emit_bytes(parser, arg_count, (uint8_t)(site >> 8));
+	emit_byte(parser, (uint8_t)site);
+}
+
+static void call(struct parser *parser, bool can_assign)
+{
+	struct inline_callee callee = parser->callee;
+	struct chunk *chunk = current_chunk(parser);
+	int32_t start = parser->operand_start, args = chunk->length, rest;
+	uint8_t arg_count;
+
+	parser->callee.function = NULL;
+	arg_count = argument_list(parser);
+
+	if (callee.function != NULL && callee.compiler == parser->compiler &&
+	    callee.start == start && callee.end == args &&
+	    arg_count == callee.function->arity &&
+	    chunk->constants.length +
+			    callee.function->chunk.constants.length <=
+		    1 << 8) {
+		// The arguments stay where the call would have found them
+		delete_code(chunk, callee.start, callee.end - callee.start);
+		emit_inline(parser, callee.function);
+		parser->callee.function = NULL;
+		return;
+	}
+
+	if (match(parser, TOKEN_LEFT_PAREN)) {
+		// The result is called right away, a curried callee can take
+		// both argument lists at once
+		emit_bytes(parser, OP_CALL_CURRIED, 0);
+		rest = chunk->length - 1;
+		emit_call_operands(parser, arg_count);
+		arg_count = argument_list(parser);
+		chunk->code[rest] = arg_count;
+	}
+	emit_byte(parser, OP_CALL);
+	emit_call_operands(parser, arg_count);
+}
+
+/**
+ * array() - Compile an array literal.
+ *
+ * The elements are evaluated in order onto the stack and collected by a
+ * single OP_ARRAY.
+ */
+static void array(struct parser *parser, bool can_assign)
+{
+	int32_t length = 0;
+
+	if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+		do {
+			expression(parser);
+			if (length == 255)
+				error(parser,
+				      "Cannot have more than 255 elements in an array literal.");
+			length++;
+		} while (match(parser, TOKEN_COMMA));
+	}
+	consume(parser, TOKEN_RIGHT_BRACKET,
+		"Expected ']' after array elements.");
+	emit_bytes(parser, OP_ARRAY, (uint8_t)length);
+}
+
+static void subscript(struct parser *parser, bool can_assign)
+{
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_BRACKET, "Expected ']' after index.");
+
+	if (can_assign && match(parser, TOKEN_EQUAL)) {
+		expression(parser);
+		emit_byte(parser, OP_SET_INDEX);
+	} else {
+		emit_byte(parser, OP_GET_INDEX);
+	}
+}
+
+/**
+ * property_site() - Add an inline cache for an access to the property
+ * @name in the function being compiled.
+ *
+ * Return: The 16-bit index of the site that follows the instruction.
+ */
+static uint16_t property_site(struct parser *parser, struct token *name)
+{
+	int32_t site = add_property_site(parser->vm, current_chunk(parser),
+					 copy_string(parser->vm, name->start,
+						     name->length));
+
+	if (site > UINT16_MAX) {
+		error(parser, "Too many property accesses in one function.");
+		return 0;
+	}
+	return (uint16_t)site;
+}
+
+static void emit_property(struct parser *parser, uint8_t op, uint16_t site)
+{
+	emit_byte(parser, op);
+	emit_bytes(parser, (uint8_t)(site >> 8), (uint8_t)site);
+}
+
+static void dot(struct parser *parser, bool can_assign)
+{
+	uint8_t arg_count;
+	uint16_t site;
+
+	consume(parser, TOKEN_IDENTIFIER, "Expected property name after '.'.");
+	site = property_site(parser, &parser->previous);
+
+	if (can_assign && match(parser, TOKEN_EQUAL)) {
+		expression(parser);
+		emit_property(parser, OP_SET_PROPERTY, site);
+	} else if (match(parser, TOKEN_LEFT_PAREN)) {
+		// Calls the method without creating a bound method first
+		arg_count = argument_list(parser);
+		emit_property(parser, OP_INVOKE, site);
+		emit_byte(parser, arg_count);
+	} else {
+		emit_property(parser, OP_GET_PROPERTY, site);
+	}
+}
+
+static struct token synthetic_token(const char *text)
+{
+	struct token token;
+
+	token.token_type = TOKEN_IDENTIFIER;
+	token.start = text;
+	token.length = (int32_t)strlen(text);
+	token.line = 0;
+	return token;
+}
+
+static void this_(struct parser *parser, bool can_assign)
+{
+	if (parser->class_compiler == NULL) {
+		error(parser, "Cannot use 'this' outside of a class.");
+		return;
+	}
+	variable(parser, false);
+}
+
+static void super_(struct parser *parser, bool can_assign)
+{
+	uint8_t arg_count;
+	uint16_t site;
+
+	if (parser->class_compiler == NULL)
+		error(parser, "Cannot use 'super' outside of a class.");
+	else if (!parser->class_compiler->has_superclass)
+		error(parser, "Cannot use 'super' in a class with no superclass.");
+
+	consume(parser, TOKEN_DOT, "Expected '.' after 'super'.");
+	consume(parser, TOKEN_IDENTIFIER, "Expected superclass method name.");
+	site = property_site(parser, &parser->previous);
+
+	named_variable(parser, synthetic_token("this"), false);
+	if (match(parser, TOKEN_LEFT_PAREN)) {
+		arg_count = argument_list(parser);
+		named_variable(parser, synthetic_token("super"), false);
+		emit_property(parser, OP_SUPER_INVOKE, site);
+		emit_byte(parser, arg_count);
+	} else {
+		named_variable(parser, synthetic_token("super"), false);
+		emit_property(parser, OP_GET_SUPER, site);
+	}
+}
+
+static void while_statement(struct parser *parser)
 {
 	uint16_t exit_jump;
-	uint32_t loop_start = current_chunk()->length;
+	uint32_t loop_start = current_chunk(parser)->length;
 
-	consume(TOKEN_LEFT_PAREN, "Expected '(' before while condition.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expected ')' after while condition.");
+	consume(parser, TOKEN_LEFT_PAREN,
+		"Expected '(' before while condition.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN,
+		"Expected ')' after while condition.");
 
-	exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-	emit_byte(OP_POP);
-	statement();
-	emit_loop(loop_start);
+	exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+	emit_byte(parser, OP_POP);
+	statement(parser);
+	emit_loop(parser, loop_start);
 
-	patch_jump(exit_jump);
-	emit_byte(OP_POP);
+	patch_jump(parser, exit_jump);
+	emit_byte(parser, OP_POP);
 }
 
-static void variable_declaration(void);
+static void variable_declaration(struct parser *parser);
 
-static void for_statement(void)
+static void for_statement(struct parser *parser)
 {
 	uint16_t exit_jump;
 	bool has_condition;
 	uint32_t loop_start;
 
-	begin_scope();
+	begin_scope(parser);
 
-	consume(TOKEN_LEFT_PAREN, "Expected '(' before for clauses.");
-	if (match(TOKEN_SEMICOLON))
+	consume(parser, TOKEN_LEFT_PAREN, "Expected '(' before for clauses.");
+	if (match(parser, TOKEN_SEMICOLON))
 		; // No initializer
-	else if (match(TOKEN_VAR))
-		variable_declaration();
+	else if (match(parser, TOKEN_VAR))
+		variable_declaration(parser);
 	else
-		expression_statement();
+		expression_statement(parser);
 
-	loop_start = current_chunk()->length;
+	loop_start = current_chunk(parser)->length;
 	has_condition = false;
-	if (!match(TOKEN_SEMICOLON)) {
-		expression();
-		consume(TOKEN_SEMICOLON, "Expected ';' after for condition.");
+	if (!match(parser, TOKEN_SEMICOLON)) {
+		expression(parser);
+		consume(parser, TOKEN_SEMICOLON,
+			"Expected ';' after for condition.");
 
 		has_condition = true;
-		exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-		emit_byte(OP_POP);
+		exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+		emit_byte(parser, OP_POP);
 	}
 
-	if (!match(TOKEN_RIGHT_PAREN)) {
-		uint32_t body_jump = emit_jump(OP_JUMP),
-			 increment_start = current_chunk()->length;
-		expression();
-		emit_byte(OP_POP);
-		consume(TOKEN_RIGHT_PAREN, "Expected ')' after for clauses.");
+	if (!match(parser, TOKEN_RIGHT_PAREN)) {
+		uint32_t body_jump = emit_jump(parser, OP_JUMP),
+			 increment_start = current_chunk(parser)->length;
+		expression(parser);
+		emit_byte(parser, OP_POP);
+		consume(parser, TOKEN_RIGHT_PAREN,
+			"Expected ')' after for clauses.");
 
-		emit_loop(loop_start);
+		emit_loop(parser, loop_start);
 		loop_start = increment_start;
-		patch_jump(body_jump);
+		patch_jump(parser, body_jump);
 	}
 
-	statement();
-	emit_loop(loop_start);
+	statement(parser);
+	emit_loop(parser, loop_start);
 
 	if (has_condition) {
-		patch_jump(exit_jump);
-		emit_byte(OP_POP); // condition
+		patch_jump(parser, exit_jump);
+		emit_byte(parser, OP_POP); // condition
 	}
 
-	end_scope();
+	end_scope(parser);
 }
 
-static void return_statement(void)
+static void return_statement(struct parser *parser)
 {
-	if (current->type == TYPE_SCRIPT) {
-		error("Cannot return from top-level code.");
+	if (parser->compiler->type == TYPE_SCRIPT) {
+		error(parser, "Cannot return from top-level code.");
 	}
 
-	if (match(TOKEN_SEMICOLON)) {
-		emit_return();
+	if (match(parser, TOKEN_SEMICOLON)) {
+		emit_return(parser);
 	} else {
-		expression();
-		consume(TOKEN_SEMICOLON,
+		if (parser->compiler->type == TYPE_INITIALIZER)
+			error(parser,
+			      "Cannot return a value from an initializer.");
+		expression(parser);
+		consume(parser, TOKEN_SEMICOLON,
 			"Expected semicolon after return expression.");
-		emit_byte(OP_RETURN);
+		emit_byte(parser, OP_RETURN);
 	}
 }
 
-static void statement(void)
-{
-	if (match(TOKEN_PRINT)) {
-		print_statement();
-	} else if (match(TOKEN_IF)) {
-		if_statement();
-	} else if (match(TOKEN_WHILE)) {
-		while_statement();
-	} else if (match(TOKEN_FOR)) {
-		for_statement();
-	} else if (match(TOKEN_LEFT_BRACE)) {
-		begin_scope();
-		block();
-		end_scope();
-	} else if (match(TOKEN_RETURN)) {
-		return_statement();
+static void statement(struct parser *parser)
+{
+	if (match(parser, TOKEN_PRINT)) {
+		print_statement(parser);
+	} else if (match(parser, TOKEN_IF)) {
+		if_statement(parser);
+	} else if (match(parser, TOKEN_WHILE)) {
+		while_statement(parser);
+	} else if (match(parser, TOKEN_FOR)) {
+		for_statement(parser);
+	} else if (match(parser, TOKEN_LEFT_BRACE)) {
+		begin_scope(parser);
+		block(parser);
+		end_scope(parser);
+	} else if (match(parser, TOKEN_RETURN)) {
+		return_statement(parser);
 	} else {
-		expression_statement();
+		expression_statement(parser);
 	}
 }
 
-static void add_local(struct token name)
+static void add_local(struct parser *parser, struct token name)
 {
+	struct compiler *current = parser->compiler;
 	struct local *local;
 
 	if (current->local_count >= 256) {
-		error("Too many local variables in function.");
+		error(parser, "Too many local variables in function.");
 		return;
 	}
 
@@ -800,25 +1605,33 @@ static void add_local(struct token name)
 	local->name = name;
 	local->depth = -1;
 	local->is_captured = false;
+	local->is_constant = false;
+	local->value = CONS_NIL;
 }
 
-static void mark_initialized(void)
+static void mark_initialized(struct parser *parser)
 {
+	struct compiler *current = parser->compiler;
+
 	if (current->scope_depth == 0)
 		return;
 	current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void declare_variable(void)
+static void declare_variable(struct parser *parser)
 {
-	struct token *name;
+	struct compiler *current = parser->compiler;
+	struct token *name = &parser->previous;
 	struct local *local;
+	value_t value;
 	int32_t i;
 
-	if (current->scope_depth == 0)
+	if (current->scope_depth == 0) {
+		if (global_constant(parser, name, &value))
+			error(parser,
+			      "Already there is a constant with same name.");
 		return;
-
-	name = &parser.previous;
+	}
 
 	for (i = current->local_count - 1; i >= 0; i--) {
 		local = &current->locals[i];
@@ -826,127 +1639,380 @@ static void declare_variable(void)
 			break;
 
 		if (identifiers_equal(&local->name, name))
-			error("Already there is a local with same name.");
+			error(parser,
+			      "Already there is a local with same name.");
 	}
 
-	add_local(*name);
+	add_local(parser, *name);
 }
 
-static uint32_t parse_variable(const char *msg)
+static uint32_t parse_variable(struct parser *parser, const char *msg)
 {
-	consume(TOKEN_IDENTIFIER, msg);
+	consume(parser, TOKEN_IDENTIFIER, msg);
 
-	declare_variable();
-	if (current->scope_depth > 0)
+	declare_variable(parser);
+	if (parser->compiler->scope_depth > 0)
 		return 0;
 
-	return identifier_constant(&parser.previous);
+	return identifier_constant(parser, &parser->previous);
 }
 
-static void define_variable(uint32_t global)
+static void define_variable(struct parser *parser, uint32_t global)
 {
-	if (current->scope_depth > 0) {
-		mark_initialized();
+	if (parser->compiler->scope_depth > 0) {
+		mark_initialized(parser);
 		return;
 	}
 
 	if (global < 1 << 8) {
-		emit_bytes(OP_DEFINE_GLOBAL, global);
+		emit_bytes(parser, OP_DEFINE_GLOBAL, global);
 	} else if (global < 1 << 24) {
-		emit_bytes(OP_DEFINE_GLOBAL_LONG, (uint8_t)(global >> 16));
-		emit_bytes((uint8_t)(global >> 8), (uint8_t)global);
+		emit_bytes(parser, OP_DEFINE_GLOBAL_LONG,
+			   (uint8_t)(global >> 16));
+		emit_bytes(parser, (uint8_t)(global >> 8), (uint8_t)global);
 	} else {
 		fprintf(stderr, "Too many global variables.");
 		exit(1);
 	}
 }
 
-static void variable_declaration(void)
+static void variable_declaration(struct parser *parser)
 {
 	uint32_t global =
-		parse_variable("Expected variable name after keyword var.");
+		parse_variable(parser,
+			       "Expected variable name after keyword var.");
 
-	if (match(TOKEN_EQUAL))
-		expression();
+	if (match(parser, TOKEN_EQUAL))
+		expression(parser);
 	else
-		emit_byte(OP_NIL);
+		emit_byte(parser, OP_NIL);
 
-	consume(TOKEN_SEMICOLON, "Expected ; after variable declaration.");
+	consume(parser, TOKEN_SEMICOLON,
+		"Expected ; after variable declaration.");
 
-	define_variable(global);
+	define_variable(parser, global);
 }
 
-static void lambda(bool can_assign);
-
-static void function(enum function_type type)
+/**
+ * inline_value() - Find out if the code from offset @start on creates a
+ * function that can be inlined.
+ * @value: Receives the function.
+ */
+static void inline_value(struct parser *parser, int32_t start,
+			 value_t *value)
 {
-	struct compiler compiler;
+	struct chunk *chunk = current_chunk(parser);
+	uint8_t *code = chunk->code + start;
+	int32_t length = chunk->length - start, constant;
 	struct object_function *function;
-	uint32_t constant;
-	int32_t i;
 
-	init_compiler(&compiler, type);
-	begin_scope();
+	if (length == 2 && code[0] == OP_CLOSURE)
+		constant = code[1];
+	else if (length == 4 && code[0] == OP_CLOSURE_LONG)
+		constant = (code[1] << 16) | (code[2] << 8) | code[3];
+	else
+		return;
+
+	function = AS_OBJ_FUNCTION(chunk->constants.values[constant]);
+	if (can_inline(function))
+		*value = chunk->constants.values[constant];
+}
+
+/**
+ * let_declaration() - Compile the binding of a constant.
+ *
+ * A constant is a variable that can't be assigned to. If its initializer
+ * folded to a value, uses of the constant load that value instead. If it is
+ * a function that can be inlined, calls of the constant are inlined.
+ */
+static void let_declaration(struct parser *parser)
+{
+	uint32_t global = parse_variable(
+		parser, "Expected constant name after keyword let.");
+	struct token name = parser->previous;
+	struct compiler *current = parser->compiler;
+	value_t value = CONS_NIL;
+	int32_t start;
+
+	consume(parser, TOKEN_EQUAL, "Expected '=' after constant name.");
+	start = current_chunk(parser)->length;
+	expression(parser);
+	if (!constant_value(parser, start, &value))
+		inline_value(parser, start, &value);
+	consume(parser, TOKEN_SEMICOLON,
+		"Expected ; after constant declaration.");
+
+	if (current->scope_depth > 0) {
+		current->locals[current->local_count - 1].is_constant = true;
+		current->locals[current->local_count - 1].value = value;
+	} else {
+		table_set(parser->vm, &parser->constants,
+			  copy_string(parser->vm, name.start, name.length),
+			  value);
+	}
+	define_variable(parser, global);
+}
 
-	consume(TOKEN_LEFT_PAREN, "Expected '(' after function name.");
-	if (!match(TOKEN_RIGHT_PAREN)) {
+static void lambda(struct parser *parser, bool can_assign);
+
+static void parameters(struct parser *parser)
+{
+	uint32_t constant;
+
+	consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after function name.");
+	if (!match(parser, TOKEN_RIGHT_PAREN)) {
 		do {
-			current->function->arity++;
-			if (current->function->arity > 255)
-				error_at_current(
+			parser->compiler->function->arity++;
+			if (parser->compiler->function->arity > 255)
+				error_at_current(parser,
 					"Function cannot have more than 255 parameters.");
-			constant = parse_variable("Expected parameter name.");
-			define_variable(constant);
-		} while (match(TOKEN_COMMA));
-		consume(TOKEN_RIGHT_PAREN,
+			constant = parse_variable(parser,
+						  "Expected parameter name.");
+			define_variable(parser, constant);
+		} while (match(parser, TOKEN_COMMA));
+		consume(parser, TOKEN_RIGHT_PAREN,
 			"Expected ')' after parameter list.");
 	}
+}
 
-	if (match(TOKEN_EQUAL)) {
-		expression();
-		emit_byte(OP_RETURN);
-	} else if (check(TOKEN_LEFT_PAREN)) {
-		lambda(false);
-		emit_byte(OP_RETURN);
+static void function_body(struct parser *parser, enum function_type type)
+{
+	if (type == TYPE_INITIALIZER && (check(parser, TOKEN_EQUAL) ||
+					 check(parser, TOKEN_LEFT_PAREN))) {
+		error_at_current(parser,
+				 "Cannot return a value from an initializer.");
+	} else if (match(parser, TOKEN_EQUAL)) {
+		expression(parser);
+		emit_byte(parser, OP_RETURN);
+	} else if (check(parser, TOKEN_LEFT_PAREN)) {
+		lambda(parser, false);
+		emit_byte(parser, OP_RETURN);
 	} else {
-		consume(TOKEN_LEFT_BRACE, "Expected '{' before function body.");
-		block();
+		consume(parser, TOKEN_LEFT_BRACE,
+			"Expected '{' before function body.");
+		block(parser);
+	}
+}
+
+/**
+ * start_recording() - Record the tokens from the current one on.
+ *
+ * Return: The position of the current token on the tape.
+ */
+static int32_t start_recording(struct parser *parser)
+{
+	struct token_tape *tape = &parser->tape;
+
+	tape->recording++;
+	if (tape->replaying)
+		return tape->position - 1;
+	// An enclosing recording has put the current token on the tape already
+	if (tape->recording == 1)
+		record_token(parser, parser->current);
+	return tape->length - 1;
+}
+
+static void stop_recording(struct parser *parser)
+{
+	if (--parser->tape.recording == 0)
+		parser->tape.length = 0;
+}
+
+/**
+ * uncurry() - Compile the function of @curried, which has several
+ * parameter lists, again with its first two lists merged into one.
+ * @tail: Position of the second list on the tape.
+ * @lambda_count: The lambda count of the VM before the second list.
+ *
+ * The tokens from the second list on are replayed from the tape, lambdas in
+ * them get the same names again. Errors of the replay are not reported, the
+ * curried function compiled without any.
+ *
+ * Return: NULL if the replay failed or the function captures other
+ * variables than @curried.
+ */
+static struct object_function *uncurry(struct parser *parser,
+				       struct compiler *curried, int32_t tail,
+				       int32_t lambda_count)
+{
+	struct token_tape *tape = &parser->tape;
+	struct token previous = parser->previous, current = parser->current;
+	int32_t names = parser->vm->lambda_count, position = tape->position, i;
+	struct object_function *function = curried->function;
+	struct compiler compiler;
+	bool replaying = tape->replaying, failed = tape->failed;
+
+	tape->replaying = true;
+	tape->failed = false;
+	tape->position = tail + 1;
+	parser->current = tape->tokens[tail];
+	// The second list is merged, the lambda it was compiled to is skipped
+	parser->vm->lambda_count = lambda_count + 1;
+
+	// As a script it takes no name from the previous token. It is named
+	// like the closure of the second list, which is the only constant of
+	// the curried function, so stack traces do not change.
+	init_compiler(parser, &compiler, TYPE_SCRIPT);
+	compiler.type = curried->type;
+	compiler.function->name =
+		AS_OBJ_FUNCTION(function->chunk.constants.values[0])->name;
+	compiler.function->is_uncurried = true;
+	begin_scope(parser);
+	for (i = 1; i <= function->arity; i++) {
+		compiler.function->arity++;
+		add_local(parser, curried->locals[i].name);
+		mark_initialized(parser);
+	}
+	parameters(parser);
+	function_body(parser, compiler.type);
+	end_compiler(parser);
+
+	if (compiler.function->upvalue_count != function->upvalue_count)
+		tape->failed = true;
+	for (i = 0; !tape->failed && i < function->upvalue_count; i++)
+		tape->failed = compiler.upvalues[i].index !=
+				       curried->upvalues[i].index ||
+			       compiler.upvalues[i].is_local !=
+				       curried->upvalues[i].is_local;
+	function = tape->failed ? NULL : compiler.function;
+
+	tape->replaying = replaying;
+	tape->failed = failed;
+	tape->position = position;
+	parser->previous = previous;
+	parser->current = current;
+	parser->vm->lambda_count = names;
+	return function;
+}
+
+static void function(struct parser *parser, enum function_type type)
+{
+	struct compiler compiler;
+	struct object_function *function;
+	int32_t tail = -1, lambda_count = 0, i;
+
+	init_compiler(parser, &compiler, type);
+	begin_scope(parser);
+	parameters(parser);
+
+	// Methods are left out, slot 0 of an uncurried call is no receiver
+	if ((type == TYPE_FUNCTION || type == TYPE_LAMBDA) &&
+	    check(parser, TOKEN_LEFT_PAREN)) {
+		lambda_count = parser->vm->lambda_count;
+		tail = start_recording(parser);
+	}
+	function_body(parser, type);
+	function = end_compiler(parser);
+	if (tail != -1) {
+		if (!parser->had_error)
+			function->uncurried = uncurry(parser, &compiler, tail,
+						      lambda_count);
+		stop_recording(parser);
 	}
 
-	function = end_compiler();
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wincompatible-pointer-types"
-	emit_closure(CONS_OBJECT(function));
+	emit_closure(parser, CONS_OBJECT(function));
 #pragma clang diagnostic pop
 	for (i = 0; i < function->upvalue_count; i++)
-		emit_bytes(compiler.upvalues[i].is_local ? 1 : 0,
+		emit_bytes(parser, compiler.upvalues[i].is_local ? 1 : 0,
 			   compiler.upvalues[i].index);
 }
 
-static void lambda(bool can_assign)
+static void lambda(struct parser *parser, bool can_assign)
 {
-	function(TYPE_LAMBDA);
+	function(parser, TYPE_LAMBDA);
 }
 
-static void function_declaration(void)
+static void function_declaration(struct parser *parser)
 {
-	uint8_t global = parse_variable("Expected function name.");
-	mark_initialized();
-	function(TYPE_FUNCTION);
-	define_variable(global);
+	uint8_t global = parse_variable(parser, "Expected function name.");
+	mark_initialized(parser);
+	function(parser, TYPE_FUNCTION);
+	define_variable(parser, global);
+}
+
+static void method(struct parser *parser)
+{
+	uint32_t constant;
+	enum function_type type = TYPE_METHOD;
+
+	consume(parser, TOKEN_IDENTIFIER, "Expected method name.");
+	constant = identifier_constant(parser, &parser->previous);
+	if (parser->previous.length == 4 &&
+	    memcmp(parser->previous.start, "init", 4) == 0)
+		type = TYPE_INITIALIZER;
+	function(parser, type);
+	emit_long_operand(parser, OP_METHOD, constant);
 }
 
-static void declaration(void)
+/**
+ * class_declaration() - Compile a class with its methods.
+ *
+ * The class is bound to its name before the methods are compiled, so they
+ * can refer to it. With a superclass, a scope holding it as local "super"
+ * encloses the methods, so super calls find it as upvalue.
+ */
+static void class_declaration(struct parser *parser)
 {
-	if (match(TOKEN_FUN))
-		function_declaration();
-	else if (match(TOKEN_VAR))
-		variable_declaration();
+	struct class_compiler class_compiler;
+	struct token class_name;
+	uint32_t constant;
+
+	consume(parser, TOKEN_IDENTIFIER, "Expected class name.");
+	class_name = parser->previous;
+	constant = identifier_constant(parser, &parser->previous);
+	declare_variable(parser);
+
+	emit_long_operand(parser, OP_CLASS, constant);
+	define_variable(parser, constant);
+
+	class_compiler.enclosing = parser->class_compiler;
+	class_compiler.has_superclass = false;
+	parser->class_compiler = &class_compiler;
+
+	if (match(parser, TOKEN_LESS)) {
+		consume(parser, TOKEN_IDENTIFIER, "Expected superclass name.");
+		variable(parser, false);
+		if (identifiers_equal(&class_name, &parser->previous))
+			error(parser, "A class cannot inherit from itself.");
+
+		begin_scope(parser);
+		add_local(parser, synthetic_token("super"));
+		define_variable(parser, 0);
+
+		named_variable(parser, class_name, false);
+		emit_byte(parser, OP_INHERIT);
+		class_compiler.has_superclass = true;
+	}
+
+	named_variable(parser, class_name, false);
+	consume(parser, TOKEN_LEFT_BRACE, "Expected '{' before class body.");
+	while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+		method(parser);
+	consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after class body.");
+	emit_byte(parser, OP_POP);
+
+	if (class_compiler.has_superclass)
+		end_scope(parser);
+	parser->class_compiler = class_compiler.enclosing;
+}
+
+static void declaration(struct parser *parser)
+{
+	if (match(parser, TOKEN_CLASS))
+		class_declaration(parser);
+	else if (match(parser, TOKEN_FUN))
+		function_declaration(parser);
+	else if (match(parser, TOKEN_VAR))
+		variable_declaration(parser);
+	else if (match(parser, TOKEN_LET))
+		let_declaration(parser);
 	else
-		statement();
+		statement(parser);
 
-	if (parser.panic_mode)
-		synchronize();
+	if (parser->panic_mode)
+		synchronize(parser);
 }
 
 // clang-format off
@@ -955,9 +2021,11 @@ struct parse_rule rules[] = {
 	[TOKEN_RIGHT_PAREN]	= { NULL,	NULL,		PREC_NONE },
 	[TOKEN_LEFT_BRACE]	= { NULL,	NULL,		PREC_NONE },
 	[TOKEN_RIGHT_BRACE]	= { NULL,	NULL,		PREC_NONE },
+	[TOKEN_LEFT_BRACKET]	= { array,	subscript,	PREC_CALL },
+	[TOKEN_RIGHT_BRACKET]	= { NULL,	NULL,		PREC_NONE },
 	[TOKEN_COMMA]		= { NULL,	NULL,		PREC_NONE },
 	[TOKEN_COLON]		= { NULL,	NULL,		PREC_NONE },
-	[TOKEN_DOT]		= { NULL,	NULL,		PREC_NONE },
+	[TOKEN_DOT]		= { NULL,	dot,		PREC_CALL },
 	[TOKEN_MINUS]		= { unary,	binary,		PREC_TERM },
 	[TOKEN_PLUS]		= { NULL,	binary,		PREC_TERM },
 	[TOKEN_QUESTION]	= { NULL,	ternary,	PREC_TERNARY },
@@ -982,15 +2050,17 @@ struct parse_rule rules[] = {
 	[TOKEN_FOR]		= { NULL,	NULL,		PREC_NONE },
 	[TOKEN_FUN]		= { lambda,	NULL,		PREC_NONE },
 	[TOKEN_IF]		= { NULL,	NULL,		PREC_NONE },
+	[TOKEN_LET]		= { NULL,	NULL,		PREC_NONE },
 	[TOKEN_NIL]		= { literal,	NULL,		PREC_NONE },
 	[TOKEN_OR]		= { NULL,	or_,		PREC_OR },
 	[TOKEN_PRINT]		= { NULL,	NULL,		PREC_NONE },
 	[TOKEN_RETURN]		= { NULL,	NULL,		PREC_NONE },
-	[TOKEN_SUPER]		= { NULL,	NULL,		PREC_NONE },
-	[TOKEN_THIS]		= { NULL,	NULL,		PREC_NONE },
+	[TOKEN_SUPER]		= { super_,	NULL,		PREC_NONE },
+	[TOKEN_THIS]		= { this_,	NULL,		PREC_NONE },
 	[TOKEN_TRUE]		= { literal,	NULL,		PREC_NONE },
 	[TOKEN_VAR]		= { NULL,	NULL,		PREC_NONE },
 	[TOKEN_WHILE]		= { NULL,	NULL,		PREC_NONE },
+	[TOKEN_YIELD]		= { yield,	NULL,		PREC_NONE },
 	[TOKEN_ERROR]		= { NULL,	NULL,		PREC_NONE },
 	[TOKEN_EOF]		= { NULL,	NULL,		PREC_NONE },
 };
@@ -1001,24 +2071,48 @@ static struct parse_rule *get_rule(enum token_type token_type)
 	return rules + token_type;
 }
 
-struct object_function *compile(char *source)
+/**
+ * compile() - Compile the source read by @scanner to the top level
+ * function of a script.
+ * @vm: The VM that owns the objects created while compiling.
+ *
+ * Return: The function or NULL if the source had compile errors.
+ */
+struct object_function *compile(struct vm *vm, struct scanner *scanner)
 {
+	struct parser parser;
 	struct compiler compiler;
 	struct object_function *function;
 
-	init_scanner(source);
-	init_compiler(&compiler, TYPE_SCRIPT);
-
+	parser.vm = vm;
+	parser.compiler = NULL;
+	parser.class_compiler = NULL;
+	parser.callee.function = NULL;
+	parser.tape.tokens = NULL;
+	parser.tape.length = 0;
+	parser.tape.capacity = 0;
+	parser.tape.recording = 0;
+	parser.tape.position = 0;
+	parser.tape.replaying = false;
+	parser.tape.failed = false;
 	parser.had_error = false;
 	parser.panic_mode = false;
+	parser.scanner = scanner;
+	init_table(&parser.constants);
+	init_compiler(&parser, &compiler, TYPE_SCRIPT);
 
-	advance();
+	advance(&parser);
 
-	while (!match(TOKEN_EOF)) {
-		declaration();
+	while (!match(&parser, TOKEN_EOF)) {
+		declaration(&parser);
 	}
 
-	function = end_compiler();
+	function = end_compiler(&parser);
+	if (!parser.had_error)
+		table_add_all(vm, &vm->constants, &parser.constants);
+	free_table(vm, &parser.constants);
+	FREE_ARRAY(vm, MEMORY_CODE, struct token, parser.tape.tokens,
+		   parser.tape.capacity);
 
 	return !parser.had_error ? function : NULL;
 }
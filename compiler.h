@@ -4,8 +4,9 @@
 #include "common.h"
 #include "chunk.h"
 #include "object.h"
+#include "scanner.h"
 #include "vm.h"
 
-struct object_function *compile(char *source);
+struct object_function *compile(struct vm *vm, struct scanner *scanner);
 
 #endif
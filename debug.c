@@ -7,12 +7,68 @@
 #include "object.h"
 #include "value.h"
 
+static const char *op_code_names[] = {
+	[OP_CONSTANT] = "OP_CONSTANT",
+	[OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+	[OP_NIL] = "OP_NIL",
+	[OP_TRUE] = "OP_TRUE",
+	[OP_FALSE] = "OP_FALSE",
+	[OP_NOT] = "OP_NOT",
+	[OP_NEGATE] = "OP_NEGATE",
+	[OP_ADD] = "OP_ADD",
+	[OP_SUB] = "OP_SUB",
+	[OP_MUL] = "OP_MUL",
+	[OP_DIV] = "OP_DIV",
+	[OP_EQUAL] = "OP_EQUAL",
+	[OP_LESS] = "OP_LESS",
+	[OP_GREATER] = "OP_GREATER",
+	[OP_PRINT] = "OP_PRINT",
+	[OP_POP] = "OP_POP",
+	[OP_POPN] = "OP_POPN",
+	[OP_PICK] = "OP_PICK",
+	[OP_NIP] = "OP_NIP",
+	[OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+	[OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+	[OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+	[OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+	[OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+	[OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+	[OP_GET_LOCAL] = "OP_GET_LOCAL",
+	[OP_SET_LOCAL] = "OP_SET_LOCAL",
+	[OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+	[OP_JUMP] = "OP_JUMP",
+	[OP_LOOP] = "OP_LOOP",
+	[OP_CALL] = "OP_CALL",
+	[OP_CALL_CURRIED] = "OP_CALL_CURRIED",
+	[OP_CLOSURE] = "OP_CLOSURE",
+	[OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+	[OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+	[OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+	[OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+	[OP_RETURN] = "OP_RETURN",
+	[OP_YIELD] = "OP_YIELD",
+	[OP_ARRAY] = "OP_ARRAY",
+	[OP_GET_INDEX] = "OP_GET_INDEX",
+	[OP_SET_INDEX] = "OP_SET_INDEX",
+	[OP_CLASS] = "OP_CLASS",
+	[OP_METHOD] = "OP_METHOD",
+	[OP_INHERIT] = "OP_INHERIT",
+	[OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+	[OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+	[OP_GET_SUPER] = "OP_GET_SUPER",
+	[OP_INVOKE] = "OP_INVOKE",
+	[OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+};
+
 static void print_type(value_t value)
 {
 	switch (value.value_type) {
 	case VALUE_NUMBER:
 		printf("number");
 		break;
+	case VALUE_INTEGER:
+		printf("integer");
+		break;
 	case VALUE_BOOLEAN:
 		printf("boolean");
 		break;
@@ -37,6 +93,30 @@ static void print_type(value_t value)
 		case OBJECT_UPVALUE:
 			printf(">upvalue");
 			break;
+		case OBJECT_CHANNEL:
+			printf(">channel");
+			break;
+		case OBJECT_COROUTINE:
+			printf(">coroutine");
+			break;
+		case OBJECT_ARRAY:
+			printf(">array");
+			break;
+		case OBJECT_MAP:
+			printf(">map");
+			break;
+		case OBJECT_FLOAT64_ARRAY:
+			printf(">float64-array");
+			break;
+		case OBJECT_CLASS:
+			printf(">class");
+			break;
+		case OBJECT_INSTANCE:
+			printf(">instance");
+			break;
+		case OBJECT_BOUND_METHOD:
+			printf(">bound_method");
+			break;
 		default:
 			fprintf(stderr,
 				"Unknown object type given to print_type.");
@@ -57,6 +137,8 @@ static void repr_value(value_t value)
 	switch (value.value_type) {
 	case VALUE_NUMBER:
 		break;
+	case VALUE_INTEGER:
+		break;
 	case VALUE_BOOLEAN:
 		break;
 	case VALUE_NIL:
@@ -88,6 +170,42 @@ static void repr_value(value_t value)
 			printf(" value-ptr:%p",
 			       AS_OBJ_UPVALUE(value)->location);
 			break;
+		case OBJECT_CHANNEL:
+			printf(" channel-ptr:%p", AS_OBJ_CHANNEL(value));
+			break;
+		case OBJECT_COROUTINE:
+			printf(" closure-ptr:%p",
+			       AS_OBJ_COROUTINE(value)->closure);
+			break;
+		case OBJECT_ARRAY:
+			printf(" len:%4d values-ptr:%p",
+			       AS_OBJ_ARRAY(value)->values.length,
+			       AS_OBJ_ARRAY(value)->values.values);
+			break;
+		case OBJECT_MAP:
+			printf(" count:%4d entries-ptr:%p",
+			       AS_OBJ_MAP(value)->map.count,
+			       AS_OBJ_MAP(value)->map.entries);
+			break;
+		case OBJECT_FLOAT64_ARRAY:
+			printf(" len:%4d values-ptr:%p",
+			       AS_OBJ_FLOAT64_ARRAY(value)->length,
+			       AS_OBJ_FLOAT64_ARRAY(value)->values);
+			break;
+		case OBJECT_CLASS:
+			printf(" name:%s shape-ptr:%p",
+			       AS_OBJ_CLASS(value)->name->characters,
+			       AS_OBJ_CLASS(value)->shape);
+			break;
+		case OBJECT_INSTANCE:
+			printf(" shape-ptr:%p fields-ptr:%p",
+			       AS_OBJ_INSTANCE(value)->shape,
+			       AS_OBJ_INSTANCE(value)->fields);
+			break;
+		case OBJECT_BOUND_METHOD:
+			printf(" method-ptr:%p",
+			       AS_OBJ_BOUND_METHOD(value)->method);
+			break;
 		default:
 			fprintf(stderr,
 				"Unknown object type given to repr_value.");
@@ -220,6 +338,44 @@ static int32_t long_closure_instruction(struct chunk *chunk, int32_t offset)
 	return offset + 4;
 }
 
+static int32_t property_instruction(char *name, struct chunk *chunk,
+				    int32_t offset)
+{
+	uint16_t site = (uint16_t)(chunk->code[offset + 1] << 8) |
+			chunk->code[offset + 2];
+	printf("%-16s %4d '%s'\n", name, site,
+	       chunk->sites[site].name->characters);
+	return offset + 3;
+}
+
+static int32_t call_instruction(struct chunk *chunk, int32_t offset)
+{
+	uint16_t site = (uint16_t)(chunk->code[offset + 2] << 8) |
+			chunk->code[offset + 3];
+	printf("%-16s %4d site %d\n", "OP_CALL", chunk->code[offset + 1],
+	       site);
+	return offset + 4;
+}
+
+static int32_t curried_call_instruction(struct chunk *chunk, int32_t offset)
+{
+	uint16_t site = (uint16_t)(chunk->code[offset + 3] << 8) |
+			chunk->code[offset + 4];
+	printf("%-16s %4d site %d then %d\n", "OP_CALL_CURRIED",
+	       chunk->code[offset + 2], site, chunk->code[offset + 1]);
+	return offset + 5;
+}
+
+static int32_t invoke_instruction(char *name, struct chunk *chunk,
+				  int32_t offset)
+{
+	uint16_t site = (uint16_t)(chunk->code[offset + 1] << 8) |
+			chunk->code[offset + 2];
+	printf("%-16s (%d args) %4d '%s'\n", name, chunk->code[offset + 3],
+	       site, chunk->sites[site].name->characters);
+	return offset + 4;
+}
+
 int32_t disassemble_instruction(struct chunk *chunk, int32_t offset)
 {
 	uint8_t instruction;
@@ -268,6 +424,10 @@ int32_t disassemble_instruction(struct chunk *chunk, int32_t offset)
 		return simple_instruction("OP_POP", offset);
 	case OP_POPN:
 		return numbered_instruction("OP_POPN", chunk, offset);
+	case OP_PICK:
+		return numbered_instruction("OP_PICK", chunk, offset);
+	case OP_NIP:
+		return numbered_instruction("OP_NIP", chunk, offset);
 	case OP_DEFINE_GLOBAL:
 		return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
 	case OP_DEFINE_GLOBAL_LONG:
@@ -294,7 +454,9 @@ int32_t disassemble_instruction(struct chunk *chunk, int32_t offset)
 	case OP_LOOP:
 		return jump_instruction("OP_LOOP", -1, chunk, offset);
 	case OP_CALL:
-		return byte_instruction("OP_CALL", chunk, offset);
+		return call_instruction(chunk, offset);
+	case OP_CALL_CURRIED:
+		return curried_call_instruction(chunk, offset);
 	case OP_CLOSURE:
 		return closure_instruction(chunk, offset);
 	case OP_CLOSURE_LONG:
@@ -307,8 +469,40 @@ int32_t disassemble_instruction(struct chunk *chunk, int32_t offset)
 		return simple_instruction("OP_CLOSE_UPVALUE", offset);
 	case OP_RETURN:
 		return simple_instruction("OP_RETURN", offset);
+	case OP_YIELD:
+		return simple_instruction("OP_YIELD", offset);
+	case OP_ARRAY:
+		return numbered_instruction("OP_ARRAY", chunk, offset);
+	case OP_GET_INDEX:
+		return simple_instruction("OP_GET_INDEX", offset);
+	case OP_SET_INDEX:
+		return simple_instruction("OP_SET_INDEX", offset);
+	case OP_CLASS:
+		return long_constant_instruction("OP_CLASS", chunk, offset);
+	case OP_METHOD:
+		return long_constant_instruction("OP_METHOD", chunk, offset);
+	case OP_INHERIT:
+		return simple_instruction("OP_INHERIT", offset);
+	case OP_GET_PROPERTY:
+		return property_instruction("OP_GET_PROPERTY", chunk, offset);
+	case OP_SET_PROPERTY:
+		return property_instruction("OP_SET_PROPERTY", chunk, offset);
+	case OP_GET_SUPER:
+		return property_instruction("OP_GET_SUPER", chunk, offset);
+	case OP_INVOKE:
+		return invoke_instruction("OP_INVOKE", chunk, offset);
+	case OP_SUPER_INVOKE:
+		return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
 	default:
 		printf("unknown instruction %d\n", instruction);
 		return offset + 1;
 	}
 }
+
+const char *op_code_name(uint8_t instruction)
+{
+	if (instruction >= sizeof(op_code_names) / sizeof(op_code_names[0]) ||
+	    op_code_names[instruction] == NULL)
+		return "OP_UNKNOWN";
+	return op_code_names[instruction];
+}
@@ -5,5 +5,6 @@
 
 void disassemble_chunk(struct chunk *chunk, char *name);
 int32_t disassemble_instruction(struct chunk *chunk, int32_t offset);
+const char *op_code_name(uint8_t instruction);
 
 #endif
@@ -0,0 +1,466 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "common.h"
+#include "kernels.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+ * Bulk operations on float64 arrays. The reductions keep four partial
+ * results, lane i of them takes the elements at indices i mod 4. With SSE2
+ * these are two registers of two doubles, without it four scalars, and
+ * both combine them in the same order, so results don't depend on the
+ * build. Element-wise kernels are plain loops over restrict pointers that
+ * the compiler vectorizes.
+ *
+ * Vectors are loaded with _mm_load_pd(), which relies on the storage of
+ * float64 arrays being aligned to FLOAT64_ALIGNMENT.
+ */
+
+#ifdef __SSE2__
+static inline double horizontal_sum(__m128d low, __m128d high)
+{
+	__m128d sum = _mm_add_pd(low, high);
+
+	return _mm_cvtsd_f64(sum) + _mm_cvtsd_f64(_mm_unpackhi_pd(sum, sum));
+}
+
+double kernel_sum(const double *x, int32_t length)
+{
+	__m128d low = _mm_setzero_pd(), high = _mm_setzero_pd();
+	double sum;
+	int32_t i;
+
+	for (i = 0; i + 4 <= length; i += 4) {
+		low = _mm_add_pd(low, _mm_load_pd(x + i));
+		high = _mm_add_pd(high, _mm_load_pd(x + i + 2));
+	}
+	sum = horizontal_sum(low, high);
+	for (; i < length; i++)
+		sum += x[i];
+	return sum;
+}
+
+double kernel_dot(const double *x, const double *y, int32_t length)
+{
+	__m128d low = _mm_setzero_pd(), high = _mm_setzero_pd();
+	double sum;
+	int32_t i;
+
+	for (i = 0; i + 4 <= length; i += 4) {
+		low = _mm_add_pd(low, _mm_mul_pd(_mm_load_pd(x + i),
+						 _mm_load_pd(y + i)));
+		high = _mm_add_pd(high, _mm_mul_pd(_mm_load_pd(x + i + 2),
+						   _mm_load_pd(y + i + 2)));
+	}
+	sum = horizontal_sum(low, high);
+	for (; i < length; i++)
+		sum += x[i] * y[i];
+	return sum;
+}
+
+/**
+ * kernel_min() - Smallest element of the @length > 0 elements at @x.
+ *
+ * NaN elements are skipped unless the first element is NaN.
+ */
+double kernel_min(const double *x, int32_t length)
+{
+	__m128d low = _mm_set1_pd(x[0]), high = low;
+	double result, lane;
+	int32_t i;
+
+	for (i = 0; i + 4 <= length; i += 4) {
+		low = _mm_min_pd(_mm_load_pd(x + i), low);
+		high = _mm_min_pd(_mm_load_pd(x + i + 2), high);
+	}
+	low = _mm_min_pd(high, low);
+	result = _mm_cvtsd_f64(low);
+	lane = _mm_cvtsd_f64(_mm_unpackhi_pd(low, low));
+	result = lane < result ? lane : result;
+	for (; i < length; i++)
+		result = x[i] < result ? x[i] : result;
+	return result;
+}
+
+/**
+ * kernel_max() - Largest element of the @length > 0 elements at @x.
+ *
+ * NaN elements are skipped unless the first element is NaN.
+ */
+double kernel_max(const double *x, int32_t length)
+{
+	__m128d low = _mm_set1_pd(x[0]), high = low;
+	double result, lane;
+	int32_t i;
+
+	for (i = 0; i + 4 <= length; i += 4) {
+		low = _mm_max_pd(_mm_load_pd(x + i), low);
+		high = _mm_max_pd(_mm_load_pd(x + i + 2), high);
+	}
+	low = _mm_max_pd(high, low);
+	result = _mm_cvtsd_f64(low);
+	lane = _mm_cvtsd_f64(_mm_unpackhi_pd(low, low));
+	result = lane > result ? lane : result;
+	for (; i < length; i++)
+		result = x[i] > result ? x[i] : result;
+	return result;
+}
+#else
+double kernel_sum(const double *x, int32_t length)
+{
+	double lanes[4] = { 0, 0, 0, 0 }, sum;
+	int32_t i;
+
+	for (i = 0; i + 4 <= length; i += 4) {
+		lanes[0] += x[i];
+		lanes[1] += x[i + 1];
+		lanes[2] += x[i + 2];
+		lanes[3] += x[i + 3];
+	}
+	sum = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+	for (; i < length; i++)
+		sum += x[i];
+	return sum;
+}
+
+double kernel_dot(const double *x, const double *y, int32_t length)
+{
+	double lanes[4] = { 0, 0, 0, 0 }, sum;
+	int32_t i;
+
+	for (i = 0; i + 4 <= length; i += 4) {
+		lanes[0] += x[i] * y[i];
+		lanes[1] += x[i + 1] * y[i + 1];
+		lanes[2] += x[i + 2] * y[i + 2];
+		lanes[3] += x[i + 3] * y[i + 3];
+	}
+	sum = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+	for (; i < length; i++)
+		sum += x[i] * y[i];
+	return sum;
+}
+
+double kernel_min(const double *x, int32_t length)
+{
+	double lanes[4] = { x[0], x[0], x[0], x[0] }, result;
+	int32_t i, j;
+
+	for (i = 0; i + 4 <= length; i += 4)
+		for (j = 0; j < 4; j++)
+			lanes[j] = x[i + j] < lanes[j] ? x[i + j] : lanes[j];
+	lanes[0] = lanes[2] < lanes[0] ? lanes[2] : lanes[0];
+	lanes[1] = lanes[3] < lanes[1] ? lanes[3] : lanes[1];
+	result = lanes[1] < lanes[0] ? lanes[1] : lanes[0];
+	for (; i < length; i++)
+		result = x[i] < result ? x[i] : result;
+	return result;
+}
+
+double kernel_max(const double *x, int32_t length)
+{
+	double lanes[4] = { x[0], x[0], x[0], x[0] }, result;
+	int32_t i, j;
+
+	for (i = 0; i + 4 <= length; i += 4)
+		for (j = 0; j < 4; j++)
+			lanes[j] = x[i + j] > lanes[j] ? x[i + j] : lanes[j];
+	lanes[0] = lanes[2] > lanes[0] ? lanes[2] : lanes[0];
+	lanes[1] = lanes[3] > lanes[1] ? lanes[3] : lanes[1];
+	result = lanes[1] > lanes[0] ? lanes[1] : lanes[0];
+	for (; i < length; i++)
+		result = x[i] > result ? x[i] : result;
+	return result;
+}
+#endif
+
+void kernel_scale(double *x, double a, int32_t length)
+{
+	int32_t i;
+
+	for (i = 0; i < length; i++)
+		x[i] *= a;
+}
+
+static inline void axpy_disjoint(double a, const double *restrict x,
+				 double *restrict y, int32_t length)
+{
+	int32_t i;
+
+	for (i = 0; i < length; i++)
+		y[i] += a * x[i];
+}
+
+/**
+ * kernel_axpy() - Add @a times @x to @y.
+ *
+ * Float64 arrays never overlap partially, so @x is either @y or disjoint
+ * from it, and only the latter is handed to the restrict loop.
+ */
+void kernel_axpy(double a, const double *x, double *y, int32_t length)
+{
+	int32_t i;
+
+	if (x != y) {
+		axpy_disjoint(a, x, y, length);
+		return;
+	}
+	for (i = 0; i < length; i++)
+		y[i] += a * y[i];
+}
+
+void kernel_add(const double *x, const double *y, double *restrict result,
+		int32_t length)
+{
+	int32_t i;
+
+	for (i = 0; i < length; i++)
+		result[i] = x[i] + y[i];
+}
+
+void kernel_mul(const double *x, const double *y, double *restrict result,
+		int32_t length)
+{
+	int32_t i;
+
+	for (i = 0; i < length; i++)
+		result[i] = x[i] * y[i];
+}
+
+/**
+ * kernel_prefix_sum() - Replace every element by the sum of it and all
+ * elements before it.
+ *
+ * Each sum depends on the one before, so this stays a scalar loop.
+ */
+void kernel_prefix_sum(double *x, int32_t length)
+{
+	int32_t i;
+
+	for (i = 1; i < length; i++)
+		x[i] += x[i - 1];
+}
+
+static value_t float64_array_value(struct object_float64_array *array)
+{
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	return CONS_OBJECT(array);
+#pragma clang diagnostic pop
+}
+
+/**
+ * float64_array_native() - Create a float64 array of as many zeros as the
+ * argument says, or a copy of an array of numbers.
+ */
+static value_t float64_array_native(struct vm *vm, int arg_count,
+				    value_t *args)
+{
+	struct object_float64_array *result;
+	struct value_array *values;
+	double length;
+	int32_t i;
+
+	if (arg_count == 1 && IS_NUMBER(args[0])) {
+		length = AS_NUMBER(args[0]);
+		if (!(length >= 0 && length <= INT32_MAX) ||
+		    length != (int32_t)length)
+			return native_error(vm, "float64_array() expects a "
+						"non-negative integer length.");
+		return float64_array_value(new_float64_array(vm, length));
+	}
+	if (arg_count != 1 || !IS_ARRAY(args[0]))
+		return native_error(vm, "float64_array() expects a length or "
+					"an array of numbers.");
+
+	values = &AS_OBJ_ARRAY(args[0])->values;
+	for (i = 0; i < values->length; i++)
+		if (!IS_NUMBER(values->values[i]))
+			return native_error(vm, "Float64 arrays can only hold "
+						"numbers.");
+	result = new_float64_array(vm, values->length);
+	for (i = 0; i < values->length; i++)
+		result->values[i] = AS_NUMBER(values->values[i]);
+	return float64_array_value(result);
+}
+
+static value_t float64_sum_native(struct vm *vm, int arg_count,
+				  value_t *args)
+{
+	struct object_float64_array *x;
+
+	if (arg_count != 1 || !IS_FLOAT64_ARRAY(args[0]))
+		return native_error(vm, "float64_sum() expects a float64 "
+					"array.");
+	x = AS_OBJ_FLOAT64_ARRAY(args[0]);
+	return CONS_NUMBER(kernel_sum(x->values, x->length));
+}
+
+/**
+ * same_length() - Check that @args are float64 arrays of equal length.
+ */
+static bool same_length(value_t *args, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (!IS_FLOAT64_ARRAY(args[i]) ||
+		    AS_OBJ_FLOAT64_ARRAY(args[i])->length !=
+			    AS_OBJ_FLOAT64_ARRAY(args[0])->length)
+			return false;
+	return true;
+}
+
+static value_t float64_dot_native(struct vm *vm, int arg_count,
+				  value_t *args)
+{
+	struct object_float64_array *x, *y;
+
+	if (arg_count != 2 || !same_length(args, 2))
+		return native_error(vm, "float64_dot() expects two float64 "
+					"arrays of the same length.");
+	x = AS_OBJ_FLOAT64_ARRAY(args[0]);
+	y = AS_OBJ_FLOAT64_ARRAY(args[1]);
+	return CONS_NUMBER(kernel_dot(x->values, y->values, x->length));
+}
+
+/**
+ * float64_min_native() - Smallest element of a float64 array, nil if it
+ * is empty.
+ */
+static value_t float64_min_native(struct vm *vm, int arg_count,
+				  value_t *args)
+{
+	struct object_float64_array *x;
+
+	if (arg_count != 1 || !IS_FLOAT64_ARRAY(args[0]))
+		return native_error(vm, "float64_min() expects a float64 "
+					"array.");
+	x = AS_OBJ_FLOAT64_ARRAY(args[0]);
+	if (x->length == 0)
+		return CONS_NIL;
+	return CONS_NUMBER(kernel_min(x->values, x->length));
+}
+
+/**
+ * float64_max_native() - Largest element of a float64 array, nil if it
+ * is empty.
+ */
+static value_t float64_max_native(struct vm *vm, int arg_count,
+				  value_t *args)
+{
+	struct object_float64_array *x;
+
+	if (arg_count != 1 || !IS_FLOAT64_ARRAY(args[0]))
+		return native_error(vm, "float64_max() expects a float64 "
+					"array.");
+	x = AS_OBJ_FLOAT64_ARRAY(args[0]);
+	if (x->length == 0)
+		return CONS_NIL;
+	return CONS_NUMBER(kernel_max(x->values, x->length));
+}
+
+/**
+ * float64_scale_native() - Multiply every element of the float64 array
+ * given first by the second argument, in place.
+ */
+static value_t float64_scale_native(struct vm *vm, int arg_count,
+				    value_t *args)
+{
+	struct object_float64_array *x;
+
+	if (arg_count != 2 || !IS_FLOAT64_ARRAY(args[0]) ||
+	    !IS_NUMBER(args[1]))
+		return native_error(vm, "float64_scale() expects a float64 "
+					"array and a number.");
+	x = AS_OBJ_FLOAT64_ARRAY(args[0]);
+	kernel_scale(x->values, AS_NUMBER(args[1]), x->length);
+	return CONS_NIL;
+}
+
+/**
+ * float64_axpy_native() - float64_axpy(a, x, y) adds a * x to the float64
+ * array y, in place.
+ */
+static value_t float64_axpy_native(struct vm *vm, int arg_count,
+				   value_t *args)
+{
+	struct object_float64_array *x, *y;
+
+	if (arg_count != 3 || !IS_NUMBER(args[0]) ||
+	    !same_length(args + 1, 2))
+		return native_error(vm, "float64_axpy() expects a number and "
+					"two float64 arrays of the same "
+					"length.");
+	x = AS_OBJ_FLOAT64_ARRAY(args[1]);
+	y = AS_OBJ_FLOAT64_ARRAY(args[2]);
+	kernel_axpy(AS_NUMBER(args[0]), x->values, y->values, y->length);
+	return CONS_NIL;
+}
+
+/**
+ * float64_add_native() - Element-wise sum of two float64 arrays as new
+ * array.
+ */
+static value_t float64_add_native(struct vm *vm, int arg_count,
+				  value_t *args)
+{
+	struct object_float64_array *x, *y, *result;
+
+	if (arg_count != 2 || !same_length(args, 2))
+		return native_error(vm, "float64_add() expects two float64 "
+					"arrays of the same length.");
+	x = AS_OBJ_FLOAT64_ARRAY(args[0]);
+	y = AS_OBJ_FLOAT64_ARRAY(args[1]);
+	result = new_float64_array(vm, x->length);
+	kernel_add(x->values, y->values, result->values, x->length);
+	return float64_array_value(result);
+}
+
+/**
+ * float64_mul_native() - Element-wise product of two float64 arrays as
+ * new array.
+ */
+static value_t float64_mul_native(struct vm *vm, int arg_count,
+				  value_t *args)
+{
+	struct object_float64_array *x, *y, *result;
+
+	if (arg_count != 2 || !same_length(args, 2))
+		return native_error(vm, "float64_mul() expects two float64 "
+					"arrays of the same length.");
+	x = AS_OBJ_FLOAT64_ARRAY(args[0]);
+	y = AS_OBJ_FLOAT64_ARRAY(args[1]);
+	result = new_float64_array(vm, x->length);
+	kernel_mul(x->values, y->values, result->values, x->length);
+	return float64_array_value(result);
+}
+
+static value_t float64_prefix_sum_native(struct vm *vm, int arg_count,
+					 value_t *args)
+{
+	struct object_float64_array *x;
+
+	if (arg_count != 1 || !IS_FLOAT64_ARRAY(args[0]))
+		return native_error(vm, "float64_prefix_sum() expects a "
+					"float64 array.");
+	x = AS_OBJ_FLOAT64_ARRAY(args[0]);
+	kernel_prefix_sum(x->values, x->length);
+	return CONS_NIL;
+}
+
+void define_kernel_natives(struct vm *vm)
+{
+	define_native_fn(vm, "float64_array", float64_array_native);
+	define_native_fn(vm, "float64_sum", float64_sum_native);
+	define_native_fn(vm, "float64_dot", float64_dot_native);
+	define_native_fn(vm, "float64_min", float64_min_native);
+	define_native_fn(vm, "float64_max", float64_max_native);
+	define_native_fn(vm, "float64_scale", float64_scale_native);
+	define_native_fn(vm, "float64_axpy", float64_axpy_native);
+	define_native_fn(vm, "float64_add", float64_add_native);
+	define_native_fn(vm, "float64_mul", float64_mul_native);
+	define_native_fn(vm, "float64_prefix_sum", float64_prefix_sum_native);
+}
@@ -0,0 +1,22 @@
+#ifndef clox_kernels_h
+#define clox_kernels_h
+
+#include "common.h"
+
+struct vm;
+
+double kernel_sum(const double *x, int32_t length);
+double kernel_dot(const double *x, const double *y, int32_t length);
+double kernel_min(const double *x, int32_t length);
+double kernel_max(const double *x, int32_t length);
+void kernel_scale(double *x, double a, int32_t length);
+void kernel_axpy(double a, const double *x, double *y, int32_t length);
+void kernel_add(const double *x, const double *y, double *result,
+		int32_t length);
+void kernel_mul(const double *x, const double *y, double *result,
+		int32_t length);
+void kernel_prefix_sum(double *x, int32_t length);
+
+void define_kernel_natives(struct vm *vm);
+
+#endif
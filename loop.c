@@ -0,0 +1,617 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "loop.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define READ_CHUNK 4096
+
+/*
+ * Scripts register callbacks for file descriptors and timers, run_loop()
+ * then waits with poll() and calls them until nothing is left to wait for.
+ * Every descriptor handed out is non-blocking, so read() and write() return
+ * false instead of stalling the loop.
+ */
+
+void init_loop(struct loop *loop)
+{
+	loop->watchers = NULL;
+	loop->fds = NULL;
+	loop->watcher_count = 0;
+	loop->watcher_capacity = 0;
+	loop->slots = NULL;
+	loop->owned = NULL;
+	loop->slot_count = 0;
+	loop->timers = NULL;
+	loop->timer_count = 0;
+	loop->timer_capacity = 0;
+	loop->next_timer = 1;
+}
+
+void free_loop(struct vm *vm, struct loop *loop)
+{
+	FREE_ARRAY(vm, MEMORY_LOOP, struct watcher, loop->watchers,
+		   loop->watcher_capacity);
+	FREE_ARRAY(vm, MEMORY_LOOP, struct pollfd, loop->fds,
+		   loop->watcher_capacity);
+	FREE_ARRAY(vm, MEMORY_LOOP, int32_t, loop->slots, loop->slot_count);
+	FREE_ARRAY(vm, MEMORY_LOOP, bool, loop->owned, loop->slot_count);
+	FREE_ARRAY(vm, MEMORY_LOOP, struct timer, loop->timers,
+		   loop->timer_capacity);
+	init_loop(loop);
+}
+
+static double now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+bool is_fd(value_t value)
+{
+	return IS_NUMBER(value) && AS_NUMBER(value) >= 0 &&
+	       AS_NUMBER(value) <= INT32_MAX &&
+	       AS_NUMBER(value) == (int32_t)AS_NUMBER(value);
+}
+
+static void grow_slots(struct vm *vm, struct loop *loop, int fd)
+{
+	int32_t old_count = loop->slot_count, i;
+
+	if (fd < loop->slot_count)
+		return;
+	loop->slot_count = GROW_CAPACITY(fd + 1);
+	loop->slots = GROW_ARRAY(vm, MEMORY_LOOP, int32_t, loop->slots,
+				 old_count, loop->slot_count);
+	loop->owned = GROW_ARRAY(vm, MEMORY_LOOP, bool, loop->owned, old_count,
+				 loop->slot_count);
+	for (i = old_count; i < loop->slot_count; i++) {
+		loop->slots[i] = -1;
+		loop->owned[i] = false;
+	}
+}
+
+/**
+ * make_fd() - Turn @fd into a value after making it non-blocking.
+ *
+ * @fd is owned by the script from now on, it may close() it.
+ *
+ * Return: @fd as number, or nil if @fd is invalid.
+ */
+static value_t make_fd(struct vm *vm, int fd)
+{
+	int flags;
+
+	if (fd < 0)
+		return CONS_NIL;
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		close(fd);
+		return CONS_NIL;
+	}
+	grow_slots(vm, &vm->loop, fd);
+	vm->loop.owned[fd] = true;
+	return CONS_NUMBER(fd);
+}
+
+static int32_t find_watcher(struct loop *loop, int fd)
+{
+	return fd < loop->slot_count ? loop->slots[fd] : -1;
+}
+
+static int32_t add_watcher(struct vm *vm, struct loop *loop, int fd)
+{
+	int32_t old_capacity, index;
+
+	grow_slots(vm, loop, fd);
+	if (loop->watcher_count == loop->watcher_capacity) {
+		old_capacity = loop->watcher_capacity;
+		loop->watcher_capacity = GROW_CAPACITY(old_capacity);
+		loop->watchers = GROW_ARRAY(vm, MEMORY_LOOP, struct watcher,
+					    loop->watchers, old_capacity,
+					    loop->watcher_capacity);
+		loop->fds = GROW_ARRAY(vm, MEMORY_LOOP, struct pollfd,
+				       loop->fds, old_capacity,
+				       loop->watcher_capacity);
+	}
+
+	index = loop->watcher_count++;
+	loop->watchers[index].fd = fd;
+	loop->watchers[index].on_read = CONS_NIL;
+	loop->watchers[index].on_write = CONS_NIL;
+	loop->fds[index].fd = fd;
+	loop->fds[index].events = 0;
+	loop->fds[index].revents = 0;
+	loop->slots[fd] = index;
+	return index;
+}
+
+/**
+ * remove_watcher() - Stop watching the descriptor at @index.
+ *
+ * The last watcher takes the place of the removed one.
+ */
+static void remove_watcher(struct loop *loop, int32_t index)
+{
+	int32_t last = --loop->watcher_count;
+
+	loop->slots[loop->watchers[index].fd] = -1;
+	if (index == last)
+		return;
+	loop->watchers[index] = loop->watchers[last];
+	loop->fds[index] = loop->fds[last];
+	loop->slots[loop->watchers[index].fd] = index;
+}
+
+static void update_events(struct loop *loop, int32_t index)
+{
+	struct watcher *watcher = &loop->watchers[index];
+
+	if (IS_NIL(watcher->on_read) && IS_NIL(watcher->on_write)) {
+		remove_watcher(loop, index);
+		return;
+	}
+	loop->fds[index].events = (IS_NIL(watcher->on_read) ? 0 : POLLIN) |
+				  (IS_NIL(watcher->on_write) ? 0 : POLLOUT);
+}
+
+/**
+ * loop_close() - Close @fd and stop watching it.
+ *
+ * Only descriptors handed out by the natives of @vm can be closed. Others,
+ * like standard input and output, belong to the whole process.
+ */
+value_t loop_close(struct vm *vm, int fd)
+{
+	int32_t index = find_watcher(&vm->loop, fd);
+
+	if (fd >= vm->loop.slot_count || !vm->loop.owned[fd])
+		return native_error(vm, "File descriptor was not opened by "
+					"the script.");
+	vm->loop.owned[fd] = false;
+	if (index >= 0)
+		remove_watcher(&vm->loop, index);
+	if (close(fd) < 0)
+		return native_error(vm, "Could not close file descriptor.");
+	return CONS_NIL;
+}
+
+/**
+ * open_native() - Open the file at the given path.
+ *
+ * The mode is "r" to read, "w" to truncate and write or "a" to append.
+ * Returns the file descriptor or nil if the file can't be opened.
+ */
+static value_t open_native(struct vm *vm, int arg_count, value_t *args)
+{
+	const char *mode;
+	int flags;
+
+	if (arg_count != 2 || !IS_STRING(args[0]) || !IS_STRING(args[1]))
+		return native_error(vm, "open() expects a path and a mode.");
+
+	mode = AS_CSTRING(args[1]);
+	if (strcmp(mode, "r") == 0)
+		flags = O_RDONLY;
+	else if (strcmp(mode, "w") == 0)
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+	else if (strcmp(mode, "a") == 0)
+		flags = O_WRONLY | O_CREAT | O_APPEND;
+	else
+		return native_error(vm, "Mode must be \"r\", \"w\" or \"a\".");
+	return make_fd(vm, open(AS_CSTRING(args[0]), flags, 0644));
+}
+
+/**
+ * pipe_native() - Call the given function with both ends of a new pipe.
+ *
+ * Returns what the function returns.
+ */
+static value_t pipe_native(struct vm *vm, int arg_count, value_t *args)
+{
+	value_t ends[2], result;
+	int fds[2];
+
+	if (arg_count != 1 || !IS_CLOSURE(args[0]))
+		return native_error(vm, "pipe() expects a function.");
+	if (pipe(fds) < 0)
+		return native_error(vm, "Could not create pipe.");
+
+	// make_fd() closes an end it fails on, the other one is closed here
+	ends[0] = make_fd(vm, fds[0]);
+	ends[1] = make_fd(vm, fds[1]);
+	if (IS_NIL(ends[0]) || IS_NIL(ends[1])) {
+		if (!IS_NIL(ends[0]))
+			loop_close(vm, fds[0]);
+		if (!IS_NIL(ends[1]))
+			loop_close(vm, fds[1]);
+		return native_error(vm, "Could not create pipe.");
+	}
+	if (!call_function(vm, args[0], 2, ends, &result))
+		return CONS_NIL;
+	return result;
+}
+
+/**
+ * read_native() - Read what is available from a file descriptor.
+ *
+ * Returns a string of up to READ_CHUNK bytes, false if nothing is available
+ * yet and nil at the end of the file.
+ */
+static value_t read_native(struct vm *vm, int arg_count, value_t *args)
+{
+	char buffer[READ_CHUNK];
+	ssize_t length;
+
+	if (arg_count != 1 || !is_fd(args[0]))
+		return native_error(vm, "read() expects a file descriptor.");
+
+	length = read((int)AS_NUMBER(args[0]), buffer, sizeof(buffer));
+	if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return CONS_BOOLEAN(false);
+	if (length < 0)
+		return native_error(vm, "Could not read file descriptor.");
+	if (length == 0)
+		return CONS_NIL;
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	return CONS_OBJECT(copy_string(vm, buffer, (int32_t)length));
+#pragma clang diagnostic pop
+}
+
+/**
+ * write_native() - Write a string to a file descriptor.
+ *
+ * Returns the number of bytes written, which may be less than the length
+ * of the string, or false if the descriptor can't take any bytes yet.
+ */
+static value_t write_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct object_string *str;
+	ssize_t length;
+
+	if (arg_count != 2 || !is_fd(args[0]) || !IS_STRING(args[1]))
+		return native_error(vm, "write() expects a file descriptor "
+					"and a string.");
+
+	str = AS_OBJ_STRING(args[1]);
+	length = write((int)AS_NUMBER(args[0]), str->characters, str->length);
+	if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return CONS_BOOLEAN(false);
+	if (length < 0)
+		return native_error(vm, "Could not write file descriptor.");
+	return CONS_NUMBER((double)length);
+}
+
+/**
+ * watch_native() - Call a function whenever a file descriptor is ready.
+ *
+ * The direction is "read" or "write", the function is called with the file
+ * descriptor until unwatch() or close() is called for it. Watching the
+ * same direction again replaces the function.
+ */
+static value_t watch_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct loop *loop = &vm->loop;
+	const char *direction;
+	int32_t index;
+	int fd;
+
+	if (arg_count != 3 || !is_fd(args[0]) || !IS_STRING(args[1]) ||
+	    !IS_CLOSURE(args[2]))
+		return native_error(vm, "watch() expects a file descriptor, "
+					"a direction and a function.");
+
+	direction = AS_CSTRING(args[1]);
+	if (strcmp(direction, "read") != 0 && strcmp(direction, "write") != 0)
+		return native_error(vm, "Direction must be \"read\" or "
+					"\"write\".");
+
+	fd = (int)AS_NUMBER(args[0]);
+	index = find_watcher(loop, fd);
+	if (index < 0)
+		index = add_watcher(vm, loop, fd);
+	if (direction[0] == 'r')
+		loop->watchers[index].on_read = args[2];
+	else
+		loop->watchers[index].on_write = args[2];
+	update_events(loop, index);
+	return CONS_NIL;
+}
+
+/**
+ * unwatch_native() - Stop calling the functions of a file descriptor.
+ *
+ * Only the given direction is dropped when there is one.
+ */
+static value_t unwatch_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct loop *loop = &vm->loop;
+	const char *direction = NULL;
+	int32_t index;
+
+	if (arg_count < 1 || arg_count > 2 || !is_fd(args[0]) ||
+	    (arg_count == 2 && !IS_STRING(args[1])))
+		return native_error(vm, "unwatch() expects a file descriptor "
+					"and an optional direction.");
+
+	index = find_watcher(loop, (int)AS_NUMBER(args[0]));
+	if (index < 0)
+		return CONS_NIL;
+	if (arg_count == 2)
+		direction = AS_CSTRING(args[1]);
+	if (direction == NULL || strcmp(direction, "read") == 0)
+		loop->watchers[index].on_read = CONS_NIL;
+	if (direction == NULL || strcmp(direction, "write") == 0)
+		loop->watchers[index].on_write = CONS_NIL;
+	update_events(loop, index);
+	return CONS_NIL;
+}
+
+/**
+ * timer_native() - Call a function once after the given milliseconds.
+ *
+ * Returns the id of the timer.
+ */
+static value_t timer_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct loop *loop = &vm->loop;
+	struct timer *timer;
+	int32_t old_capacity;
+
+	if (arg_count != 2 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 ||
+	    !IS_CLOSURE(args[1]))
+		return native_error(vm, "timer() expects milliseconds and a "
+					"function.");
+
+	if (loop->timer_count == loop->timer_capacity) {
+		old_capacity = loop->timer_capacity;
+		loop->timer_capacity = GROW_CAPACITY(old_capacity);
+		loop->timers = GROW_ARRAY(vm, MEMORY_LOOP, struct timer,
+					  loop->timers, old_capacity,
+					  loop->timer_capacity);
+	}
+	timer = &loop->timers[loop->timer_count++];
+	timer->id = loop->next_timer++;
+	timer->deadline = now_ms() + AS_NUMBER(args[0]);
+	timer->callback = args[1];
+	return CONS_NUMBER(timer->id);
+}
+
+static bool unix_address(value_t path, struct sockaddr_un *address)
+{
+	struct object_string *str = AS_OBJ_STRING(path);
+
+	if ((size_t)str->length >= sizeof(address->sun_path))
+		return false;
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	memcpy(address->sun_path, str->characters, str->length);
+	return true;
+}
+
+/**
+ * listen_native() - Listen on the Unix socket at the given path.
+ *
+ * A file left at the path is removed first. Returns the file descriptor to
+ * accept() connections on or nil on failure.
+ */
+static value_t listen_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct sockaddr_un address;
+	int fd;
+
+	if (arg_count != 1 || !IS_STRING(args[0]))
+		return native_error(vm, "listen() expects a path.");
+	if (!unix_address(args[0], &address))
+		return native_error(vm, "Socket path is too long.");
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return CONS_NIL;
+	unlink(address.sun_path);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return CONS_NIL;
+	}
+	return make_fd(vm, fd);
+}
+
+/**
+ * connect_native() - Connect to the Unix socket at the given path.
+ *
+ * Returns the file descriptor of the connection or nil on failure.
+ */
+static value_t connect_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct sockaddr_un address;
+	int fd;
+
+	if (arg_count != 1 || !IS_STRING(args[0]))
+		return native_error(vm, "connect() expects a path.");
+	if (!unix_address(args[0], &address))
+		return native_error(vm, "Socket path is too long.");
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return CONS_NIL;
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		close(fd);
+		return CONS_NIL;
+	}
+	return make_fd(vm, fd);
+}
+
+/**
+ * accept_native() - Accept a connection on a listening socket.
+ *
+ * Returns the file descriptor of the connection, or false if no connection
+ * is pending.
+ */
+static value_t accept_native(struct vm *vm, int arg_count, value_t *args)
+{
+	int fd;
+
+	if (arg_count != 1 || !is_fd(args[0]))
+		return native_error(vm, "accept() expects a file descriptor.");
+
+	fd = accept((int)AS_NUMBER(args[0]), NULL, NULL);
+	if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return CONS_BOOLEAN(false);
+	if (fd < 0)
+		return native_error(vm, "Could not accept connection.");
+	return make_fd(vm, fd);
+}
+
+static int32_t earliest_timer(struct loop *loop)
+{
+	int32_t earliest = -1, i;
+
+	for (i = 0; i < loop->timer_count; i++)
+		if (earliest < 0 ||
+		    loop->timers[i].deadline < loop->timers[earliest].deadline)
+			earliest = i;
+	return earliest;
+}
+
+/**
+ * fire_timers() - Call the callbacks of all timers that expired by now.
+ *
+ * Timers started by the callbacks wait for the next round.
+ *
+ * Return: false if a callback failed.
+ */
+static bool fire_timers(struct vm *vm, struct loop *loop)
+{
+	double now = now_ms();
+	value_t callback, result;
+	int32_t earliest;
+
+	for (;;) {
+		earliest = earliest_timer(loop);
+		if (earliest < 0 || loop->timers[earliest].deadline > now)
+			return true;
+
+		callback = loop->timers[earliest].callback;
+		loop->timers[earliest] = loop->timers[--loop->timer_count];
+		if (!call_function(vm, callback, 0, NULL, &result))
+			return false;
+	}
+}
+
+static int next_timeout(struct loop *loop)
+{
+	int32_t earliest = earliest_timer(loop);
+	double timeout;
+
+	if (earliest < 0)
+		return -1;
+	timeout = loop->timers[earliest].deadline - now_ms();
+	return timeout <= 0 ? 0 : (int)timeout + 1;
+}
+
+/**
+ * dispatch() - Call the callbacks of the descriptors poll() reported.
+ *
+ * Callbacks may add and remove watchers. Walking backwards visits every
+ * watcher that was ready exactly once: a removal only moves the last
+ * watcher, which was visited already, and additions are appended.
+ *
+ * Return: false if a callback failed.
+ */
+static bool dispatch(struct vm *vm, struct loop *loop)
+{
+	struct watcher watcher;
+	value_t fd, result;
+	int32_t i, index;
+	short revents;
+
+	for (i = loop->watcher_count - 1; i >= 0; i--) {
+		if (i >= loop->watcher_count || loop->fds[i].revents == 0)
+			continue;
+		revents = loop->fds[i].revents;
+		loop->fds[i].revents = 0;
+		watcher = loop->watchers[i];
+		fd = CONS_NUMBER(watcher.fd);
+
+		if (revents & POLLNVAL) {
+			remove_watcher(loop, i);
+			continue;
+		}
+		if ((revents & (POLLIN | POLLHUP | POLLERR)) &&
+		    !IS_NIL(watcher.on_read) &&
+		    !call_function(vm, watcher.on_read, 1, &fd, &result))
+			return false;
+
+		// The read callback may have dropped the watcher
+		index = find_watcher(loop, watcher.fd);
+		if (index < 0)
+			continue;
+		watcher = loop->watchers[index];
+		if ((revents & (POLLOUT | POLLHUP | POLLERR)) &&
+		    !IS_NIL(watcher.on_write) &&
+		    !call_function(vm, watcher.on_write, 1, &fd, &result))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * run_loop_native() - Wait for descriptors and timers and call their
+ * callbacks until no watcher and no timer is left.
+ */
+static value_t run_loop_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct loop *loop = &vm->loop;
+	int ready;
+
+	if (arg_count != 0)
+		return native_error(vm, "run_loop() expects no arguments.");
+
+	while (loop->watcher_count > 0 || loop->timer_count > 0) {
+		if (!fire_timers(vm, loop))
+			return CONS_NIL;
+		if (loop->watcher_count == 0 && loop->timer_count == 0)
+			break;
+
+		ready = poll(loop->fds, loop->watcher_count,
+			     next_timeout(loop));
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (ready < 0)
+			return native_error(vm, "Could not poll file "
+						"descriptors.");
+		if (ready > 0 && !dispatch(vm, loop))
+			return CONS_NIL;
+	}
+	return CONS_NIL;
+}
+
+void define_loop_natives(struct vm *vm)
+{
+	define_native_fn(vm, "open", open_native);
+	define_native_fn(vm, "pipe", pipe_native);
+	define_native_fn(vm, "read", read_native);
+	define_native_fn(vm, "write", write_native);
+	define_native_fn(vm, "watch", watch_native);
+	define_native_fn(vm, "unwatch", unwatch_native);
+	define_native_fn(vm, "timer", timer_native);
+	define_native_fn(vm, "listen", listen_native);
+	define_native_fn(vm, "connect", connect_native);
+	define_native_fn(vm, "accept", accept_native);
+	define_native_fn(vm, "run_loop", run_loop_native);
+}
@@ -0,0 +1,53 @@
+#ifndef clox_loop_h
+#define clox_loop_h
+
+#include "common.h"
+#include "value.h"
+
+/*
+ * A watcher holds the callbacks waiting for a file descriptor, nil for the
+ * directions nobody waits for.
+ */
+struct watcher {
+	int fd;
+	value_t on_read;
+	value_t on_write;
+};
+
+struct timer {
+	int32_t id;
+	double deadline;
+	value_t callback;
+};
+
+struct pollfd;
+
+/*
+ * The event loop of a VM. @fds mirrors @watchers so it can be handed to
+ * poll() as is, @slots maps a file descriptor to its index in both or -1.
+ * @owned tells for the same descriptors whether the natives handed them out
+ * and close() may close them.
+ */
+struct loop {
+	struct watcher *watchers;
+	struct pollfd *fds;
+	int32_t watcher_count;
+	int32_t watcher_capacity;
+	int32_t *slots;
+	bool *owned;
+	int32_t slot_count;
+	struct timer *timers;
+	int32_t timer_count;
+	int32_t timer_capacity;
+	int32_t next_timer;
+};
+
+struct vm;
+
+void init_loop(struct loop *loop);
+void free_loop(struct vm *vm, struct loop *loop);
+void define_loop_natives(struct vm *vm);
+bool is_fd(value_t value);
+value_t loop_close(struct vm *vm, int fd);
+
+#endif
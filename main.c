@@ -1,10 +1,17 @@
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "channel.h"
 #include "chunk.h"
 #include "debug.h"
+#include "runner.h"
+#include "sampler.h"
 #include "vm.h"
 
+static struct vm vm;
+
 static void repl(void)
 {
 	char line[1024];
@@ -16,64 +23,113 @@ static void repl(void)
 			break;
 		}
 
-		interpret(line);
+		interpret(&vm, line, strlen(line));
 	}
 }
 
-static char *read_file(const char *path)
+static int run_file(const char *path)
 {
-	FILE *file = fopen(path, "rb");
-	size_t file_size, bytes_read;
-	char *buffer;
-
-	if (file == NULL) {
-		fprintf(stderr, "Could not open file \"%s\".\n", path);
-		exit(74);
-	}
+	struct source_file source;
+	enum interpret_result result;
 
-	fseek(file, 0L, SEEK_END);
-	file_size = ftell(file);
-	rewind(file);
+	if (!open_source_file(path, stderr, &source))
+		return 74;
+	result = interpret_file(&vm, &source);
+	close_source_file(&source);
 
-	buffer = malloc(file_size + 1);
-	if (buffer == NULL) {
-		fprintf(stderr, "Not enough memory to read \"%s\".", path);
-		exit(74);
-	}
-	bytes_read = fread(buffer, sizeof(char), file_size, file);
-	if (bytes_read < file_size) {
-		fprintf(stderr, "Could not read file \"%s\".", path);
-		exit(74);
-	}
-	buffer[bytes_read] = '\0';
-
-	fclose(file);
-	return buffer;
+	return exit_code(result);
 }
 
-static void run_file(const char *path)
+static void usage(void)
 {
-	char *source = read_file(path);
-	enum interpret_result result = interpret(source);
-	free(source);
-
-	if (result == INTERPRET_COMPILE_ERROR)
-		exit(65);
-	if (result == INTERPRET_RUNTIME_ERROR)
-		exit(70);
+	printf("Usage: clox [options] [path/to/script...]\n"
+	       "A script path of - reads the script from standard input.\n"
+	       "Options:\n"
+	       "  --sample=FILE       Write sampled Lox call stacks to FILE in\n"
+	       "                      collapsed format for flame graphs\n"
+	       "  --sample-rate=HZ    Samples per second of CPU time (default %d)\n"
+	       "  --memstats          Print memory statistics to stderr at exit\n"
+	       "  --flush-lines=N     Flush printed output every N lines (default\n"
+	       "                      1 on a terminal, otherwise when full)\n"
+	       "  --jobs=N            Run the scripts on N threads (max %d), each\n"
+	       "                      with its own VM, output stays in order;\n"
+	       "                      scripts talking through channels block\n"
+	       "                      their thread, so N must be at least the\n"
+	       "                      number of such scripts or they hang\n",
+	       SAMPLER_DEFAULT_HZ, RUNNER_MAX_JOBS);
 }
 
 int main(int argc, char *argv[])
 {
-	init_vm();
+	const char *sample_path = NULL, **paths;
+	int32_t sample_rate = SAMPLER_DEFAULT_HZ, jobs = 0, path_count = 0,
+		flush_lines = -1, i;
+	bool memstats = false;
+	int result = 0;
+
+	paths = malloc(sizeof(*paths) * argc);
+	if (paths == NULL)
+		exit(1);
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--sample=", 9) == 0) {
+			sample_path = argv[i] + 9;
+		} else if (strncmp(argv[i], "--sample-rate=", 14) == 0) {
+			sample_rate = atoi(argv[i] + 14);
+		} else if (strcmp(argv[i], "--memstats") == 0) {
+			memstats = true;
+		} else if (strncmp(argv[i], "--flush-lines=", 14) == 0) {
+			flush_lines = atoi(argv[i] + 14);
+		} else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+			jobs = atoi(argv[i] + 7);
+		} else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+			jobs = atoi(argv[++i]);
+		} else if (argv[i][0] != '-' || argv[i][1] == '\0') {
+			paths[path_count++] = argv[i];
+		} else {
+			usage();
+			return 64;
+		}
+	}
+
+	if (jobs < 0 || jobs > RUNNER_MAX_JOBS ||
+	    (jobs > 0 && path_count == 0) ||
+	    (sample_path != NULL && (jobs > 0 || path_count > 1))) {
+		usage();
+		return 64;
+	}
+
+	if (jobs > 0 || path_count > 1) {
+		result = run_scripts(paths, path_count, jobs > 0 ? jobs : 1,
+				     memstats);
+		free_channels();
+		free(paths);
+		return result;
+	}
 
-	if (argc == 1)
+	init_vm(&vm);
+	if (flush_lines >= 0)
+		vm.out.flush_lines = flush_lines;
+	else if (isatty(STDOUT_FILENO))
+		vm.out.flush_lines = 1;
+
+	if (sample_path != NULL &&
+	    !start_sampler(&vm, sample_path, sample_rate)) {
+		fprintf(stderr, "Could not start sampler.\n");
+		return 64;
+	}
+
+	if (path_count == 0)
 		repl();
-	else if (argc == 2)
-		run_file(argv[1]);
 	else
-		printf("Usage: clox [path/to/script]\n");
+		result = run_file(paths[0]);
+
+	stop_sampler();
+	if (memstats)
+		print_memory_report(stderr, &vm.memory);
+	free_vm(&vm);
+	free_channels();
+	free(paths);
 
-	free_vm();
-	return 0;
+	return result;
 }
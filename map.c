@@ -0,0 +1,202 @@
+#include <string.h>
+
+#include "common.h"
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+
+void init_map(struct map *map)
+{
+	map->entries = NULL;
+	map->length = 0;
+	map->capacity = 0;
+	map->count = 0;
+	map->slots = NULL;
+}
+
+void free_map(struct vm *vm, struct map *map)
+{
+	FREE_ARRAY(vm, MEMORY_MAP, struct map_entry, map->entries,
+		   map->capacity);
+	FREE_ARRAY(vm, MEMORY_MAP, int32_t, map->slots, map->capacity * 2);
+	init_map(map);
+}
+
+// Finalizer of MurmurHash3, spreads every input bit over the whole hash
+static uint32_t mix(uint64_t bits)
+{
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdull;
+	bits ^= bits >> 33;
+	bits *= 0xc4ceb9fe1a85ec53ull;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+/**
+ * hash_value() - Hash @key consistently with keys_equal().
+ *
+ * Numbers are hashed by the bits of their double with 0 and -0 folded
+ * together, since they are equal, so an integer hashes like the double with
+ * its value. Strings carry their hash already, every other object is
+ * hashed by identity.
+ */
+static uint32_t hash_value(value_t key)
+{
+	double number;
+	uint64_t bits;
+
+	switch (key.value_type) {
+	case VALUE_NUMBER:
+	case VALUE_INTEGER:
+		number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+		memcpy(&bits, &number, sizeof(bits));
+		return mix(bits);
+	case VALUE_BOOLEAN:
+		return AS_BOOLEAN(key) ? 1 : 2;
+	case VALUE_NIL:
+		return 3;
+	case VALUE_OBJECT:
+		if (IS_STRING(key))
+			return AS_OBJ_STRING(key)->hash;
+		return mix((uint64_t)(uintptr_t)AS_OBJECT(key));
+	}
+	return 0; // UNREACHABLE
+}
+
+static bool keys_equal(value_t a, value_t b)
+{
+	if (IS_NUMBER(a) && IS_NUMBER(b))
+		return AS_NUMBER(a) == AS_NUMBER(b);
+	if (a.value_type != b.value_type)
+		return false;
+
+	switch (a.value_type) {
+	case VALUE_NUMBER:
+	case VALUE_INTEGER:
+		return AS_NUMBER(a) == AS_NUMBER(b);
+	case VALUE_BOOLEAN:
+		return AS_BOOLEAN(a) == AS_BOOLEAN(b);
+	case VALUE_NIL:
+		return true;
+	case VALUE_OBJECT:
+		return AS_OBJECT(a) == AS_OBJECT(b);
+	}
+	return false; // UNREACHABLE
+}
+
+/**
+ * find_slot() - Find the slot of @key or the free slot it would go in.
+ *
+ * NOTE: The map must have slots.
+ */
+static int32_t *find_slot(struct map *map, value_t key, uint32_t hash)
+{
+	uint32_t mask = (uint32_t)map->capacity * 2 - 1, i = hash & mask;
+	struct map_entry *entry;
+
+	for (;; i = (i + 1) & mask) {
+		if (map->slots[i] == -1)
+			return &map->slots[i];
+		entry = &map->entries[map->slots[i]];
+		if (!entry->deleted && entry->hash == hash &&
+		    keys_equal(entry->key, key))
+			return &map->slots[i];
+	}
+}
+
+/**
+ * make_room() - Make room for one more entry.
+ *
+ * If at least half of the entries were deleted they are compacted in
+ * place, otherwise the capacity grows. Either way the slots are rebuilt.
+ */
+static void make_room(struct vm *vm, struct map *map)
+{
+	int32_t old_capacity = map->capacity, length = 0, i;
+
+	if (map->count > map->length / 2 || map->capacity == 0) {
+		map->capacity = GROW_CAPACITY(old_capacity);
+		map->entries = GROW_ARRAY(vm, MEMORY_MAP, struct map_entry,
+					  map->entries, old_capacity,
+					  map->capacity);
+		map->slots = GROW_ARRAY(vm, MEMORY_MAP, int32_t, map->slots,
+					old_capacity * 2, map->capacity * 2);
+	}
+
+	for (i = 0; i < map->length; i++)
+		if (!map->entries[i].deleted)
+			map->entries[length++] = map->entries[i];
+	map->length = length;
+
+	for (i = 0; i < map->capacity * 2; i++)
+		map->slots[i] = -1;
+	for (i = 0; i < map->length; i++)
+		*find_slot(map, map->entries[i].key, map->entries[i].hash) = i;
+}
+
+bool map_get(struct map *map, value_t key, value_t *value)
+{
+	int32_t slot;
+
+	if (map->count == 0)
+		return false;
+	slot = *find_slot(map, key, hash_value(key));
+	if (slot == -1)
+		return false;
+	*value = map->entries[slot].value;
+	return true;
+}
+
+/**
+ * map_set() - Set the value of @key, a new key goes after all others.
+ */
+void map_set(struct vm *vm, struct map *map, value_t key, value_t value)
+{
+	uint32_t hash = hash_value(key);
+	struct map_entry *entry;
+	int32_t *slot;
+
+	if (map->capacity > 0) {
+		slot = find_slot(map, key, hash);
+		if (*slot != -1) {
+			map->entries[*slot].value = value;
+			return;
+		}
+	}
+
+	if (map->length == map->capacity)
+		make_room(vm, map);
+	slot = find_slot(map, key, hash);
+	*slot = map->length++;
+	entry = &map->entries[*slot];
+	entry->key = key;
+	entry->value = value;
+	entry->hash = hash;
+	entry->deleted = false;
+	map->count++;
+}
+
+/**
+ * map_delete() - Remove @key from @map.
+ *
+ * The entry stays in its slot so probe sequences through it aren't cut
+ * short, it is dropped by the next make_room().
+ *
+ * Return: false if @key wasn't in @map.
+ */
+bool map_delete(struct map *map, value_t key)
+{
+	int32_t slot;
+
+	if (map->count == 0)
+		return false;
+	slot = *find_slot(map, key, hash_value(key));
+	if (slot == -1)
+		return false;
+	map->entries[slot].deleted = true;
+	map->entries[slot].key = CONS_NIL;
+	map->entries[slot].value = CONS_NIL;
+	map->count--;
+	return true;
+}
@@ -0,0 +1,38 @@
+#ifndef clox_map_h
+#define clox_map_h
+
+#include "common.h"
+#include "value.h"
+
+struct map_entry {
+	value_t key;
+	value_t value;
+	uint32_t hash;
+	bool deleted;
+};
+
+/*
+ * A hash map from any value to any value that remembers insertion order.
+ * @entries holds the entries in the order they were added, deleted ones
+ * stay in place until the entries are compacted. @slots is the open
+ * addressing index into @entries, -1 marks a free slot. It has twice as
+ * many slots as there are entries, so probe sequences stay short without
+ * any tombstone bookkeeping.
+ */
+struct map {
+	struct map_entry *entries;
+	int32_t length;
+	int32_t capacity;
+	int32_t count;
+	int32_t *slots;
+};
+
+struct vm;
+
+void init_map(struct map *map);
+void free_map(struct vm *vm, struct map *map);
+bool map_get(struct map *map, value_t key, value_t *value);
+void map_set(struct vm *vm, struct map *map, value_t key, value_t value);
+bool map_delete(struct map *map, value_t key);
+
+#endif
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "chunk.h"
 #include "common.h"
 #include "object.h"
@@ -6,13 +8,16 @@
 
 /**
  * reallocate() - Resizes a memory block.
+ * @vm: VM the memory block is charged to.
  * @ptr: Pointer to the memory block to be resized.
- * @old_size: The current size of the memory block (not used in this function).
+ * @old_size: The current size of the memory block.
  * @new_size: The new size for the memory block.
+ * @category: What the memory block is used for.
  *
  * This function attempts to resize the memory block pointed to by @ptr
  * to the specified @new_size. If @new_size is zero, the memory block
- * is freed and NULL is returned.
+ * is freed and NULL is returned. The difference between @old_size and
+ * @new_size is charged to @category in the memory statistics of @vm.
  *
  * NOTE: If the reallocation fails, the program exits with a status of 1.
  *
@@ -20,21 +25,36 @@
  * pointer returned by a previous allocation function (e.g., malloc or
  * realloc).
  *
- * NOTE: The @old_size parameter is included for compatibility but
- * is not used in the function's logic.
+ * NOTE: @old_size must be the size the block was last allocated with,
+ * otherwise the statistics drift. A block malloc()ed outside of the VM is
+ * taken over by passing it with an @old_size of zero.
  *
  * Return: A pointer to the newly allocated memory block, or NULL if
  * the new size is zero.
  */
-void *reallocate(void *ptr, size_t old_size, size_t new_size)
+void *reallocate(struct vm *vm, void *ptr, size_t old_size, size_t new_size,
+		 enum memory_category category)
 {
+	struct memory_stats *stats = &vm->memory;
 	void *result;
 
+	stats->live[category] += new_size - old_size;
+	stats->total_live += new_size - old_size;
+	if (stats->live[category] > stats->peak[category])
+		stats->peak[category] = stats->live[category];
+	if (stats->total_live > stats->total_peak)
+		stats->total_peak = stats->total_live;
+
 	if (new_size == 0) {
+		if (ptr != NULL)
+			stats->frees++;
 		free(ptr);
 		return NULL;
 	}
 
+	if (old_size == 0)
+		stats->allocations++;
+
 	result = realloc(ptr, new_size);
 	if (result == NULL)
 		exit(1);
@@ -42,47 +62,208 @@ void *reallocate(void *ptr, size_t old_size, size_t new_size)
 	return result;
 }
 
-static void free_object(struct object *object)
+static void free_object(struct vm *vm, struct object *object)
 {
+	vm->memory.objects[object_memory_category(object->object_type)]--;
+
 	switch (object->object_type) {
 	case OBJECT_STRING: {
 		struct object_string *str = (struct object_string *)object;
-		FREE_ARRAY(char, str->characters, str->length + 1);
-		FREE(struct object_string, object);
+		FREE_ARRAY(vm, MEMORY_STRING, char, str->characters,
+			   str->length + 1);
+		FREE(vm, MEMORY_STRING, struct object_string, object);
 		break;
 	}
 	case OBJECT_FUNCTION: {
 		struct object_function *fn = (struct object_function *)object;
-		free_chunk(&fn->chunk);
-		FREE(struct object_function, object);
+		free_chunk(vm, &fn->chunk);
+		FREE(vm, MEMORY_FUNCTION, struct object_function, object);
 		// Don't need to free fn->name because of garbage collection
 		break;
 	}
 	case OBJECT_NATIVE_FN:
-		FREE(struct object_native_fn, object);
+		FREE(vm, MEMORY_NATIVE_FN, struct object_native_fn, object);
 		break;
 	case OBJECT_UPVALUE:
-		FREE(struct object_upvalue, object);
+		FREE(vm, MEMORY_UPVALUE, struct object_upvalue, object);
 		break;
 	case OBJECT_CLOSURE: {
 		struct object_closure *closure =
 			(struct object_closure *)object;
-		FREE_ARRAY(struct object_upvalue, closure->upvalues,
-			   closure->upvalue_count);
-		FREE(struct object_closure, object);
+		FREE_ARRAY(vm, MEMORY_CLOSURE, struct object_upvalue *,
+			   closure->upvalues, closure->upvalue_count);
+		FREE(vm, MEMORY_CLOSURE, struct object_closure, object);
+		break;
+	}
+	case OBJECT_CHANNEL:
+		// The channel itself is shared, see channel.c
+		FREE(vm, MEMORY_CHANNEL, struct object_channel, object);
+		break;
+	case OBJECT_COROUTINE: {
+		struct object_coroutine *coroutine =
+			(struct object_coroutine *)object;
+		free_fiber_stack(vm, &coroutine->fiber);
+		FREE(vm, MEMORY_COROUTINE, struct object_coroutine, object);
 		break;
 	}
+	case OBJECT_ARRAY: {
+		struct object_array *array = (struct object_array *)object;
+		FREE_ARRAY(vm, MEMORY_ARRAY, value_t, array->values.values,
+			   array->values.capacity);
+		FREE(vm, MEMORY_ARRAY, struct object_array, object);
+		break;
+	}
+	case OBJECT_MAP: {
+		struct object_map *map = (struct object_map *)object;
+		free_map(vm, &map->map);
+		FREE(vm, MEMORY_MAP, struct object_map, object);
+		break;
+	}
+	case OBJECT_FLOAT64_ARRAY: {
+		struct object_float64_array *array =
+			(struct object_float64_array *)object;
+		FREE_ARRAY(vm, MEMORY_ARRAY, char, array->storage,
+			   FLOAT64_STORAGE_SIZE(array->length));
+		FREE(vm, MEMORY_ARRAY, struct object_float64_array, object);
+		break;
+	}
+	case OBJECT_CLASS: {
+		struct object_class *klass = (struct object_class *)object;
+		free_table(vm, &klass->methods);
+		free_shape(vm, klass->shape);
+		FREE(vm, MEMORY_CLASS, struct object_class, object);
+		break;
+	}
+	case OBJECT_INSTANCE: {
+		struct object_instance *instance =
+			(struct object_instance *)object;
+		FREE_ARRAY(vm, MEMORY_CLASS, value_t, instance->fields,
+			   instance->capacity);
+		FREE(vm, MEMORY_CLASS, struct object_instance, object);
+		break;
+	}
+	case OBJECT_BOUND_METHOD:
+		FREE(vm, MEMORY_CLASS, struct object_bound_method, object);
+		break;
 	default:
 		break;
 	}
 }
 
-void free_objects(void)
+/**
+ * free_objects_until() - Free the objects allocated after @last.
+ * @vm: VM owning the objects.
+ * @last: Object to stop at, or NULL to free all objects.
+ *
+ * Objects are prepended to the list of the VM, so @last and the objects
+ * allocated before it are kept.
+ */
+void free_objects_until(struct vm *vm, struct object *last)
 {
-	struct object *object = vm.objects;
-	while (object != NULL) {
-		vm.objects = object->next;
-		free_object(object);
-		object = vm.objects;
+	struct object *object = vm->objects;
+	while (object != last) {
+		vm->objects = object->next;
+		free_object(vm, object);
+		object = vm->objects;
+	}
+}
+
+void free_objects(struct vm *vm)
+{
+	free_objects_until(vm, NULL);
+}
+
+static const char *memory_category_names[] = {
+	[MEMORY_CODE] = "code",
+	[MEMORY_CONSTANTS] = "constants",
+	[MEMORY_LINES] = "lines",
+	[MEMORY_TABLE] = "tables",
+	[MEMORY_STRING] = "strings",
+	[MEMORY_FUNCTION] = "functions",
+	[MEMORY_NATIVE_FN] = "natives",
+	[MEMORY_CLOSURE] = "closures",
+	[MEMORY_UPVALUE] = "upvalues",
+	[MEMORY_CHANNEL] = "channels",
+	[MEMORY_COROUTINE] = "coroutines",
+	[MEMORY_LOOP] = "loop",
+	[MEMORY_ARRAY] = "arrays",
+	[MEMORY_MAP] = "maps",
+	[MEMORY_CLASS] = "classes",
+	[MEMORY_SHAPE] = "shapes",
+};
+
+/**
+ * NOTE: This function does no allocation.
+ */
+void init_memory_stats(struct memory_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+/**
+ * restart_memory_stats() - Count again from the statistics in @initial.
+ * @stats: Statistics to restart.
+ * @initial: Statistics to restart from.
+ *
+ * The live bytes and objects are kept since they describe memory that is
+ * still allocated, the peaks and the number of allocations and frees are
+ * taken from @initial.
+ */
+void restart_memory_stats(struct memory_stats *stats,
+			  const struct memory_stats *initial)
+{
+	int32_t i;
+
+	for (i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+		stats->peak[i] = initial->peak[i];
+		if (stats->live[i] > stats->peak[i])
+			stats->peak[i] = stats->live[i];
+	}
+	stats->total_peak = initial->total_peak;
+	if (stats->total_live > stats->total_peak)
+		stats->total_peak = stats->total_live;
+	stats->allocations = initial->allocations;
+	stats->frees = initial->frees;
+}
+
+const char *memory_category_name(enum memory_category category)
+{
+	return memory_category_names[category];
+}
+
+/**
+ * find_memory_category() - Look up a memory category by its name.
+ * @name: Name as printed in the memory report, e.g. "strings".
+ *
+ * Return: The category, or -1 if there is no category named @name.
+ */
+int32_t find_memory_category(const char *name)
+{
+	int32_t i;
+
+	for (i = 0; i < MEMORY_CATEGORY_COUNT; i++)
+		if (strcmp(memory_category_names[i], name) == 0)
+			return i;
+	return -1;
+}
+
+void print_memory_report(FILE *out, struct memory_stats *stats)
+{
+	int32_t i;
+
+	fprintf(out, "== memory ==\n");
+	fprintf(out, "%-12s %12s %12s %10s\n", "category", "live", "peak",
+		"objects");
+	for (i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+		fprintf(out, "%-12s %12zu %12zu", memory_category_names[i],
+			stats->live[i], stats->peak[i]);
+		if (i >= MEMORY_STRING)
+			fprintf(out, " %10lld", (long long)stats->objects[i]);
+		fprintf(out, "\n");
 	}
+	fprintf(out, "%-12s %12zu %12zu\n", "total", stats->total_live,
+		stats->total_peak);
+	fprintf(out, "allocations: %llu, frees: %llu\n",
+		(unsigned long long)stats->allocations,
+		(unsigned long long)stats->frees);
 }
@@ -1,23 +1,68 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, old_count, new_count)          \
-	((type *)reallocate(pointer, sizeof(type) * (old_count), \
-			    sizeof(type) * (new_count)))
+#define GROW_ARRAY(vm, category, type, pointer, old_count, new_count) \
+	((type *)reallocate(vm, pointer, sizeof(type) * (old_count),      \
+			    sizeof(type) * (new_count), category))
+
+#define FREE_ARRAY(vm, category, type, pointer, old_count) \
+	(reallocate(vm, pointer, sizeof(type) * (old_count), 0, category))
+
+#define ALLOCATE(vm, category, type, size) \
+	((type *)reallocate(vm, NULL, 0, (size) * sizeof(type), category))
+
+#define FREE(vm, category, type, pointer) \
+	(reallocate(vm, pointer, sizeof(type), 0, category))
+
+enum memory_category {
+	MEMORY_CODE,
+	MEMORY_CONSTANTS,
+	MEMORY_LINES,
+	MEMORY_TABLE,
+	MEMORY_STRING,
+	MEMORY_FUNCTION,
+	MEMORY_NATIVE_FN,
+	MEMORY_CLOSURE,
+	MEMORY_UPVALUE,
+	MEMORY_CHANNEL,
+	MEMORY_COROUTINE,
+	MEMORY_LOOP,
+	MEMORY_ARRAY,
+	MEMORY_MAP,
+	MEMORY_CLASS,
+	MEMORY_SHAPE,
+	MEMORY_CATEGORY_COUNT,
+};
 
-#define FREE_ARRAY(type, pointer, old_count) \
-	(reallocate(pointer, sizeof(type) * (old_count), 0))
+struct memory_stats {
+	size_t live[MEMORY_CATEGORY_COUNT];
+	size_t peak[MEMORY_CATEGORY_COUNT];
+	int64_t objects[MEMORY_CATEGORY_COUNT];
+	size_t total_live;
+	size_t total_peak;
+	uint64_t allocations;
+	uint64_t frees;
+};
 
-#define ALLOCATE(type, size) \
-	((type *)reallocate(NULL, 0, (size) * sizeof(type)))
+struct object;
+struct vm;
 
-#define FREE(type, pointer) (reallocate(pointer, sizeof(type), 0))
+void *reallocate(struct vm *vm, void *ptr, size_t old_size, size_t new_size,
+		 enum memory_category category);
+void free_objects_until(struct vm *vm, struct object *last);
+void free_objects(struct vm *vm);
 
-void *reallocate(void *ptr, size_t old_size, size_t new_size);
-void free_objects(void);
+void init_memory_stats(struct memory_stats *stats);
+void restart_memory_stats(struct memory_stats *stats,
+			  const struct memory_stats *initial);
+const char *memory_category_name(enum memory_category category);
+int32_t find_memory_category(const char *name);
+void print_memory_report(FILE *out, struct memory_stats *stats);
 
 #endif
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 
+#include "channel.h"
 #include "chunk.h"
 #include "object.h"
 #include "memory.h"
@@ -12,32 +13,137 @@ bool is_object_type(value_t value, enum object_type object_type)
 	return IS_OBJECT(value) && AS_OBJECT(value)->object_type == object_type;
 }
 
-static void print_function(struct object_function *fn)
+static void print_function(FILE *out, struct object_function *fn)
 {
 	if (fn->name == NULL) {
-		printf("<script>");
+		fprintf(out, "<script>");
 		return;
 	}
-	printf("<fn %s>", fn->name->characters);
+	fprintf(out, "<fn %s>", fn->name->characters);
 }
 
-void print_object(value_t value)
+// Collections nested deeper than this are printed as [...] or {...}, which
+// ends cycles
+#define PRINT_NESTING_DEPTH 8
+
+static void print_nested(FILE *out, value_t value, int32_t depth);
+
+static void print_array(FILE *out, struct object_array *array, int32_t depth)
+{
+	int32_t i;
+
+	if (depth == PRINT_NESTING_DEPTH) {
+		fprintf(out, "[...]");
+		return;
+	}
+	fprintf(out, "[");
+	for (i = 0; i < array->values.length; i++) {
+		if (i > 0)
+			fprintf(out, ", ");
+		print_nested(out, array->values.values[i], depth + 1);
+	}
+	fprintf(out, "]");
+}
+
+static void print_map(FILE *out, struct map *map, int32_t depth)
+{
+	struct map_entry *entry;
+	bool first = true;
+
+	if (depth == PRINT_NESTING_DEPTH) {
+		fprintf(out, "{...}");
+		return;
+	}
+	fprintf(out, "{");
+	for (entry = map->entries; entry < map->entries + map->length;
+	     entry++) {
+		if (entry->deleted)
+			continue;
+		if (!first)
+			fprintf(out, ", ");
+		first = false;
+		print_nested(out, entry->key, depth + 1);
+		fprintf(out, ": ");
+		print_nested(out, entry->value, depth + 1);
+	}
+	fprintf(out, "}");
+}
+
+static void print_float64_array(FILE *out,
+				struct object_float64_array *array)
+{
+	int32_t i;
+
+	fprintf(out, "float64[");
+	for (i = 0; i < array->length; i++) {
+		if (i > 0)
+			fprintf(out, ", ");
+		fprint_value(out, CONS_NUMBER(array->values[i]));
+	}
+	fprintf(out, "]");
+}
+
+static void print_nested(FILE *out, value_t value, int32_t depth)
+{
+	if (IS_ARRAY(value))
+		print_array(out, AS_OBJ_ARRAY(value), depth);
+	else if (IS_MAP(value))
+		print_map(out, &AS_OBJ_MAP(value)->map, depth);
+	else
+		fprint_value(out, value);
+}
+
+void print_object(FILE *out, value_t value)
 {
 	switch (OBJECT_TYPE(value)) {
 	case OBJECT_STRING:
-		printf("%s", AS_CSTRING(value));
+		fprintf(out, "%s", AS_CSTRING(value));
 		break;
 	case OBJECT_FUNCTION:
-		print_function(AS_OBJ_FUNCTION(value));
+		print_function(out, AS_OBJ_FUNCTION(value));
 		break;
 	case OBJECT_NATIVE_FN:
-		printf("<native fn>");
+		fprintf(out, "<native fn>");
 		break;
 	case OBJECT_CLOSURE:
-		print_function(AS_OBJ_CLOSURE(value)->function);
+		print_function(out, AS_OBJ_CLOSURE(value)->function);
 		break;
 	case OBJECT_UPVALUE:
-		printf("upvalue");
+		fprintf(out, "upvalue");
+		break;
+	case OBJECT_CHANNEL:
+		fprintf(out, "<channel %s>",
+			channel_name(AS_OBJ_CHANNEL(value)));
+		break;
+	case OBJECT_COROUTINE: {
+		struct object_string *name =
+			AS_OBJ_COROUTINE(value)->closure->function->name;
+		if (name == NULL)
+			fprintf(out, "<coroutine>");
+		else
+			fprintf(out, "<coroutine %s>", name->characters);
+		break;
+	}
+	case OBJECT_ARRAY:
+		print_array(out, AS_OBJ_ARRAY(value), 0);
+		break;
+	case OBJECT_MAP:
+		print_map(out, &AS_OBJ_MAP(value)->map, 0);
+		break;
+	case OBJECT_FLOAT64_ARRAY:
+		print_float64_array(out, AS_OBJ_FLOAT64_ARRAY(value));
+		break;
+	case OBJECT_CLASS:
+		fprintf(out, "<class %s>",
+			AS_OBJ_CLASS(value)->name->characters);
+		break;
+	case OBJECT_INSTANCE:
+		fprintf(out, "<%s instance>",
+			AS_OBJ_INSTANCE(value)->klass->name->characters);
+		break;
+	case OBJECT_BOUND_METHOD:
+		print_function(out,
+			       AS_OBJ_BOUND_METHOD(value)->method->function);
 		break;
 	default: // UNREACHABLE
 		fprintf(stderr, "Unknown object type passed to print_object");
@@ -60,100 +166,162 @@ uint32_t hash_string(const char *str, int32_t length)
 	return hash;
 }
 
-#define ALLOCATE_OBJ(type, obj_type) \
-	((type *)allocate_object(sizeof(type), obj_type))
+enum memory_category object_memory_category(enum object_type obj_type)
+{
+	switch (obj_type) {
+	case OBJECT_STRING:
+		return MEMORY_STRING;
+	case OBJECT_FUNCTION:
+		return MEMORY_FUNCTION;
+	case OBJECT_NATIVE_FN:
+		return MEMORY_NATIVE_FN;
+	case OBJECT_CLOSURE:
+		return MEMORY_CLOSURE;
+	case OBJECT_UPVALUE:
+		return MEMORY_UPVALUE;
+	case OBJECT_CHANNEL:
+		return MEMORY_CHANNEL;
+	case OBJECT_COROUTINE:
+		return MEMORY_COROUTINE;
+	case OBJECT_ARRAY:
+		return MEMORY_ARRAY;
+	case OBJECT_MAP:
+		return MEMORY_MAP;
+	case OBJECT_FLOAT64_ARRAY:
+		return MEMORY_ARRAY;
+	case OBJECT_CLASS: /* fall through */
+	case OBJECT_INSTANCE: /* fall through */
+	case OBJECT_BOUND_METHOD:
+		return MEMORY_CLASS;
+	}
+	return MEMORY_CATEGORY_COUNT; // UNREACHABLE
+}
+
+#define ALLOCATE_OBJ(vm, type, obj_type) \
+	((type *)allocate_object(vm, sizeof(type), obj_type))
 
-struct object *allocate_object(size_t size, enum object_type obj_type)
+struct object *allocate_object(struct vm *vm, size_t size,
+			       enum object_type obj_type)
 {
-	struct object *obj = reallocate(NULL, 0, size);
+	enum memory_category category = object_memory_category(obj_type);
+	struct object *obj = reallocate(vm, NULL, 0, size, category);
+
+	vm->memory.objects[category]++;
 	obj->object_type = obj_type;
-	obj->next = vm.objects;
-	vm.objects = obj;
+	obj->next = vm->objects;
+	vm->objects = obj;
 	return obj;
 }
 
-static struct object_string *allocate_string(char *str, int32_t length,
-					     int32_t hash)
+static struct object_string *allocate_string(struct vm *vm, char *str,
+					     int32_t length, int32_t hash)
 {
 	struct object_string *result =
-		ALLOCATE_OBJ(struct object_string, OBJECT_STRING);
+		ALLOCATE_OBJ(vm, struct object_string, OBJECT_STRING);
 	result->length = length;
 	result->characters = str;
 	result->hash = hash;
 
-	table_set(&vm.strings, result, CONS_NIL);
+	table_set(vm, &vm->strings, result, CONS_NIL);
 
 	return result;
 }
 
-struct object_string *copy_string(const char *str, int32_t length)
+struct object_string *copy_string(struct vm *vm, const char *str,
+				  int32_t length)
 {
 	char *copy;
 	int32_t hash;
 	struct object_string *interned;
 
 	hash = hash_string(str, length);
-	interned = table_find_string(&vm.strings, str, length, hash);
+	interned = table_find_string(&vm->strings, str, length, hash);
 	if (interned != NULL)
 		return interned;
 
-	copy = ALLOCATE(char, length + 1);
+	copy = ALLOCATE(vm, MEMORY_STRING, char, length + 1);
 	memcpy(copy, str, length);
 	copy[length] = '\0';
 
-	return allocate_string(copy, length, hash);
+	return allocate_string(vm, copy, length, hash);
 }
 
-struct object_string *take_string(char *str, int32_t length)
+struct object_string *take_string(struct vm *vm, char *str, int32_t length)
 {
 	int32_t hash = hash_string(str, length);
 	struct object_string *interned =
-		table_find_string(&vm.strings, str, length, hash);
+		table_find_string(&vm->strings, str, length, hash);
 
-	interned = table_find_string(&vm.strings, str, length, hash);
 	if (interned != NULL) {
-		FREE_ARRAY(char, str, length + 1);
+		FREE_ARRAY(vm, MEMORY_STRING, char, str, length + 1);
 		return interned;
 	}
 
-	return allocate_string(str, length, hash);
+	return allocate_string(vm, str, length, hash);
 }
 
-struct object_function *new_function(void)
+/**
+ * adopt_string() - Intern @str which was allocated with malloc().
+ * @hash: Hash of @str, as computed by hash_string().
+ *
+ * Like take_string() but for characters allocated outside of @vm, which
+ * are charged to @vm when they become part of its heap.
+ */
+struct object_string *adopt_string(struct vm *vm, char *str, int32_t length,
+				   uint32_t hash)
+{
+	struct object_string *interned =
+		table_find_string(&vm->strings, str, length, hash);
+
+	if (interned != NULL) {
+		free(str);
+		return interned;
+	}
+
+	str = reallocate(vm, str, 0, length + 1, MEMORY_STRING);
+	return allocate_string(vm, str, length, hash);
+}
+
+struct object_function *new_function(struct vm *vm)
 {
 	struct object_function *result =
-		ALLOCATE_OBJ(struct object_function, OBJECT_FUNCTION);
+		ALLOCATE_OBJ(vm, struct object_function, OBJECT_FUNCTION);
 	result->arity = 0;
 	result->upvalue_count = 0;
 	result->name = NULL;
+	result->uncurried = NULL;
+	result->closure = NULL;
+	result->is_uncurried = false;
 	init_chunk(&result->chunk);
 	return result;
 }
 
-struct object_native_fn *new_native_fn(native_fn function)
+struct object_native_fn *new_native_fn(struct vm *vm, native_fn function)
 {
 	struct object_native_fn *result =
-		ALLOCATE_OBJ(struct object_native_fn, OBJECT_NATIVE_FN);
+		ALLOCATE_OBJ(vm, struct object_native_fn, OBJECT_NATIVE_FN);
 	result->function = function;
 	return result;
 }
 
-struct object_upvalue *new_upvalue(value_t *slot)
+struct object_upvalue *new_upvalue(struct vm *vm, value_t *slot)
 {
 	struct object_upvalue *result =
-		ALLOCATE_OBJ(struct object_upvalue, OBJECT_UPVALUE);
+		ALLOCATE_OBJ(vm, struct object_upvalue, OBJECT_UPVALUE);
 	result->location = slot;
 	result->container = CONS_NIL;
 	result->next = NULL;
 	return result;
 }
 
-struct object_closure *new_closure(struct object_function *function)
+struct object_closure *new_closure(struct vm *vm,
+				   struct object_function *function)
 {
 	struct object_closure *result =
-		ALLOCATE_OBJ(struct object_closure, OBJECT_CLOSURE);
+		ALLOCATE_OBJ(vm, struct object_closure, OBJECT_CLOSURE);
 	struct object_upvalue **upvalues =
-		ALLOCATE(struct object_upvalue *, function->upvalue_count);
+		ALLOCATE(vm, MEMORY_CLOSURE, struct object_upvalue *,
+			 function->upvalue_count);
 	int32_t i;
 
 	for (i = 0; i < function->upvalue_count; i++)
@@ -162,5 +330,182 @@ struct object_closure *new_closure(struct object_function *function)
 	result->function = function;
 	result->upvalues = upvalues;
 	result->upvalue_count = function->upvalue_count;
+	result->uncurried = NULL;
+	return result;
+}
+
+struct object_channel *new_channel(struct vm *vm, struct channel *channel)
+{
+	struct object_channel *result =
+		ALLOCATE_OBJ(vm, struct object_channel, OBJECT_CHANNEL);
+	result->channel = channel;
+	return result;
+}
+
+/**
+ * new_coroutine() - Create a coroutine that runs @closure on its own fiber.
+ *
+ * The fiber gets a value stack and frames of its own, so switching to and
+ * from it never copies values. They are smaller than the ones of the script
+ * which limits the call depth inside the coroutine to COROUTINE_FRAME_MAX.
+ */
+struct object_coroutine *new_coroutine(struct vm *vm,
+				       struct object_closure *closure)
+{
+	struct object_coroutine *result =
+		ALLOCATE_OBJ(vm, struct object_coroutine, OBJECT_COROUTINE);
+	struct fiber *fiber = &result->fiber;
+
+	result->closure = closure;
+	fiber->frames = ALLOCATE(vm, MEMORY_COROUTINE, struct call_frame,
+				 COROUTINE_FRAME_MAX);
+	fiber->frame_count = 0;
+	fiber->frame_max = COROUTINE_FRAME_MAX;
+	fiber->stack = ALLOCATE(vm, MEMORY_COROUTINE, value_t,
+				COROUTINE_STACK_MAX);
+	fiber->stack_top = fiber->stack;
+	fiber->open_upvalues = NULL;
+	fiber->caller = NULL;
+	fiber->state = FIBER_NEW;
+	fiber->native_calls = 0;
+	return result;
+}
+
+/**
+ * free_fiber_stack() - Release the frames and stack of a coroutine.
+ *
+ * NOTE: Upvalues must not point into the stack anymore, which holds once
+ * the coroutine returned since returning closes them.
+ */
+void free_fiber_stack(struct vm *vm, struct fiber *fiber)
+{
+	if (fiber->stack == NULL)
+		return;
+	FREE_ARRAY(vm, MEMORY_COROUTINE, struct call_frame, fiber->frames,
+		   COROUTINE_FRAME_MAX);
+	FREE_ARRAY(vm, MEMORY_COROUTINE, value_t, fiber->stack,
+		   COROUTINE_STACK_MAX);
+	fiber->frames = NULL;
+	fiber->stack = NULL;
+	fiber->stack_top = NULL;
+}
+
+/**
+ * new_array() - Create an empty array with room for @capacity elements.
+ */
+struct object_array *new_array(struct vm *vm, int32_t capacity)
+{
+	struct object_array *result =
+		ALLOCATE_OBJ(vm, struct object_array, OBJECT_ARRAY);
+
+	init_value_array(&result->values);
+	if (capacity > 0) {
+		result->values.values =
+			ALLOCATE(vm, MEMORY_ARRAY, value_t, capacity);
+		result->values.capacity = capacity;
+	}
+	return result;
+}
+
+/**
+ * array_append() - Add @value to the end of @array.
+ *
+ * The storage grows geometrically, so appending is amortized O(1).
+ */
+void array_append(struct vm *vm, struct object_array *array, value_t value)
+{
+	struct value_array *values = &array->values;
+	int32_t old_capacity;
+
+	if (values->capacity < values->length + 1) {
+		old_capacity = values->capacity;
+		values->capacity = GROW_CAPACITY(old_capacity);
+		values->values = GROW_ARRAY(vm, MEMORY_ARRAY, value_t,
+					    values->values, old_capacity,
+					    values->capacity);
+	}
+	values->values[values->length++] = value;
+}
+
+struct object_map *new_map(struct vm *vm)
+{
+	struct object_map *result =
+		ALLOCATE_OBJ(vm, struct object_map, OBJECT_MAP);
+
+	init_map(&result->map);
+	return result;
+}
+
+/**
+ * new_float64_array() - Create an array of @length zeros.
+ */
+struct object_float64_array *new_float64_array(struct vm *vm,
+					       int32_t length)
+{
+	struct object_float64_array *result = ALLOCATE_OBJ(
+		vm, struct object_float64_array, OBJECT_FLOAT64_ARRAY);
+	uintptr_t address;
+
+	result->length = length;
+	result->storage = ALLOCATE(vm, MEMORY_ARRAY, char,
+				   FLOAT64_STORAGE_SIZE(length));
+	address = ((uintptr_t)result->storage + FLOAT64_ALIGNMENT - 1) &
+		  ~(uintptr_t)(FLOAT64_ALIGNMENT - 1);
+	result->values = (double *)address;
+	memset(result->values, 0, sizeof(double) * length);
+	return result;
+}
+
+struct object_class *new_class(struct vm *vm, struct object_string *name)
+{
+	struct object_class *result =
+		ALLOCATE_OBJ(vm, struct object_class, OBJECT_CLASS);
+
+	result->name = name;
+	init_table(&result->methods);
+	result->initializer = NULL;
+	result->shape = new_shape(vm, NULL, NULL);
+	return result;
+}
+
+struct object_instance *new_instance(struct vm *vm,
+				     struct object_class *klass)
+{
+	struct object_instance *result =
+		ALLOCATE_OBJ(vm, struct object_instance, OBJECT_INSTANCE);
+
+	result->klass = klass;
+	result->shape = klass->shape;
+	result->fields = NULL;
+	result->capacity = 0;
+	return result;
+}
+
+/**
+ * instance_reserve() - Make room for @field_count fields in @instance.
+ */
+void instance_reserve(struct vm *vm, struct object_instance *instance,
+		      int32_t field_count)
+{
+	int32_t old_capacity = instance->capacity;
+
+	if (field_count <= old_capacity)
+		return;
+	instance->capacity = GROW_CAPACITY(old_capacity);
+	if (instance->capacity < field_count)
+		instance->capacity = field_count;
+	instance->fields = GROW_ARRAY(vm, MEMORY_CLASS, value_t,
+				      instance->fields, old_capacity,
+				      instance->capacity);
+}
+
+struct object_bound_method *new_bound_method(struct vm *vm, value_t receiver,
+					     struct object_closure *method)
+{
+	struct object_bound_method *result = ALLOCATE_OBJ(
+		vm, struct object_bound_method, OBJECT_BOUND_METHOD);
+
+	result->receiver = receiver;
+	result->method = method;
 	return result;
 }
@@ -3,7 +3,10 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "map.h"
 #include "memory.h"
+#include "shape.h"
+#include "table.h"
 #include "value.h"
 
 enum object_type {
@@ -12,6 +15,14 @@ enum object_type {
 	OBJECT_NATIVE_FN,
 	OBJECT_CLOSURE,
 	OBJECT_UPVALUE,
+	OBJECT_CHANNEL,
+	OBJECT_COROUTINE,
+	OBJECT_ARRAY,
+	OBJECT_MAP,
+	OBJECT_FLOAT64_ARRAY,
+	OBJECT_CLASS,
+	OBJECT_INSTANCE,
+	OBJECT_BOUND_METHOD,
 };
 
 struct object {
@@ -32,18 +43,32 @@ struct object_string {
 #define AS_OBJ_STRING(value) ((struct object_string *)AS_OBJECT(value))
 #define AS_CSTRING(value) (AS_OBJ_STRING(value)->characters)
 
+/*
+ * A function with several parameter lists has @uncurried, the same function
+ * with its first two lists merged into one. It captures the same upvalues,
+ * and is only called by calls that pass both lists at once. An uncurried
+ * function without upvalues has a single @closure shared by all closures
+ * of the curried one.
+ */
+struct object_closure;
+
 struct object_function {
 	struct object object;
 	int32_t arity;
 	int32_t upvalue_count;
 	struct chunk chunk;
 	struct object_string *name;
+	struct object_function *uncurried;
+	struct object_closure *closure;
+	bool is_uncurried;
 };
 
 #define IS_FUNCTION(value) (is_object_type(value, OBJECT_FUNCTION))
 #define AS_OBJ_FUNCTION(value) ((struct object_function *)AS_OBJECT(value))
 
-typedef value_t (*native_fn)(int arg_count, value_t *values);
+struct vm;
+
+typedef value_t (*native_fn)(struct vm *vm, int arg_count, value_t *values);
 
 struct object_native_fn {
 	struct object object;
@@ -64,29 +89,186 @@ struct object_upvalue {
 #define IS_UPVALUE(value) (is_object_type(value, OBJECT_UPVALUE))
 #define AS_OBJ_UPVALUE(value) ((struct object_upvalue *)AS_OBJECT(value))
 
+/*
+ * @uncurried is the closure of function->uncurried with the same upvalues,
+ * made by the first call that passes both parameter lists.
+ */
 struct object_closure {
 	struct object object;
 	struct object_function *function;
 	struct object_upvalue **upvalues;
 	int32_t upvalue_count;
+	struct object_closure *uncurried;
 };
 
 #define IS_CLOSURE(value) (is_object_type(value, OBJECT_CLOSURE))
 #define AS_OBJ_CLOSURE(value) ((struct object_closure *)AS_OBJECT(value))
 
+struct channel;
+
+struct object_channel {
+	struct object object;
+	struct channel *channel;
+};
+
+#define IS_CHANNEL(value) (is_object_type(value, OBJECT_CHANNEL))
+#define AS_OBJ_CHANNEL(value) \
+	(((struct object_channel *)AS_OBJECT(value))->channel)
+
+enum fiber_state {
+	FIBER_NEW,
+	FIBER_SUSPENDED,
+	FIBER_RUNNING,
+	FIBER_DONE,
+};
+
+struct call_frame;
+
+/*
+ * A fiber is a value stack with its call frames. Only the fiber that is
+ * running lives in the registers of the VM, all others are saved here.
+ * @native_calls counts the natives running Lox code on the fiber through
+ * call_function(), which a yield must not leave.
+ */
+struct fiber {
+	struct call_frame *frames;
+	int32_t frame_count;
+	int32_t frame_max;
+	value_t *stack;
+	value_t *stack_top;
+	struct object_upvalue *open_upvalues;
+	struct fiber *caller;
+	enum fiber_state state;
+	int32_t native_calls;
+};
+
+struct object_coroutine {
+	struct object object;
+	struct object_closure *closure;
+	struct fiber fiber;
+};
+
+#define IS_COROUTINE(value) (is_object_type(value, OBJECT_COROUTINE))
+#define AS_OBJ_COROUTINE(value) ((struct object_coroutine *)AS_OBJECT(value))
+
+/*
+ * The elements of an array are stored contiguously in @values, which grows
+ * by GROW_CAPACITY() like every other dynamic array of the VM.
+ */
+struct object_array {
+	struct object object;
+	struct value_array values;
+};
+
+#define IS_ARRAY(value) (is_object_type(value, OBJECT_ARRAY))
+#define AS_OBJ_ARRAY(value) ((struct object_array *)AS_OBJECT(value))
+
+struct object_map {
+	struct object object;
+	struct map map;
+};
+
+#define IS_MAP(value) (is_object_type(value, OBJECT_MAP))
+#define AS_OBJ_MAP(value) ((struct object_map *)AS_OBJECT(value))
+
+#define FLOAT64_ALIGNMENT 32
+
+/*
+ * A float64 array holds raw doubles instead of values, so the kernels in
+ * kernels.c can run over them with vector instructions. @values points
+ * into @storage at the first multiple of FLOAT64_ALIGNMENT, the length is
+ * fixed at creation.
+ */
+struct object_float64_array {
+	struct object object;
+	int32_t length;
+	double *values;
+	char *storage;
+};
+
+#define IS_FLOAT64_ARRAY(value) (is_object_type(value, OBJECT_FLOAT64_ARRAY))
+#define AS_OBJ_FLOAT64_ARRAY(value) \
+	((struct object_float64_array *)AS_OBJECT(value))
+#define FLOAT64_STORAGE_SIZE(length) \
+	((size_t)(length) * sizeof(double) + FLOAT64_ALIGNMENT)
+
+/*
+ * @shape is the root shape of the instances of the class. Every class has
+ * its own, so a shape also tells the class and an inline cache keyed by
+ * shape can hold methods as well as fields. @initializer is the "init"
+ * method, if any, looked up once when the class is created.
+ */
+struct object_class {
+	struct object object;
+	struct object_string *name;
+	struct table methods;
+	struct object_closure *initializer;
+	struct shape *shape;
+};
+
+#define IS_CLASS(value) (is_object_type(value, OBJECT_CLASS))
+#define AS_OBJ_CLASS(value) ((struct object_class *)AS_OBJECT(value))
+
+/*
+ * The fields of an instance are stored in @fields at the slots its @shape
+ * maps their names to.
+ */
+struct object_instance {
+	struct object object;
+	struct object_class *klass;
+	struct shape *shape;
+	value_t *fields;
+	int32_t capacity;
+};
+
+#define IS_INSTANCE(value) (is_object_type(value, OBJECT_INSTANCE))
+#define AS_OBJ_INSTANCE(value) ((struct object_instance *)AS_OBJECT(value))
+
+struct object_bound_method {
+	struct object object;
+	value_t receiver;
+	struct object_closure *method;
+};
+
+#define IS_BOUND_METHOD(value) (is_object_type(value, OBJECT_BOUND_METHOD))
+#define AS_OBJ_BOUND_METHOD(value) \
+	((struct object_bound_method *)AS_OBJECT(value))
+
 bool is_object_type(value_t value, enum object_type object_type);
-void print_object(value_t value);
+void print_object(FILE *out, value_t value);
 
 #define FNV_OFFSET_BASIS 2166136261u
 #define FNV_PRIME 16777619
 int32_t hash(const char *str, int32_t length);
 
-struct object *allocate_object(size_t size, enum object_type obj_type);
-struct object_string *copy_string(const char *str, int32_t length);
-struct object_string *take_string(char *str, int32_t length);
-struct object_function *new_function(void);
-struct object_native_fn *new_native_fn(native_fn function);
-struct object_upvalue *new_upvalue(value_t *slot);
-struct object_closure *new_closure(struct object_function *function);
+enum memory_category object_memory_category(enum object_type obj_type);
+struct object *allocate_object(struct vm *vm, size_t size,
+			       enum object_type obj_type);
+struct object_string *copy_string(struct vm *vm, const char *str,
+				  int32_t length);
+struct object_string *take_string(struct vm *vm, char *str, int32_t length);
+struct object_string *adopt_string(struct vm *vm, char *str, int32_t length,
+				   uint32_t hash);
+struct object_function *new_function(struct vm *vm);
+struct object_native_fn *new_native_fn(struct vm *vm, native_fn function);
+struct object_upvalue *new_upvalue(struct vm *vm, value_t *slot);
+struct object_closure *new_closure(struct vm *vm,
+				   struct object_function *function);
+struct object_channel *new_channel(struct vm *vm, struct channel *channel);
+struct object_coroutine *new_coroutine(struct vm *vm,
+				       struct object_closure *closure);
+void free_fiber_stack(struct vm *vm, struct fiber *fiber);
+struct object_array *new_array(struct vm *vm, int32_t capacity);
+void array_append(struct vm *vm, struct object_array *array, value_t value);
+struct object_map *new_map(struct vm *vm);
+struct object_float64_array *new_float64_array(struct vm *vm,
+					       int32_t length);
+struct object_class *new_class(struct vm *vm, struct object_string *name);
+struct object_instance *new_instance(struct vm *vm,
+				     struct object_class *klass);
+void instance_reserve(struct vm *vm, struct object_instance *instance,
+		      int32_t field_count);
+struct object_bound_method *new_bound_method(struct vm *vm, value_t receiver,
+					     struct object_closure *method);
 
 #endif
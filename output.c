@@ -0,0 +1,95 @@
+#include <string.h>
+
+#include "common.h"
+#include "object.h"
+#include "output.h"
+
+void init_output(struct output *output, FILE *file)
+{
+	output->file = file;
+	output->length = 0;
+	output->flush_lines = 0;
+	output->lines = 0;
+}
+
+/**
+ * flush_output() - Hand the buffered output over to the stream.
+ *
+ * NOTE: The stream itself is not flushed, it keeps ordering the output
+ * with everything else written to it.
+ */
+void flush_output(struct output *output)
+{
+	if (output->length == 0)
+		return;
+	fwrite(output->buffer, 1, output->length, output->file);
+	output->length = 0;
+}
+
+static void output_bytes(struct output *output, const char *bytes,
+			 int32_t length)
+{
+	if (output->length + length > OUTPUT_BUFFER_SIZE) {
+		flush_output(output);
+		if (length > OUTPUT_BUFFER_SIZE) {
+			fwrite(bytes, 1, length, output->file);
+			return;
+		}
+	}
+	memcpy(output->buffer + output->length, bytes, length);
+	output->length += length;
+}
+
+/**
+ * output_value() - Print @value like fprint_value() would.
+ *
+ * Numbers, booleans, nil and strings are formatted right into the buffer,
+ * everything else is rare enough to go through the stream.
+ */
+void output_value(struct output *output, value_t value)
+{
+	struct object_string *str;
+
+	if (output->length + NUMBER_BUFFER_SIZE > OUTPUT_BUFFER_SIZE)
+		flush_output(output);
+
+	switch (value.value_type) {
+	case VALUE_NUMBER:
+	case VALUE_INTEGER:
+		output->length += format_number(AS_NUMBER(value),
+						output->buffer +
+							output->length);
+		break;
+	case VALUE_BOOLEAN:
+		if (AS_BOOLEAN(value))
+			output_bytes(output, "true", 4);
+		else
+			output_bytes(output, "false", 5);
+		break;
+	case VALUE_NIL:
+		output_bytes(output, "nil", 3);
+		break;
+	case VALUE_OBJECT:
+		if (IS_STRING(value)) {
+			str = AS_OBJ_STRING(value);
+			output_bytes(output, str->characters, str->length);
+		} else {
+			flush_output(output);
+			print_object(output->file, value);
+		}
+		break;
+	}
+}
+
+/**
+ * output_line() - End the current line.
+ */
+void output_line(struct output *output)
+{
+	output_bytes(output, "\n", 1);
+	if (output->flush_lines > 0 && ++output->lines >= output->flush_lines) {
+		flush_output(output);
+		fflush(output->file);
+		output->lines = 0;
+	}
+}
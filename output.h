@@ -0,0 +1,29 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+#define OUTPUT_BUFFER_SIZE 8192
+
+/*
+ * Output of print statements, collected in @buffer and written to @file in
+ * large chunks. With @flush_lines set, @file is also flushed after every
+ * @flush_lines lines so interactive output shows up in time.
+ */
+struct output {
+	FILE *file;
+	int32_t length;
+	int32_t flush_lines;
+	int32_t lines;
+	char buffer[OUTPUT_BUFFER_SIZE];
+};
+
+void init_output(struct output *output, FILE *file);
+void flush_output(struct output *output);
+void output_value(struct output *output, value_t value);
+void output_line(struct output *output);
+
+#endif
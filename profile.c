@@ -0,0 +1,425 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "debug.h"
+#include "object.h"
+#include "profile.h"
+#include "vm.h"
+
+#ifdef PROFILE_EXECUTION
+
+#define PROFILE_TOP_INSTRUCTIONS 20
+#define PROFILE_DEFAULT_JSON "clox-profile.json"
+
+struct function_record {
+	struct object_function *function;
+	uint64_t count;
+	uint64_t cycles;
+};
+
+struct instruction_record {
+	struct object_function *function;
+	int32_t offset;
+	uint64_t count;
+	uint64_t cycles;
+};
+
+struct op_record {
+	uint8_t op;
+	uint64_t count;
+	uint64_t cycles;
+};
+
+/**
+ * read_cycles() - Read a monotonically increasing timestamp.
+ *
+ * Uses the time stamp counter on x86 and falls back to a nanosecond
+ * monotonic clock elsewhere. Only differences between two readings are
+ * meaningful.
+ */
+static uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static const char *cycles_unit(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return "cycles";
+#else
+	return "ns";
+#endif
+}
+
+static void *allocate_counters(int32_t length)
+{
+	void *counters = calloc(length, sizeof(uint64_t));
+
+	if (counters == NULL)
+		exit(1);
+	return counters;
+}
+
+/**
+ * NOTE: Setting CLOX_PROFILE_CYCLES in the environment enables sampling of
+ * a timestamp per instruction, which is considerably slower than counting.
+ */
+void init_profile(struct vm *vm)
+{
+	struct profile *profile = &vm->profile;
+	const char *cycles = getenv("CLOX_PROFILE_CYCLES");
+
+	memset(profile, 0, sizeof(*profile));
+	profile->cycles = cycles != NULL && strcmp(cycles, "0") != 0;
+}
+
+/**
+ * profile_instruction() - Account for the instruction about to be executed.
+ * @vm: The VM executing the instruction.
+ * @function: Function whose chunk contains the instruction.
+ * @ip: Pointer to the opcode of the instruction.
+ *
+ * Counters are charged per opcode and per bytecode offset. Per function
+ * totals are derived from the per offset counters when reporting. When
+ * cycle sampling is enabled, the time elapsed since the previous call is
+ * charged to the previous instruction.
+ *
+ * NOTE: Per offset counters are not allocated through reallocate() so that
+ * profiling does not skew the memory accounting of the VM.
+ */
+void profile_instruction(struct vm *vm, struct object_function *function,
+			 uint8_t *ip)
+{
+	struct profile *profile = &vm->profile;
+	struct chunk *chunk = &function->chunk;
+	int32_t offset = (int32_t)(ip - chunk->code);
+	uint64_t now;
+
+	if (chunk->exec_counts == NULL)
+		chunk->exec_counts = allocate_counters(chunk->length);
+	chunk->exec_counts[offset]++;
+	profile->op_counts[*ip]++;
+
+	if (!profile->cycles)
+		return;
+
+	now = read_cycles();
+	if (profile->last_slot != NULL) {
+		*profile->last_slot += now - profile->last_stamp;
+		profile->op_cycles[profile->last_op] +=
+			now - profile->last_stamp;
+	}
+	if (chunk->exec_cycles == NULL)
+		chunk->exec_cycles = allocate_counters(chunk->length);
+	profile->last_slot = &chunk->exec_cycles[offset];
+	profile->last_op = *ip;
+	profile->last_stamp = now;
+}
+
+static int compare_counts(uint64_t a, uint64_t b)
+{
+	return a < b ? 1 : a > b ? -1 : 0;
+}
+
+static int compare_ops(const void *a, const void *b)
+{
+	return compare_counts(((const struct op_record *)a)->count,
+			      ((const struct op_record *)b)->count);
+}
+
+static int compare_functions(const void *a, const void *b)
+{
+	return compare_counts(((const struct function_record *)a)->count,
+			      ((const struct function_record *)b)->count);
+}
+
+static int compare_instructions(const void *a, const void *b)
+{
+	return compare_counts(((const struct instruction_record *)a)->count,
+			      ((const struct instruction_record *)b)->count);
+}
+
+static const char *function_name(struct object_function *function)
+{
+	return function->name == NULL ? "<script>" :
+					function->name->characters;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+	return total == 0 ? 0.0 : 100.0 * (double)part / (double)total;
+}
+
+static void report_text(FILE *out, struct profile *profile,
+			struct op_record *ops, int32_t op_count,
+			struct function_record *functions,
+			int32_t function_count,
+			struct instruction_record *instructions,
+			int32_t instruction_count, uint64_t total)
+{
+	int32_t i;
+	struct object_function *function;
+
+	fprintf(out, "== opcode profile ==\n");
+	fprintf(out, "%-22s %14s %7s", "opcode", "count", "%");
+	if (profile->cycles)
+		fprintf(out, " %16s %10s", cycles_unit(), "per op");
+	fprintf(out, "\n");
+	for (i = 0; i < op_count; i++) {
+		fprintf(out, "%-22s %14llu %6.2f%%", op_code_name(ops[i].op),
+			(unsigned long long)ops[i].count,
+			percent(ops[i].count, total));
+		if (profile->cycles)
+			fprintf(out, " %16llu %10.1f",
+				(unsigned long long)ops[i].cycles,
+				(double)ops[i].cycles / (double)ops[i].count);
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "== function profile ==\n");
+	fprintf(out, "%-22s %6s %14s %7s", "function", "line", "count", "%");
+	if (profile->cycles)
+		fprintf(out, " %16s", cycles_unit());
+	fprintf(out, "\n");
+	for (i = 0; i < function_count; i++) {
+		function = functions[i].function;
+		fprintf(out, "%-22s %6d %14llu %6.2f%%", function_name(function),
+			read_line(&function->chunk.lines, 0),
+			(unsigned long long)functions[i].count,
+			percent(functions[i].count, total));
+		if (profile->cycles)
+			fprintf(out, " %16llu",
+				(unsigned long long)functions[i].cycles);
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "== hot instructions ==\n");
+	fprintf(out, "%-22s %6s %6s %-22s %14s %7s\n", "function", "offset",
+		"line", "opcode", "count", "%");
+	for (i = 0; i < instruction_count && i < PROFILE_TOP_INSTRUCTIONS;
+	     i++) {
+		function = instructions[i].function;
+		fprintf(out, "%-22s %6d %6d %-22s %14llu %6.2f%%\n",
+			function_name(function), instructions[i].offset,
+			read_line(&function->chunk.lines,
+				  instructions[i].offset),
+			op_code_name(function->chunk.code[instructions[i].offset]),
+			(unsigned long long)instructions[i].count,
+			percent(instructions[i].count, total));
+	}
+}
+
+static void report_json(FILE *out, struct profile *profile,
+			struct op_record *ops, int32_t op_count,
+			struct function_record *functions,
+			int32_t function_count,
+			struct instruction_record *instructions,
+			int32_t instruction_count, uint64_t total)
+{
+	int32_t i;
+	struct object_function *function;
+
+	fprintf(out, "{\n  \"total\": %llu,\n", (unsigned long long)total);
+	fprintf(out, "  \"cycles_unit\": %s%s%s,\n",
+		profile->cycles ? "\"" : "",
+		profile->cycles ? cycles_unit() : "null",
+		profile->cycles ? "\"" : "");
+
+	fprintf(out, "  \"opcodes\": [");
+	for (i = 0; i < op_count; i++)
+		fprintf(out,
+			"%s\n    {\"opcode\": \"%s\", \"count\": %llu, "
+			"\"cycles\": %llu}",
+			i == 0 ? "" : ",", op_code_name(ops[i].op),
+			(unsigned long long)ops[i].count,
+			(unsigned long long)ops[i].cycles);
+	fprintf(out, "\n  ],\n");
+
+	fprintf(out, "  \"functions\": [");
+	for (i = 0; i < function_count; i++) {
+		function = functions[i].function;
+		fprintf(out,
+			"%s\n    {\"function\": \"%s\", \"line\": %d, "
+			"\"count\": %llu, \"cycles\": %llu}",
+			i == 0 ? "" : ",", function_name(function),
+			read_line(&function->chunk.lines, 0),
+			(unsigned long long)functions[i].count,
+			(unsigned long long)functions[i].cycles);
+	}
+	fprintf(out, "\n  ],\n");
+
+	fprintf(out, "  \"instructions\": [");
+	for (i = 0; i < instruction_count; i++) {
+		function = instructions[i].function;
+		fprintf(out,
+			"%s\n    {\"function\": \"%s\", \"offset\": %d, "
+			"\"line\": %d, \"opcode\": \"%s\", \"count\": %llu, "
+			"\"cycles\": %llu}",
+			i == 0 ? "" : ",", function_name(function),
+			instructions[i].offset,
+			read_line(&function->chunk.lines,
+				  instructions[i].offset),
+			op_code_name(function->chunk.code[instructions[i].offset]),
+			(unsigned long long)instructions[i].count,
+			(unsigned long long)instructions[i].cycles);
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
+
+/**
+ * open_json() - Open the file the JSON profile of @vm goes to.
+ *
+ * Return: The file, or NULL after reporting that it can't be opened.
+ */
+static FILE *open_json(struct vm *vm)
+{
+	const char *path = getenv("CLOX_PROFILE_JSON");
+	char *numbered = NULL;
+	size_t length, size;
+	FILE *out;
+
+	if (path == NULL)
+		path = PROFILE_DEFAULT_JSON;
+	// "clox-profile.json" of the third script becomes "clox-profile-3.json"
+	if (vm->profile.script > 0) {
+		length = strlen(path);
+		size = length + 16;
+		if (length >= 5 && strcmp(path + length - 5, ".json") == 0)
+			length -= 5;
+		numbered = malloc(size);
+		if (numbered == NULL)
+			exit(1);
+		snprintf(numbered, size, "%.*s-%d%s", (int)length, path,
+			 vm->profile.script, path + length);
+		path = numbered;
+	}
+
+	out = fopen(path, "w");
+	if (out == NULL)
+		fprintf(vm->err, "Could not write profile to \"%s\".\n", path);
+	free(numbered);
+	return out;
+}
+
+/**
+ * profile_report() - Dump the collected profile.
+ *
+ * A text report sorted by execution count is written to the error stream
+ * of the VM and the complete profile is written as JSON to the file named
+ * by the CLOX_PROFILE_JSON environment variable, or to "clox-profile.json".
+ * Under --jobs every script is profiled on its own: its text report comes
+ * with its other errors and the number of the script is added to the name
+ * of the JSON file, e.g. "clox-profile-2.json" for the second script.
+ * Nothing is reported if no instruction was executed, like by the VM of a
+ * worker once its last script was reset.
+ *
+ * NOTE: Must be called before the objects of the VM are freed since the
+ * counters live in the chunks of the functions.
+ */
+void profile_report(struct vm *vm)
+{
+	struct profile *profile = &vm->profile;
+	struct op_record ops[256];
+	struct function_record *functions;
+	struct instruction_record *instructions;
+	int32_t op_count = 0, function_count = 0, instruction_count = 0, i;
+	uint64_t total = 0;
+	struct object *object;
+	struct object_function *function;
+	FILE *out;
+
+	for (i = 0; i < 256; i++) {
+		if (profile->op_counts[i] == 0)
+			continue;
+		ops[op_count].op = (uint8_t)i;
+		ops[op_count].count = profile->op_counts[i];
+		ops[op_count].cycles = profile->op_cycles[i];
+		total += profile->op_counts[i];
+		op_count++;
+	}
+	if (total == 0)
+		return;
+
+	for (object = vm->objects; object != NULL; object = object->next) {
+		if (object->object_type != OBJECT_FUNCTION)
+			continue;
+		function = (struct object_function *)object;
+		if (function->chunk.exec_counts == NULL)
+			continue;
+		function_count++;
+		for (i = 0; i < function->chunk.length; i++)
+			if (function->chunk.exec_counts[i] != 0)
+				instruction_count++;
+	}
+
+	functions = malloc(sizeof(*functions) * (function_count + 1));
+	instructions = malloc(sizeof(*instructions) * (instruction_count + 1));
+	if (functions == NULL || instructions == NULL)
+		exit(1);
+
+	function_count = instruction_count = 0;
+	for (object = vm->objects; object != NULL; object = object->next) {
+		struct function_record *record;
+
+		if (object->object_type != OBJECT_FUNCTION)
+			continue;
+		function = (struct object_function *)object;
+		if (function->chunk.exec_counts == NULL)
+			continue;
+
+		record = &functions[function_count++];
+		record->function = function;
+		record->count = 0;
+		record->cycles = 0;
+		for (i = 0; i < function->chunk.length; i++) {
+			struct instruction_record *instruction;
+			uint64_t cycles = function->chunk.exec_cycles != NULL ?
+						  function->chunk.exec_cycles[i] :
+						  0;
+
+			if (function->chunk.exec_counts[i] == 0)
+				continue;
+			instruction = &instructions[instruction_count++];
+			instruction->function = function;
+			instruction->offset = i;
+			instruction->count = function->chunk.exec_counts[i];
+			instruction->cycles = cycles;
+			record->count += instruction->count;
+			record->cycles += cycles;
+		}
+	}
+
+	qsort(ops, op_count, sizeof(*ops), compare_ops);
+	qsort(functions, function_count, sizeof(*functions),
+	      compare_functions);
+	qsort(instructions, instruction_count, sizeof(*instructions),
+	      compare_instructions);
+
+	report_text(vm->err, profile, ops, op_count, functions,
+		    function_count, instructions, instruction_count, total);
+
+	out = open_json(vm);
+	if (out != NULL) {
+		report_json(out, profile, ops, op_count, functions,
+			    function_count, instructions, instruction_count,
+			    total);
+		fclose(out);
+	}
+
+	free(functions);
+	free(instructions);
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+#include "object.h"
+
+#ifdef PROFILE_EXECUTION
+struct vm;
+
+struct profile {
+	uint64_t op_counts[256];
+	uint64_t op_cycles[256];
+	bool cycles;
+	uint64_t last_stamp;
+	uint64_t *last_slot;
+	uint8_t last_op;
+	// Number of the script under --jobs, 0 otherwise
+	int32_t script;
+};
+
+void init_profile(struct vm *vm);
+void profile_instruction(struct vm *vm, struct object_function *function,
+			 uint8_t *ip);
+void profile_report(struct vm *vm);
+#endif
+
+#endif
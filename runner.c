@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "runner.h"
+#include "vm.h"
+
+#define EXIT_IO_ERROR 74
+
+/*
+ * Every worker owns a deque of script indices. A worker takes scripts from
+ * the front of its own deque and, once that is empty, steals from the back
+ * of the deques of the other workers, so one slow script does not hold up
+ * the scripts queued behind it. Scripts are dealt round robin so workers
+ * progress through the list roughly in order, which lets the main thread
+ * print finished scripts early.
+ */
+struct deque {
+	pthread_mutex_t lock;
+	int32_t *scripts;
+	int32_t front;
+	int32_t back;
+};
+
+struct script {
+	const char *path;
+	char *out;
+	size_t out_length;
+	char *err;
+	size_t err_length;
+	int exit_code;
+	bool done;
+};
+
+struct runner {
+	struct script *scripts;
+	int32_t script_count;
+	struct deque *deques;
+	int32_t worker_count;
+	bool memstats;
+	pthread_mutex_t lock;
+	pthread_cond_t script_done;
+};
+
+struct worker {
+	struct runner *runner;
+	int32_t id;
+	pthread_t thread;
+	struct vm vm;
+};
+
+static int32_t read_source_file(void *context, char *buffer, int32_t size)
+{
+	struct source_file *file = context;
+	ssize_t bytes_read;
+
+	do
+		bytes_read = read(file->fd, buffer, size);
+	while (bytes_read < 0 && errno == EINTR);
+	if (bytes_read < 0) {
+		fprintf(file->err, "Could not read file \"%s\".\n", file->path);
+		return 0;
+	}
+	return (int32_t)bytes_read;
+}
+
+/**
+ * open_source_file() - Open the script at @path, - for standard input.
+ * @err: Stream the reason of a failure is reported to.
+ *
+ * A regular file is mapped into memory and compiled without a copy.
+ * Anything else, like a pipe, is read in pieces while compiling.
+ *
+ * Return: false on failure.
+ */
+bool open_source_file(const char *path, FILE *err, struct source_file *file)
+{
+	struct stat st;
+	void *text;
+
+	file->path = path;
+	file->err = err;
+	file->text = NULL;
+	file->length = 0;
+	file->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if (file->fd < 0) {
+		fprintf(err, "Could not open file \"%s\".\n", path);
+		return false;
+	}
+	if (fstat(file->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return true;
+
+	// mmap() refuses empty mappings, the empty source needs none anyway
+	file->text = "";
+	if (st.st_size == 0)
+		return true;
+	text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if (text == MAP_FAILED) {
+		fprintf(err, "Could not read file \"%s\".\n", path);
+		close_source_file(file);
+		return false;
+	}
+	file->text = text;
+	file->length = st.st_size;
+	return true;
+}
+
+enum interpret_result interpret_file(struct vm *vm, struct source_file *file)
+{
+	if (file->text != NULL)
+		return interpret(vm, file->text, file->length);
+	return interpret_reader(vm, read_source_file, file);
+}
+
+void close_source_file(struct source_file *file)
+{
+	if (file->length > 0)
+		munmap((void *)file->text, file->length);
+	if (file->fd != STDIN_FILENO)
+		close(file->fd);
+}
+
+int exit_code(enum interpret_result result)
+{
+	if (result == INTERPRET_COMPILE_ERROR)
+		return 65;
+	if (result == INTERPRET_RUNTIME_ERROR)
+		return 70;
+	return 0;
+}
+
+static bool take_front(struct deque *deque, int32_t *script)
+{
+	bool found;
+
+	pthread_mutex_lock(&deque->lock);
+	found = deque->front < deque->back;
+	if (found)
+		*script = deque->scripts[deque->front++];
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+static bool take_back(struct deque *deque, int32_t *script)
+{
+	bool found;
+
+	pthread_mutex_lock(&deque->lock);
+	found = deque->front < deque->back;
+	if (found)
+		*script = deque->scripts[--deque->back];
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+static bool next_script(struct worker *worker, int32_t *script)
+{
+	struct runner *runner = worker->runner;
+	int32_t i;
+
+	if (take_front(&runner->deques[worker->id], script))
+		return true;
+	for (i = 1; i < runner->worker_count; i++)
+		if (take_back(&runner->deques[(worker->id + i) %
+					      runner->worker_count],
+			      script))
+			return true;
+	return false;
+}
+
+/**
+ * run_script() - Run @script in an isolate on the VM of @worker.
+ *
+ * Output of the script is captured in memory and printed by the main
+ * thread once all scripts before it were printed.
+ */
+static void run_script(struct worker *worker, struct script *script)
+{
+	struct runner *runner = worker->runner;
+	struct vm *vm = &worker->vm;
+	FILE *out = open_memstream(&script->out, &script->out_length),
+	     *err = open_memstream(&script->err, &script->err_length);
+	struct source_file source;
+	int code = EXIT_IO_ERROR;
+
+	if (out == NULL || err == NULL)
+		exit(1);
+
+	if (open_source_file(script->path, err, &source)) {
+		init_output(&vm->out, out);
+		vm->err = err;
+#ifdef PROFILE_EXECUTION
+		vm->profile.script = (int32_t)(script - runner->scripts) + 1;
+#endif
+		code = exit_code(interpret_file(vm, &source));
+		if (runner->memstats)
+			print_memory_report(err, &vm->memory);
+		reset_vm(vm);
+		close_source_file(&source);
+	}
+	fclose(out);
+	fclose(err);
+
+	pthread_mutex_lock(&runner->lock);
+	script->exit_code = code;
+	script->done = true;
+	pthread_cond_broadcast(&runner->script_done);
+	pthread_mutex_unlock(&runner->lock);
+}
+
+static void *work(void *arg)
+{
+	struct worker *worker = arg;
+	int32_t script;
+
+	init_vm(&worker->vm);
+	while (next_script(worker, &script))
+		run_script(worker, &worker->runner->scripts[script]);
+	free_vm(&worker->vm);
+	return NULL;
+}
+
+static void init_deques(struct runner *runner)
+{
+	struct deque *deque;
+	int32_t capacity = runner->script_count / runner->worker_count + 1, i;
+
+	runner->deques = malloc(sizeof(*runner->deques) *
+				runner->worker_count);
+	if (runner->deques == NULL)
+		exit(1);
+
+	for (i = 0; i < runner->worker_count; i++) {
+		deque = &runner->deques[i];
+		pthread_mutex_init(&deque->lock, NULL);
+		deque->scripts = malloc(sizeof(int32_t) * capacity);
+		if (deque->scripts == NULL)
+			exit(1);
+		deque->front = 0;
+		deque->back = 0;
+	}
+	for (i = 0; i < runner->script_count; i++) {
+		deque = &runner->deques[i % runner->worker_count];
+		deque->scripts[deque->back++] = i;
+	}
+}
+
+/**
+ * print_script() - Wait until @script finished and print its output.
+ *
+ * Return: The exit code of the script.
+ */
+static int print_script(struct runner *runner, struct script *script)
+{
+	pthread_mutex_lock(&runner->lock);
+	while (!script->done)
+		pthread_cond_wait(&runner->script_done, &runner->lock);
+	pthread_mutex_unlock(&runner->lock);
+
+	fwrite(script->out, 1, script->out_length, stdout);
+	fflush(stdout);
+	fwrite(script->err, 1, script->err_length, stderr);
+	free(script->out);
+	free(script->err);
+	return script->exit_code;
+}
+
+/**
+ * run_scripts() - Run scripts on a pool of worker threads.
+ * @paths: Paths of the scripts.
+ * @count: Number of scripts.
+ * @jobs: Number of worker threads, each with its own VM.
+ * @memstats: Print the memory statistics of every script to its stderr.
+ *
+ * Every script runs in its own isolate: each worker initializes its VM
+ * once and resets it after each script, so scripts never see each other's
+ * globals or strings but share the natives. Output is printed in the
+ * order of @paths regardless of the order the scripts finish in.
+ *
+ * Return: The exit code of the first script that failed, 0 otherwise.
+ */
+int run_scripts(const char **paths, int32_t count, int32_t jobs,
+		bool memstats)
+{
+	struct runner runner;
+	struct worker *workers;
+	int32_t i;
+	int code, result = 0;
+
+	if (jobs > count)
+		jobs = count;
+	if (jobs < 1)
+		jobs = 1;
+
+	runner.scripts = calloc(count, sizeof(*runner.scripts));
+	workers = malloc(sizeof(*workers) * jobs);
+	if (runner.scripts == NULL || workers == NULL)
+		exit(1);
+	for (i = 0; i < count; i++)
+		runner.scripts[i].path = paths[i];
+	runner.script_count = count;
+	runner.worker_count = jobs;
+	runner.memstats = memstats;
+	pthread_mutex_init(&runner.lock, NULL);
+	pthread_cond_init(&runner.script_done, NULL);
+	init_deques(&runner);
+
+	for (i = 0; i < jobs; i++) {
+		workers[i].runner = &runner;
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, work,
+				   &workers[i]) != 0) {
+			fprintf(stderr, "Could not start worker thread.\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		code = print_script(&runner, &runner.scripts[i]);
+		if (result == 0)
+			result = code;
+	}
+
+	for (i = 0; i < jobs; i++) {
+		pthread_join(workers[i].thread, NULL);
+		pthread_mutex_destroy(&runner.deques[i].lock);
+		free(runner.deques[i].scripts);
+	}
+	pthread_cond_destroy(&runner.script_done);
+	pthread_mutex_destroy(&runner.lock);
+	free(runner.deques);
+	free(workers);
+	free(runner.scripts);
+	return result;
+}
@@ -0,0 +1,30 @@
+#ifndef clox_runner_h
+#define clox_runner_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+#define RUNNER_MAX_JOBS 256
+
+/*
+ * The source of a script. @text is the mapped file or NULL if the file is
+ * read in pieces while compiling.
+ */
+struct source_file {
+	const char *path;
+	FILE *err;
+	int fd;
+	const char *text;
+	size_t length;
+};
+
+bool open_source_file(const char *path, FILE *err, struct source_file *file);
+enum interpret_result interpret_file(struct vm *vm, struct source_file *file);
+void close_source_file(struct source_file *file);
+int exit_code(enum interpret_result result);
+int run_scripts(const char **paths, int32_t count, int32_t jobs,
+		bool memstats);
+
+#endif
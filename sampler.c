@@ -0,0 +1,255 @@
+#define _XOPEN_SOURCE 700
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+#include "sampler.h"
+#include "vm.h"
+
+#define SAMPLER_MAX_STACKS (1 << 14)
+#define SAMPLER_MAX_FRAMES (1 << 16)
+
+struct sample_frame {
+	struct object_function *function;
+	int32_t line;
+};
+
+struct sample_stack {
+	uint32_t hash;
+	int32_t depth;
+	int32_t first_frame;
+	uint64_t count;
+};
+
+/*
+ * Samples are aggregated inside the signal handler so the sampler never
+ * allocates while the VM is running. Identical stacks share one entry of
+ * @stacks and their frames are stored once in @frames.
+ */
+struct sampler {
+	struct vm *vm;
+	const char *path;
+	struct sample_stack *stacks;
+	struct sample_frame *frames;
+	int32_t frame_count;
+	uint64_t samples;
+	uint64_t dropped;
+	struct sigaction previous;
+	bool running;
+};
+
+static struct sampler sampler;
+
+static uint32_t hash_frame(uint32_t hash, struct sample_frame *frame)
+{
+	uintptr_t function = (uintptr_t)frame->function;
+	uint32_t i;
+
+	for (i = 0; i < sizeof(function); i++) {
+		hash ^= (uint8_t)(function >> (i * 8));
+		hash *= FNV_PRIME;
+	}
+	for (i = 0; i < sizeof(frame->line); i++) {
+		hash ^= (uint8_t)((uint32_t)frame->line >> (i * 8));
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static bool stack_equal(struct sample_stack *stack,
+			struct sample_frame *frames, int32_t depth)
+{
+	int32_t i;
+	struct sample_frame *stored = &sampler.frames[stack->first_frame];
+
+	if (stack->depth != depth)
+		return false;
+	for (i = 0; i < depth; i++)
+		if (stored[i].function != frames[i].function ||
+		    stored[i].line != frames[i].line)
+			return false;
+	return true;
+}
+
+/**
+ * NOTE: Only reads VM state. A frame that is being pushed while the signal
+ * arrives may still describe its previous occupant, which can attribute a
+ * single sample to the caller instead of the callee.
+ */
+static void handle_sample(int signal)
+{
+	struct sample_frame frames[FRAME_MAX];
+	struct sample_stack *stack;
+	struct call_frame *frame;
+	struct object_function *function;
+	int32_t depth = 0, frame_count = sampler.vm->frame_count, offset, i;
+	uint32_t hash = FNV_OFFSET_BASIS, bucket;
+
+	(void)signal;
+	for (i = 0; i < frame_count && i < sampler.vm->frame_max; i++) {
+		frame = &sampler.vm->frames[i];
+		if (frame->closure == NULL)
+			break;
+		function = frame->closure->function;
+		offset = (int32_t)(frame->ip - function->chunk.code) - 1;
+		if (offset < 0 || offset >= function->chunk.length)
+			offset = 0;
+		frames[depth].function = function;
+		frames[depth].line = read_line(&function->chunk.lines, offset);
+		hash = hash_frame(hash, &frames[depth]);
+		depth++;
+	}
+	if (depth == 0)
+		return;
+
+	sampler.samples++;
+	bucket = hash % SAMPLER_MAX_STACKS;
+	for (i = 0; i < SAMPLER_MAX_STACKS; i++) {
+		stack = &sampler.stacks[bucket];
+		if (stack->count == 0)
+			break;
+		if (stack->hash == hash && stack_equal(stack, frames, depth)) {
+			stack->count++;
+			return;
+		}
+		bucket = (bucket + 1) % SAMPLER_MAX_STACKS;
+	}
+
+	if (stack->count != 0 ||
+	    sampler.frame_count + depth > SAMPLER_MAX_FRAMES) {
+		sampler.dropped++;
+		return;
+	}
+
+	memcpy(&sampler.frames[sampler.frame_count], frames,
+	       sizeof(*frames) * depth);
+	stack->hash = hash;
+	stack->depth = depth;
+	stack->first_frame = sampler.frame_count;
+	stack->count = 1;
+	sampler.frame_count += depth;
+}
+
+/**
+ * start_sampler() - Start sampling the call frames of @vm.
+ * @vm: The VM to sample.
+ * @path: File the collapsed stacks are written to by stop_sampler().
+ * @hz: Number of samples taken per second of CPU time.
+ *
+ * Installs a SIGPROF handler driven by setitimer(ITIMER_PROF). Each sample
+ * walks the frames of @vm and resolves every frame to its function and the
+ * line of the instruction being executed.
+ *
+ * NOTE: SIGPROF is delivered per process, so only one VM can be sampled at
+ * a time.
+ *
+ * Return: true if the timer was started, false otherwise.
+ */
+bool start_sampler(struct vm *vm, const char *path, int32_t hz)
+{
+	struct sigaction action;
+	struct itimerval timer;
+
+	if (hz <= 0 || hz > 1000000)
+		return false;
+
+	sampler.vm = vm;
+	sampler.path = path;
+	sampler.stacks = calloc(SAMPLER_MAX_STACKS, sizeof(*sampler.stacks));
+	sampler.frames = calloc(SAMPLER_MAX_FRAMES, sizeof(*sampler.frames));
+	if (sampler.stacks == NULL || sampler.frames == NULL)
+		exit(1);
+	sampler.frame_count = 0;
+	sampler.samples = 0;
+	sampler.dropped = 0;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_sample;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, &sampler.previous) != 0)
+		return false;
+
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / hz;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+		sigaction(SIGPROF, &sampler.previous, NULL);
+		return false;
+	}
+
+	sampler.running = true;
+	return true;
+}
+
+static void write_frame(FILE *out, struct sample_frame *frame)
+{
+	if (frame->function->name == NULL)
+		fprintf(out, "script:%d", frame->line);
+	else
+		fprintf(out, "%s:%d", frame->function->name->characters,
+			frame->line);
+}
+
+/**
+ * stop_sampler() - Stop sampling and write the collected stacks.
+ *
+ * The output uses the collapsed stack format understood by flame graph
+ * tools: one line per distinct stack, frames from the outermost to the
+ * innermost separated by ';', followed by the number of samples.
+ *
+ * NOTE: Must be called before the objects of the VM are freed since the
+ * samples refer to the functions.
+ */
+void stop_sampler(void)
+{
+	struct itimerval timer;
+	struct sample_stack *stack;
+	FILE *out;
+	int32_t i, j;
+
+	if (!sampler.running)
+		return;
+
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &sampler.previous, NULL);
+	sampler.running = false;
+
+	out = fopen(sampler.path, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Could not write samples to \"%s\".\n",
+			sampler.path);
+	} else {
+		for (i = 0; i < SAMPLER_MAX_STACKS; i++) {
+			stack = &sampler.stacks[i];
+			if (stack->count == 0)
+				continue;
+			for (j = 0; j < stack->depth; j++) {
+				if (j > 0)
+					fputc(';', out);
+				write_frame(out,
+					    &sampler.frames[stack->first_frame +
+							    j]);
+			}
+			fprintf(out, " %llu\n",
+				(unsigned long long)stack->count);
+		}
+		fclose(out);
+	}
+
+	if (sampler.dropped > 0)
+		fprintf(stderr, "Sampler dropped %llu of %llu samples.\n",
+			(unsigned long long)sampler.dropped,
+			(unsigned long long)sampler.samples);
+
+	free(sampler.stacks);
+	free(sampler.frames);
+	sampler.stacks = NULL;
+	sampler.frames = NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef clox_sampler_h
+#define clox_sampler_h
+
+#include "common.h"
+
+#define SAMPLER_DEFAULT_HZ 1000
+
+struct vm;
+
+bool start_sampler(struct vm *vm, const char *path, int32_t hz);
+void stop_sampler(void);
+
+#endif
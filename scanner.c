@@ -1,269 +1,476 @@
 #include <ctype.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "scanner.h"
 
-struct scanner {
-	char *start;
-	char *current;
-	int32_t line;
+struct keyword {
+	const char *text;
+	int32_t length;
+	enum token_type token_type;
 };
 
-struct scanner scanner;
+#include "keywords.h"
 
-void init_scanner(char *source)
+#define SOURCE_BLOCK_SIZE (64 * 1024)
+
+/*
+ * A piece of a streamed source. Blocks are never moved or freed before
+ * free_scanner(), since tokens handed out earlier point into them.
+ */
+struct source_block {
+	struct source_block *next;
+	char *limit;
+	char text[];
+};
+
+/**
+ * init_scanner() - Scan the @length bytes at @source.
+ *
+ * @source needs no terminating NUL byte, so a mapped file can be scanned
+ * as is.
+ */
+void init_scanner(struct scanner *scanner, const char *source, size_t length)
 {
-	scanner.start = source;
-	scanner.current = source;
-	scanner.line = 1;
+	scanner->start = source;
+	scanner->current = source;
+	scanner->end = source + length;
+	scanner->line = 1;
+	scanner->read = NULL;
+	scanner->context = NULL;
+	scanner->blocks = NULL;
 }
 
-static bool is_at_end(void)
+/**
+ * init_scanner_reader() - Scan a source that arrives in pieces, like a pipe.
+ * @read: Called with @context whenever the scanner needs more input.
+ */
+void init_scanner_reader(struct scanner *scanner, read_fn read, void *context)
 {
-	return *scanner.current == '\0';
+	init_scanner(scanner, NULL, 0);
+	scanner->read = read;
+	scanner->context = context;
 }
 
-static struct token make_token(enum token_type token_type)
+/**
+ * free_scanner() - Free the blocks of a streamed source.
+ *
+ * NOTE: Tokens of a streamed source are invalid afterwards.
+ */
+void free_scanner(struct scanner *scanner)
+{
+	struct source_block *block;
+
+	while (scanner->blocks != NULL) {
+		block = scanner->blocks;
+		scanner->blocks = block->next;
+		free(block);
+	}
+}
+
+/**
+ * refill() - Read the next piece of a streamed source.
+ *
+ * Input is appended to the newest block while it has room. Otherwise the
+ * part of the current token scanned so far is copied to the front of a new
+ * block, so every token stays contiguous.
+ *
+ * Return: false at the end of the input.
+ */
+static bool refill(struct scanner *scanner)
+{
+	struct source_block *block = scanner->blocks;
+	size_t kept = scanner->end - scanner->start, size = SOURCE_BLOCK_SIZE;
+	int32_t bytes_read;
+
+	if (scanner->read == NULL)
+		return false;
+
+	if (block == NULL || scanner->end == block->limit) {
+		while (size < kept * 2)
+			size *= 2;
+		block = malloc(sizeof(*block) + size);
+		if (block == NULL)
+			exit(1);
+		block->next = scanner->blocks;
+		block->limit = block->text + size;
+		scanner->blocks = block;
+		memcpy(block->text, scanner->start, kept);
+		scanner->current = block->text +
+				   (scanner->current - scanner->start);
+		scanner->start = block->text;
+		scanner->end = block->text + kept;
+	}
+
+	bytes_read = scanner->read(scanner->context, block->text +
+				   (scanner->end - block->text),
+				   block->limit - scanner->end);
+	if (bytes_read <= 0) {
+		scanner->read = NULL;
+		return false;
+	}
+	scanner->end += bytes_read;
+	return true;
+}
+
+static bool is_at_end(struct scanner *scanner)
+{
+	return scanner->current == scanner->end && !refill(scanner);
+}
+
+static struct token make_token(struct scanner *scanner,
+			       enum token_type token_type)
 {
 	return (struct token){
 		.token_type = token_type,
-		.start = scanner.start,
-		.length = scanner.current - scanner.start,
-		.line = scanner.line,
+		.start = scanner->start,
+		.length = scanner->current - scanner->start,
+		.line = scanner->line,
 	};
 }
 
-static struct token error_token(const char *msg)
+static struct token error_token(struct scanner *scanner, const char *msg)
 {
 	return (struct token){
 		.token_type = TOKEN_ERROR,
 		.start = msg,
 		.length = strlen(msg),
-		.line = scanner.line,
+		.line = scanner->line,
 	};
 }
 
-static char advance(void)
+static char advance(struct scanner *scanner)
 {
-	scanner.current++;
-	return scanner.current[-1];
+	scanner->current++;
+	return scanner->current[-1];
 }
 
-static bool match(char c)
+static bool match(struct scanner *scanner, char c)
 {
-	if (is_at_end())
+	if (is_at_end(scanner))
 		return false;
 
-	if (*scanner.current != c)
+	if (*scanner->current != c)
 		return false;
 
-	scanner.current++;
+	scanner->current++;
 	return true;
 }
 
-static char peek(void)
+static char peek(struct scanner *scanner)
 {
-	return *scanner.current;
+	if (is_at_end(scanner))
+		return '\0';
+	return *scanner->current;
 }
 
-static char peek_next(void)
+static char peek_next(struct scanner *scanner)
 {
-	if (is_at_end())
-		return '\0';
-	return scanner.current[1];
+	while (scanner->end - scanner->current < 2)
+		if (!refill(scanner))
+			return '\0';
+	return scanner->current[1];
 }
 
-static void skip_whitespace(void)
-{
-	char c;
+/*
+ * Runs of bytes the scanner skips without looking at them one by one:
+ * whitespace, the rest of a comment, the body of a string and the rest of
+ * an identifier.
+ */
+enum byte_run {
+	RUN_WHITESPACE,
+	RUN_COMMENT,
+	RUN_STRING,
+	RUN_IDENTIFIER,
+};
 
-	for (;;)
-		switch (c = peek()) {
-		case '/':
-			if (peek_next() == '/')
-				while (peek() != '\n' && !is_at_end())
-					advance();
-			/* fall through */
-			else
-				return;
-		case '\n':
-			scanner.line++;
-			/* fall through */
-		case ' ':
-		case '\r':
-		case '\t':
-			advance();
-			break;
-		default:
-			return;
-		}
+static inline bool ends_run(char c, enum byte_run run)
+{
+	switch (run) {
+	case RUN_WHITESPACE:
+		return c != ' ' && c != '\t' && c != '\r' && c != '\n';
+	case RUN_COMMENT:
+		return c == '\n';
+	case RUN_STRING:
+		return c == '"';
+	case RUN_IDENTIFIER:
+		return !isalnum(c) && c != '_';
+	}
+	return true; // UNREACHABLE
 }
 
-static struct token string(void)
-{
-	char c;
-	bool b;
+// Runs are checked byte by byte up to this length
+#define SHORT_RUN 16
 
-	while ((c = peek()) != '"' && !(b = is_at_end())) {
-		if (c == '\n')
-			scanner.line++;
-		advance();
-	}
+#ifdef __SSE2__
+#define CHUNK_SIZE 16
 
-	if (b)
-		return error_token("Unterminated string.");
+static inline __m128i in_range(__m128i bytes, char low, char high)
+{
+	__m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(low));
+	__m128i width = _mm_set1_epi8((char)(high - low));
 
-	advance(); // consume closing '"'
-	return make_token(TOKEN_STRING);
+	return _mm_cmpeq_epi8(_mm_min_epu8(offset, width), offset);
 }
 
-static struct token number(void)
+static inline __m128i equal(__m128i bytes, char c)
 {
-	while (isdigit(peek()))
-		advance();
+	return _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c));
+}
 
-	if (peek() == '.' && isdigit(peek_next())) {
-		// consume '.'
-		advance();
-		while (isdigit(peek()))
-			advance();
+// run_ends() - Mark the bytes of @bytes that end a run of kind @run.
+static inline uint32_t run_ends(__m128i bytes, enum byte_run run)
+{
+	__m128i ends, letters;
+
+	switch (run) {
+	case RUN_WHITESPACE:
+		ends = _mm_or_si128(_mm_or_si128(equal(bytes, ' '),
+						 equal(bytes, '\t')),
+				    _mm_or_si128(equal(bytes, '\r'),
+						 equal(bytes, '\n')));
+		return ~(uint32_t)_mm_movemask_epi8(ends) & 0xffff;
+	case RUN_COMMENT:
+		return (uint32_t)_mm_movemask_epi8(equal(bytes, '\n'));
+	case RUN_STRING:
+		return (uint32_t)_mm_movemask_epi8(equal(bytes, '"'));
+	case RUN_IDENTIFIER:
+		// Setting 0x20 turns upper into lower case letters
+		letters = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+		ends = _mm_or_si128(in_range(letters, 'a', 'z'),
+				    in_range(bytes, '0', '9'));
+		ends = _mm_or_si128(ends, equal(bytes, '_'));
+		return ~(uint32_t)_mm_movemask_epi8(ends) & 0xffff;
 	}
+	return 0; // UNREACHABLE
+}
 
-	return make_token(TOKEN_NUMBER);
+/**
+ * skip_long_run() - Skip the rest of a run that is at least SHORT_RUN
+ * bytes long.
+ *
+ * Compares 16 bytes at once. The chunks are loaded from 16 byte aligned
+ * addresses: such a load never crosses a page boundary, so reading the
+ * bytes of the last chunk beyond @end can't fault. They and the bytes of
+ * the first chunk before @current are masked out.
+ */
+static const char *skip_long_run(const char *current, const char *end,
+				 enum byte_run run, int32_t *lines)
+{
+	const char *chunk = current - ((uintptr_t)current & (CHUNK_SIZE - 1));
+	uint32_t skip = (uint32_t)(current - chunk), ends, newlines;
+	__m128i bytes;
+
+	for (; chunk < end; chunk += CHUNK_SIZE, skip = 0) {
+		bytes = _mm_load_si128((const __m128i *)chunk);
+		ends = run_ends(bytes, run) >> skip << skip;
+		if (end - chunk < CHUNK_SIZE)
+			ends |= 1u << (end - chunk);
+		if (lines != NULL) {
+			newlines = (uint32_t)_mm_movemask_epi8(
+				equal(bytes, '\n'));
+			newlines = newlines >> skip << skip;
+			if (ends != 0)
+				newlines &= (ends & -ends) - 1;
+			*lines += __builtin_popcount(newlines);
+		}
+		if (ends != 0)
+			return chunk + __builtin_ctz(ends);
+	}
+	return end;
+}
+#else
+static const char *skip_long_run(const char *current, const char *end,
+				 enum byte_run run, int32_t *lines)
+{
+	for (; current < end && !ends_run(*current, run); current++)
+		if (lines != NULL && *current == '\n')
+			(*lines)++;
+	return current;
+}
+#endif
+
+/**
+ * skip_run() - Find the end of the run of kind @run starting at @current.
+ * @lines: Incremented by the newlines in the run, may be NULL.
+ *
+ * Most runs are short and checked byte by byte right here, only longer
+ * ones are handed to skip_long_run().
+ *
+ * Return: The first byte not in the run or @end.
+ */
+static inline const char *skip_run(const char *current, const char *end,
+				   enum byte_run run, int32_t *lines)
+{
+	const char *limit = end - current > SHORT_RUN ? current + SHORT_RUN :
+							 end;
+
+	for (; current < limit; current++) {
+		if (ends_run(*current, run))
+			return current;
+		if (lines != NULL && *current == '\n')
+			(*lines)++;
+	}
+	if (current == end)
+		return current;
+	return skip_long_run(current, end, run, lines);
 }
 
-static enum token_type check_keyword(int32_t start, int32_t length,
-				     const char *rest,
-				     enum token_type token_type)
+/**
+ * skip() - Advance past the run of kind @run, refilling a streamed source
+ * as long as the run reaches the end of what was read so far.
+ *
+ * Whitespace and comments are not part of a token and aren't kept when
+ * refilling.
+ */
+static inline void skip(struct scanner *scanner, enum byte_run run,
+			int32_t *lines)
 {
-	if (scanner.current - scanner.start != start + length)
-		return TOKEN_IDENTIFIER;
+	scanner->current = skip_run(scanner->current, scanner->end, run, lines);
+	while (scanner->current == scanner->end) {
+		if (run == RUN_WHITESPACE || run == RUN_COMMENT)
+			scanner->start = scanner->current;
+		if (!refill(scanner))
+			return;
+		scanner->current = skip_long_run(scanner->current, scanner->end,
+						 run, lines);
+	}
+}
 
-	if (memcmp(scanner.start + start, rest, length) != 0)
-		return TOKEN_IDENTIFIER;
+static void skip_whitespace(struct scanner *scanner)
+{
+	for (;;) {
+		skip(scanner, RUN_WHITESPACE, &scanner->line);
+		scanner->start = scanner->current;
+		if (peek(scanner) != '/' || peek_next(scanner) != '/')
+			return;
+		skip(scanner, RUN_COMMENT, NULL);
+	}
+}
 
-	return token_type;
+static struct token string(struct scanner *scanner)
+{
+	skip(scanner, RUN_STRING, &scanner->line);
+	if (is_at_end(scanner))
+		return error_token(scanner, "Unterminated string.");
+
+	advance(scanner); // consume closing '"'
+	return make_token(scanner, TOKEN_STRING);
 }
 
-static enum token_type identifier_type(void)
+static struct token number(struct scanner *scanner)
 {
-	switch (*scanner.start) {
-	case 'a':
-		return check_keyword(1, 2, "nd", TOKEN_AND);
-	case 'c':
-		return check_keyword(1, 4, "lass", TOKEN_CLASS);
-	case 'e':
-		return check_keyword(1, 3, "lse", TOKEN_ELSE);
-	case 'f':
-		if (scanner.current - scanner.start < 2)
-			break;
-		switch (scanner.start[1]) {
-		case 'a':
-			return check_keyword(2, 3, "lse", TOKEN_FALSE);
-		case 'o':
-			return check_keyword(2, 1, "r", TOKEN_FOR);
-		case 'u':
-			return check_keyword(2, 1, "n", TOKEN_FUN);
-		default:
-			break;
-		}
-	case 'i':
-		return check_keyword(1, 1, "f", TOKEN_IF);
-	case 'n':
-		return check_keyword(1, 2, "il", TOKEN_NIL);
-	case 'o':
-		return check_keyword(1, 1, "r", TOKEN_OR);
-	case 'p':
-		return check_keyword(1, 4, "rint", TOKEN_PRINT);
-	case 'r':
-		return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-	case 's':
-		return check_keyword(1, 4, "uper", TOKEN_SUPER);
-	case 't':
-		if (scanner.current - scanner.start < 2)
-			break;
-		switch (scanner.start[1]) {
-		case 'h':
-			return check_keyword(2, 2, "is", TOKEN_THIS);
-		case 'r':
-			return check_keyword(2, 2, "ue", TOKEN_TRUE);
-		default:
-			break;
-		}
-	case 'v':
-		return check_keyword(1, 2, "ar", TOKEN_VAR);
-	case 'w':
-		return check_keyword(1, 4, "hile", TOKEN_WHILE);
+	while (isdigit(peek(scanner)))
+		advance(scanner);
+
+	if (peek(scanner) == '.' && isdigit(peek_next(scanner))) {
+		// consume '.'
+		advance(scanner);
+		while (isdigit(peek(scanner)))
+			advance(scanner);
 	}
-	return TOKEN_IDENTIFIER;
+
+	return make_token(scanner, TOKEN_NUMBER);
 }
 
-static struct token identifier(void)
+/**
+ * identifier_type() - Tell keywords from other identifiers.
+ *
+ * Looks the token up in the perfect hash table generated from keywords.def,
+ * which has a single candidate slot for each length, first and last
+ * character.
+ */
+static enum token_type identifier_type(struct scanner *scanner)
 {
-	char c;
+	int32_t length = scanner->current - scanner->start;
+	const struct keyword *keyword;
+
+	if (length > KEYWORD_MAX_LENGTH)
+		return TOKEN_IDENTIFIER;
 
-	for (c = peek(); isalnum(c) || c == '_'; c = peek())
-		advance();
+	keyword = &keywords[KEYWORD_HASH(length, scanner->start[0],
+					 scanner->start[length - 1])];
+	if (keyword->length != length ||
+	    memcmp(scanner->start, keyword->text, length) != 0)
+		return TOKEN_IDENTIFIER;
+	return keyword->token_type;
+}
 
-	return make_token(identifier_type());
+static struct token identifier(struct scanner *scanner)
+{
+	skip(scanner, RUN_IDENTIFIER, NULL);
+	return make_token(scanner, identifier_type(scanner));
 }
 
-struct token scan_token(void)
+struct token scan_token(struct scanner *scanner)
 {
 	char c;
 
-	skip_whitespace();
-	scanner.start = scanner.current;
+	skip_whitespace(scanner);
+	scanner->start = scanner->current;
 
-	if (is_at_end())
-		return make_token(TOKEN_EOF);
+	if (is_at_end(scanner))
+		return make_token(scanner, TOKEN_EOF);
 
-	c = advance();
+	c = advance(scanner);
 
 	if (isdigit(c))
-		return number();
+		return number(scanner);
 	if (isalpha(c) || c == '_')
-		return identifier();
+		return identifier(scanner);
 
 	switch (c) {
 	case '(':
-		return make_token(TOKEN_LEFT_PAREN);
+		return make_token(scanner, TOKEN_LEFT_PAREN);
 	case ')':
-		return make_token(TOKEN_RIGHT_PAREN);
+		return make_token(scanner, TOKEN_RIGHT_PAREN);
 	case '{':
-		return make_token(TOKEN_LEFT_BRACE);
+		return make_token(scanner, TOKEN_LEFT_BRACE);
 	case '}':
-		return make_token(TOKEN_RIGHT_BRACE);
+		return make_token(scanner, TOKEN_RIGHT_BRACE);
+	case '[':
+		return make_token(scanner, TOKEN_LEFT_BRACKET);
+	case ']':
+		return make_token(scanner, TOKEN_RIGHT_BRACKET);
 	case ':':
-		return make_token(TOKEN_COLON);
+		return make_token(scanner, TOKEN_COLON);
 	case ',':
-		return make_token(TOKEN_COMMA);
+		return make_token(scanner, TOKEN_COMMA);
 	case '.':
-		return make_token(TOKEN_DOT);
+		return make_token(scanner, TOKEN_DOT);
 	case '-':
-		return make_token(TOKEN_MINUS);
+		return make_token(scanner, TOKEN_MINUS);
 	case '+':
-		return make_token(TOKEN_PLUS);
+		return make_token(scanner, TOKEN_PLUS);
 	case '?':
-		return make_token(TOKEN_QUESTION);
+		return make_token(scanner, TOKEN_QUESTION);
 	case ';':
-		return make_token(TOKEN_SEMICOLON);
+		return make_token(scanner, TOKEN_SEMICOLON);
 	case '/':
-		return make_token(TOKEN_SLASH);
+		return make_token(scanner, TOKEN_SLASH);
 	case '*':
-		return make_token(TOKEN_STAR);
+		return make_token(scanner, TOKEN_STAR);
 	case '!':
-		return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+		return make_token(scanner, match(scanner, '=') ?
+						   TOKEN_BANG_EQUAL :
+						   TOKEN_BANG);
 	case '=':
-		return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+		return make_token(scanner, match(scanner, '=') ?
+						   TOKEN_EQUAL_EQUAL :
+						   TOKEN_EQUAL);
 	case '>':
-		return make_token(match('=') ? TOKEN_GREATER_EQUAL :
-					       TOKEN_GREATER);
+		return make_token(scanner, match(scanner, '=') ?
+						   TOKEN_GREATER_EQUAL :
+						   TOKEN_GREATER);
 	case '<':
-		return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+		return make_token(scanner, match(scanner, '=') ?
+						   TOKEN_LESS_EQUAL :
+						   TOKEN_LESS);
 	case '"':
-		return string();
+		return string(scanner);
 	}
 
-	return error_token("Unexpected character.");
+	return error_token(scanner, "Unexpected character.");
 }
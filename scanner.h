@@ -9,6 +9,8 @@ enum token_type {
 	TOKEN_RIGHT_PAREN,
 	TOKEN_LEFT_BRACE,
 	TOKEN_RIGHT_BRACE,
+	TOKEN_LEFT_BRACKET,
+	TOKEN_RIGHT_BRACKET,
 	TOKEN_COLON,
 	TOKEN_COMMA,
 	TOKEN_DOT,
@@ -39,6 +41,7 @@ enum token_type {
 	TOKEN_FOR,
 	TOKEN_FUN,
 	TOKEN_IF,
+	TOKEN_LET,
 	TOKEN_NIL,
 	TOKEN_OR,
 	TOKEN_PRINT,
@@ -48,6 +51,7 @@ enum token_type {
 	TOKEN_TRUE,
 	TOKEN_VAR,
 	TOKEN_WHILE,
+	TOKEN_YIELD,
 	// Special
 	TOKEN_ERROR,
 	TOKEN_EOF,
@@ -60,7 +64,33 @@ struct token {
 	int32_t line;
 };
 
-void init_scanner(char *source);
-struct token scan_token(void);
+/*
+ * Reads up to @size bytes of a streamed source into @buffer.
+ *
+ * Return: The number of bytes read, 0 at the end of the source.
+ */
+typedef int32_t (*read_fn)(void *context, char *buffer, int32_t size);
+
+struct source_block;
+
+/*
+ * The scanner works on the range from @start to @end. For a streamed source
+ * @read is called to get more input once @end is reached, the input is kept
+ * in @blocks until free_scanner().
+ */
+struct scanner {
+	const char *start;
+	const char *current;
+	const char *end;
+	int32_t line;
+	read_fn read;
+	void *context;
+	struct source_block *blocks;
+};
+
+void init_scanner(struct scanner *scanner, const char *source, size_t length);
+void init_scanner_reader(struct scanner *scanner, read_fn read, void *context);
+void free_scanner(struct scanner *scanner);
+struct token scan_token(struct scanner *scanner);
 
 #endif
@@ -0,0 +1,82 @@
+#include "common.h"
+#include "memory.h"
+#include "shape.h"
+
+/**
+ * new_shape() - Create the shape that adds @name to @parent.
+ *
+ * A root shape has no @parent and no @name.
+ */
+struct shape *new_shape(struct vm *vm, struct shape *parent,
+			struct object_string *name)
+{
+	struct shape *shape = ALLOCATE(vm, MEMORY_SHAPE, struct shape, 1);
+
+	shape->parent = parent;
+	shape->name = name;
+	shape->field_count = parent == NULL ? 0 : parent->field_count + 1;
+	shape->transitions = NULL;
+	shape->transition_count = 0;
+	shape->transition_capacity = 0;
+	return shape;
+}
+
+/**
+ * free_shape() - Free @shape with all shapes reachable from it.
+ */
+void free_shape(struct vm *vm, struct shape *shape)
+{
+	int32_t i;
+
+	for (i = 0; i < shape->transition_count; i++)
+		free_shape(vm, shape->transitions[i]);
+	FREE_ARRAY(vm, MEMORY_SHAPE, struct shape *, shape->transitions,
+		   shape->transition_capacity);
+	FREE(vm, MEMORY_SHAPE, struct shape, shape);
+}
+
+/**
+ * shape_find() - Slot of the field @name in the layout of @shape.
+ *
+ * Walks from @shape to the root, which is only done when an inline cache
+ * misses.
+ *
+ * Return: The slot, or -1 if @shape has no field @name.
+ */
+int32_t shape_find(struct shape *shape, struct object_string *name)
+{
+	for (; shape->parent != NULL; shape = shape->parent)
+		if (shape->name == name)
+			return shape->field_count - 1;
+	return -1;
+}
+
+/**
+ * shape_add() - The shape an instance of @shape moves to when the field
+ * @name is added.
+ *
+ * NOTE: @shape must not have a field @name already.
+ */
+struct shape *shape_add(struct vm *vm, struct shape *shape,
+			struct object_string *name)
+{
+	struct shape *child;
+	int32_t i, old_capacity;
+
+	for (i = 0; i < shape->transition_count; i++)
+		if (shape->transitions[i]->name == name)
+			return shape->transitions[i];
+
+	if (shape->transition_count == shape->transition_capacity) {
+		old_capacity = shape->transition_capacity;
+		shape->transition_capacity = GROW_CAPACITY(old_capacity);
+		shape->transitions = GROW_ARRAY(vm, MEMORY_SHAPE,
+						struct shape *,
+						shape->transitions,
+						old_capacity,
+						shape->transition_capacity);
+	}
+	child = new_shape(vm, shape, name);
+	shape->transitions[shape->transition_count++] = child;
+	return child;
+}
@@ -0,0 +1,32 @@
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "common.h"
+
+struct object_string;
+struct vm;
+
+/*
+ * A shape is the field layout shared by all instances that got the same
+ * fields in the same order. It extends the layout of @parent by @name at
+ * slot @field_count - 1, the root shape of a class has no fields. Adding a
+ * field moves an instance to a child shape in @transitions, which is
+ * created by the first instance and shared by all that follow.
+ */
+struct shape {
+	struct shape *parent;
+	struct object_string *name;
+	int32_t field_count;
+	struct shape **transitions;
+	int32_t transition_count;
+	int32_t transition_capacity;
+};
+
+struct shape *new_shape(struct vm *vm, struct shape *parent,
+			struct object_string *name);
+void free_shape(struct vm *vm, struct shape *shape);
+int32_t shape_find(struct shape *shape, struct object_string *name);
+struct shape *shape_add(struct vm *vm, struct shape *shape,
+			struct object_string *name);
+
+#endif
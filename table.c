@@ -1,6 +1,7 @@
 #include <string.h>
 
 #include "memory.h"
+#include "object.h"
 #include "table.h"
 
 void init_table(struct table *table)
@@ -10,16 +11,20 @@ void init_table(struct table *table)
 	table->entries = NULL;
 }
 
-void free_table(struct table *table)
+void free_table(struct vm *vm, struct table *table)
 {
-	FREE_ARRAY(struct entry, table->entries, table->capacity);
+	FREE_ARRAY(vm, MEMORY_TABLE, struct entry, table->entries,
+		   table->capacity);
 	init_table(table);
 }
 
-static void adjust_capacity(struct table *table, int32_t capacity)
+static void adjust_capacity(struct vm *vm, struct table *table,
+			    int32_t capacity)
 {
 	int32_t i;
-	struct entry *entries = ALLOCATE(struct entry, capacity), *entry, *old;
+	struct entry *entries =
+		ALLOCATE(vm, MEMORY_TABLE, struct entry, capacity);
+	struct entry *entry, *old;
 
 	for (i = 0; i < capacity; i++) {
 		entry = entries + i;
@@ -38,7 +43,8 @@ static void adjust_capacity(struct table *table, int32_t capacity)
 		table->count++;
 	}
 
-	FREE_ARRAY(struct entry, table->entries, table->capacity);
+	FREE_ARRAY(vm, MEMORY_TABLE, struct entry, table->entries,
+		   table->capacity);
 	table->entries = entries;
 	table->capacity = capacity;
 }
@@ -63,14 +69,15 @@ struct entry *find_entry(struct entry *entries, int32_t capacity,
 	}
 }
 
-bool table_set(struct table *table, struct object_string *key, value_t value)
+bool table_set(struct vm *vm, struct table *table, struct object_string *key,
+	       value_t value)
 {
 	struct entry *bucket;
 	bool new_key;
 
 	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
 		int32_t capacity = GROW_CAPACITY(table->capacity);
-		adjust_capacity(table, capacity);
+		adjust_capacity(vm, table, capacity);
 	}
 
 	bucket = find_entry(table->entries, table->capacity, key);
@@ -99,16 +106,16 @@ bool table_get(struct table *table, struct object_string *key, value_t *value)
 	return true;
 }
 
-void table_add_all(struct table *dest, struct table *src)
+void table_add_all(struct vm *vm, struct table *dest, struct table *src)
 {
 	int32_t i;
 	struct entry *entry;
 
 	for (i = 0; i < src->capacity; i++) {
 		entry = &src->entries[i];
-		if (entry == NULL)
+		if (entry->key == NULL)
 			continue;
-		table_set(dest, entry->key, entry->value);
+		table_set(vm, dest, entry->key, entry->value);
 	}
 }
 
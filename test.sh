@@ -92,6 +92,37 @@ for category_dir in "$TEST_ROOT_DIR"/*; do
     fi
 done
 
+# Cases running the interpreter with options, their combined output is
+# compared to test/<name>.exp
+run_case() {
+    local name="$1"
+    shift
+    local expected_file="$TEST_ROOT_DIR/${name}.exp"
+    local actual_output_file="$RESULT_DIR/${name}.out"
+
+    "$INTERPRETER" "$@" > "$actual_output_file" 2>&1
+    if diff -q "$actual_output_file" "$expected_file" > /dev/null; then
+        echo "  ✅ PASS: $name"
+        ((total_tests_passed++))
+        rm "$actual_output_file"
+    else
+        diff_file="$RESULT_DIR/${name}.diff"
+        diff -u "$expected_file" "$actual_output_file" > "$diff_file"
+        echo "  ❌ FAIL: $name"
+        echo " - Diff saved to '$diff_file'."
+    fi
+    ((total_tests_run++))
+}
+
+echo "========================================"
+echo "Testing options"
+# Output stays in the order of the scripts, each script's buffered output
+# comes before its errors
+run_case jobs --jobs=2 "$TEST_ROOT_DIR"/jobs/*.lox
+# Every line is flushed before a later error is written
+run_case flush-lines --flush-lines=1 "$TEST_ROOT_DIR"/jobs/b-error.lox
+echo ""
+
 # Print final summary
 echo "========================================"
 echo "FINAL TEST SUMMARY"
@@ -0,0 +1,112 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Generates keywords.h from keywords.def: a perfect hash table of the
+ * keywords indexed by a hash of their length, first and last character.
+ * The generator searches the smallest table and the smallest multipliers
+ * for which no two keywords collide, so the scanner needs one table lookup
+ * and one compare to classify an identifier.
+ */
+
+struct keyword {
+	const char *text;
+	const char *token_type;
+};
+
+static const struct keyword keywords[] = {
+#define KEYWORD(text, token_type) { text, #token_type },
+#include "keywords.def"
+#undef KEYWORD
+};
+
+#define KEYWORD_COUNT ((int)(sizeof(keywords) / sizeof(keywords[0])))
+#define MAX_MULTIPLIER 64
+#define MAX_TABLE_SIZE (KEYWORD_COUNT * 8)
+
+struct perfect_hash {
+	unsigned length;
+	unsigned first;
+	unsigned last;
+	unsigned size;
+};
+
+static unsigned hash(const struct perfect_hash *h, const char *text)
+{
+	unsigned length = (unsigned)strlen(text);
+
+	return (length * h->length + (unsigned char)text[0] * h->first +
+		(unsigned char)text[length - 1] * h->last) % h->size;
+}
+
+static bool is_perfect(const struct perfect_hash *h)
+{
+	bool used[MAX_TABLE_SIZE] = { false };
+	unsigned slot;
+	int i;
+
+	for (i = 0; i < KEYWORD_COUNT; i++) {
+		slot = hash(h, keywords[i].text);
+		if (used[slot])
+			return false;
+		used[slot] = true;
+	}
+	return true;
+}
+
+/**
+ * find_hash() - Search the parameters of a perfect hash for the keywords.
+ *
+ * Table sizes are tried from KEYWORD_COUNT up, so the first hash found is
+ * minimal if one exists for this family of functions.
+ *
+ * Return: false if there is none with a table of up to MAX_TABLE_SIZE.
+ */
+static bool find_hash(struct perfect_hash *h)
+{
+	for (h->size = KEYWORD_COUNT; h->size <= MAX_TABLE_SIZE; h->size++)
+		for (h->first = 1; h->first < MAX_MULTIPLIER; h->first++)
+			for (h->last = 0; h->last < MAX_MULTIPLIER; h->last++)
+				for (h->length = 0;
+				     h->length < MAX_MULTIPLIER; h->length++)
+					if (is_perfect(h))
+						return true;
+	return false;
+}
+
+int main(void)
+{
+	struct perfect_hash h;
+	size_t length, max_length = 0;
+	int i;
+
+	if (!find_hash(&h)) {
+		fprintf(stderr, "gen_keywords: no perfect hash found, raise "
+				"MAX_MULTIPLIER or MAX_TABLE_SIZE\n");
+		return 1;
+	}
+	for (i = 0; i < KEYWORD_COUNT; i++) {
+		length = strlen(keywords[i].text);
+		if (length > max_length)
+			max_length = length;
+	}
+
+	printf("/* Generated by tools/gen_keywords from keywords.def. */\n\n");
+	printf("#define KEYWORD_MAX_LENGTH %zu\n", max_length);
+	printf("#define KEYWORD_TABLE_SIZE %u\n", h.size);
+	printf("#define KEYWORD_HASH(length, first, last) \\\n"
+	       "\t(((uint32_t)(length) * %uu + \\\n"
+	       "\t  (uint32_t)(unsigned char)(first) * %uu + \\\n"
+	       "\t  (uint32_t)(unsigned char)(last) * %uu) %% "
+	       "KEYWORD_TABLE_SIZE)\n\n",
+	       h.length, h.first, h.last);
+	printf("static const struct keyword keywords[KEYWORD_TABLE_SIZE] = "
+	       "{\n");
+	for (i = 0; i < KEYWORD_COUNT; i++)
+		printf("\t[%u] = { \"%s\", %zu, %s },\n",
+		       hash(&h, keywords[i].text), keywords[i].text,
+		       strlen(keywords[i].text), keywords[i].token_type);
+	printf("};\n");
+	return 0;
+}
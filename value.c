@@ -1,4 +1,6 @@
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "value.h"
 #include "object.h"
@@ -18,14 +20,16 @@ void init_value_array(struct value_array *value_array)
  * NOTE: The @value_array must be properly initialized before calling this
  * function.
  */
-void write_value_array(struct value_array *value_array, value_t value)
+void write_value_array(struct vm *vm, struct value_array *value_array,
+		       value_t value)
 {
 	int32_t old_capacity;
 
 	if (value_array->capacity < value_array->length + 1) {
 		old_capacity = value_array->capacity;
 		value_array->capacity = GROW_CAPACITY(old_capacity);
-		value_array->values = GROW_ARRAY(value_t, value_array->values,
+		value_array->values = GROW_ARRAY(vm, MEMORY_CONSTANTS, value_t,
+						 value_array->values,
 						 old_capacity,
 						 value_array->capacity);
 	}
@@ -34,26 +38,198 @@ void write_value_array(struct value_array *value_array, value_t value)
 	value_array->length++;
 }
 
-void free_value_array(struct value_array *value_array)
+void free_value_array(struct vm *vm, struct value_array *value_array)
 {
-	FREE_ARRAY(value_t, value_array->values, value_array->capacity);
+	FREE_ARRAY(vm, MEMORY_CONSTANTS, value_t, value_array->values,
+		   value_array->capacity);
 	init_value_array(value_array);
 }
 
+static const double powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+};
+
+static const double thresholds[] = { 1e-4, 1e-3, 1e-2, 1e-1, 1e0,
+				     1e1,  1e2,	 1e3,  1e4,  1e5 };
+
+static int32_t format_integer(uint32_t integer, char *buffer)
+{
+	char digits[10];
+	int32_t length = 0, i;
+
+	do {
+		digits[length++] = (char)('0' + integer % 10);
+		integer /= 10;
+	} while (integer > 0);
+	for (i = 0; i < length; i++)
+		buffer[i] = digits[length - 1 - i];
+	return length;
+}
+
+/**
+ * format_number() - Format @number into @buffer exactly like "%g" does.
+ * @buffer: At least NUMBER_BUFFER_SIZE bytes, not NUL terminated.
+ *
+ * Integers and numbers printed without exponent are built from their six
+ * significant digits directly. Everything else, including numbers whose
+ * rounding can't be decided reliably in double precision, is left to
+ * snprintf().
+ *
+ * Return: The number of characters written.
+ */
+int32_t format_number(double number, char *buffer)
+{
+	double magnitude = number < 0 ? -number : number, scaled, fraction;
+	uint32_t significand;
+	char digits[6];
+	int32_t length = 0, exponent, integer_digits, last, i;
+
+	if (magnitude < 1e6 && magnitude == (uint32_t)magnitude) {
+		if (signbit(number))
+			buffer[length++] = '-';
+		return length + format_integer((uint32_t)magnitude,
+					       buffer + length);
+	}
+	if (!(magnitude >= thresholds[0] && magnitude < 1e6))
+		goto fallback;
+
+	for (exponent = 5; magnitude < thresholds[exponent + 4]; exponent--)
+		;
+	scaled = magnitude * powers_of_ten[5 - exponent];
+	fraction = scaled - (uint32_t)scaled;
+	if (scaled < 99999.5 || scaled >= 999999.5 ||
+	    (fraction > 0.5 - 1e-6 && fraction < 0.5 + 1e-6))
+		goto fallback;
+
+	significand = (uint32_t)(scaled + 0.5);
+	for (i = 5; i >= 0; i--) {
+		digits[i] = (char)('0' + significand % 10);
+		significand /= 10;
+	}
+	integer_digits = exponent >= 0 ? exponent + 1 : 0;
+	for (last = 5; last >= integer_digits && digits[last] == '0'; last--)
+		;
+
+	if (signbit(number))
+		buffer[length++] = '-';
+	if (exponent < 0) {
+		buffer[length++] = '0';
+		buffer[length++] = '.';
+		for (i = exponent + 1; i < 0; i++)
+			buffer[length++] = '0';
+	}
+	for (i = 0; i <= last; i++) {
+		if (i == integer_digits && exponent >= 0)
+			buffer[length++] = '.';
+		buffer[length++] = digits[i];
+	}
+	return length;
+
+fallback:
+	return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+}
+
+// Largest integer up to which every integer is exactly a double
+#define EXACT_INTEGER_MAX (1ULL << 53)
+// Digits that surely fit into an uint64_t
+#define MAX_DIGITS 19
+
+static const double exact_powers_of_ten[] = {
+	1e0,  1e1,  1e2,  1e3,	1e4,  1e5,  1e6,  1e7,	1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/**
+ * parse_slow() - Convert a literal with strtod().
+ *
+ * strtod() would also accept exponents and hexadecimal digits following
+ * the literal, so it only gets to see a terminated copy.
+ */
+static double parse_slow(const char *start, int32_t length)
+{
+	char buffer[64], *copy = buffer;
+	double result;
+
+	if (length >= (int32_t)sizeof(buffer)) {
+		copy = malloc(length + 1);
+		if (copy == NULL)
+			exit(1);
+	}
+	memcpy(copy, start, length);
+	copy[length] = '\0';
+	result = strtod(copy, NULL);
+	if (copy != buffer)
+		free(copy);
+	return result;
+}
+
+/**
+ * parse_number() - Convert a number literal to the nearest double.
+ * @start: The literal, digits with an optional fraction, as scanned.
+ * @length: Length of the literal, @start doesn't need to be terminated.
+ *
+ * When the digits form an integer of at most 53 bits and the fraction has
+ * at most 22 digits, both the integer and the power of ten are exact
+ * doubles and a single division rounds correctly. Other literals are left
+ * to parse_slow().
+ */
+double parse_number(const char *start, int32_t length)
+{
+	const char *end = start + length, *c;
+	uint64_t significand = 0;
+	int32_t digits = 0, fraction_digits = 0;
+	bool fraction = false;
+
+	// Trailing zeros of the fraction don't change the value
+	if (memchr(start, '.', length) != NULL) {
+		while (end[-1] == '0')
+			end--;
+		if (end[-1] == '.')
+			end--;
+	}
+
+	for (c = start; c < end; c++) {
+		if (*c == '.') {
+			fraction = true;
+			continue;
+		}
+		if (significand == 0 && *c == '0') {
+			fraction_digits += fraction;
+			continue;
+		}
+		if (++digits > MAX_DIGITS)
+			return parse_slow(start, length);
+		significand = significand * 10 + (uint64_t)(*c - '0');
+		fraction_digits += fraction;
+	}
+
+	if (significand > EXACT_INTEGER_MAX || fraction_digits > 22)
+		return parse_slow(start, length);
+	return (double)significand / exact_powers_of_ten[fraction_digits];
+}
+
 void print_value(value_t value)
+{
+	fprint_value(stdout, value);
+}
+
+void fprint_value(FILE *out, value_t value)
 {
 	switch (value.value_type) {
 	case VALUE_NUMBER:
-		printf("%g", AS_NUMBER(value));
+	case VALUE_INTEGER: {
+		char buffer[NUMBER_BUFFER_SIZE];
+		fwrite(buffer, 1, format_number(AS_NUMBER(value), buffer), out);
 		break;
+	}
 	case VALUE_BOOLEAN:
-		printf(AS_BOOLEAN(value) ? "true" : "false");
+		fprintf(out, AS_BOOLEAN(value) ? "true" : "false");
 		break;
 	case VALUE_NIL:
-		printf("nil");
+		fprintf(out, "nil");
 		break;
 	case VALUE_OBJECT:
-		print_object(value);
+		print_object(out, value);
 		break;
 	}
 }
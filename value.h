@@ -1,10 +1,13 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+
 #include "common.h"
 
 enum value_type {
 	VALUE_NUMBER,
+	VALUE_INTEGER,
 	VALUE_BOOLEAN,
 	VALUE_NIL,
 	VALUE_OBJECT,
@@ -15,36 +18,64 @@ struct value {
 	union {
 		bool boolean;
 		double number;
+		int64_t integer;
 		struct object *object;
 	} as;
 };
 
 #define CONS_NUMBER(val) ((struct value){ VALUE_NUMBER, { .number = val } })
+#define CONS_INTEGER(val) \
+	((struct value){ VALUE_INTEGER, { .integer = val } })
 #define CONS_BOOLEAN(val) ((struct value){ VALUE_BOOLEAN, { .boolean = val } })
 #define CONS_NIL ((struct value){ VALUE_NIL, { .number = 0 } })
 #define CONS_OBJECT(val) ((struct value){ VALUE_OBJECT, { .object = val } })
 
-#define AS_NUMBER(value) ((value).as.number)
+/*
+ * Integers are numbers that are known to be integral, they only exist to
+ * give arithmetic on them a fast path. They are kept to INTEGER_BITS bits,
+ * where every integer is exactly a double, so converting one never rounds
+ * and a program can't tell them from the double with the same value.
+ */
+#define INTEGER_BITS 54
+#define INTEGER_MIN (-((int64_t)1 << (INTEGER_BITS - 1)))
+#define INTEGER_MAX (((int64_t)1 << (INTEGER_BITS - 1)) - 1)
+
+#define AS_NUMBER(value)                                  \
+	((value).value_type == VALUE_INTEGER ?            \
+		 (double)(value).as.integer :             \
+		 (value).as.number)
+#define AS_INTEGER(value) ((value).as.integer)
 #define AS_BOOLEAN(value) ((value).as.boolean)
 #define AS_OBJECT(value) ((value).as.object)
 
-#define IS_NUMBER(value) ((value).value_type == VALUE_NUMBER)
+// Both kinds of numbers come first in enum value_type
+#define IS_NUMBER(value) ((value).value_type <= VALUE_INTEGER)
+#define IS_INTEGER(value) ((value).value_type == VALUE_INTEGER)
 #define IS_BOOLEAN(value) ((value).value_type == VALUE_BOOLEAN)
 #define IS_NIL(value) ((value).value_type == VALUE_NIL)
 #define IS_OBJECT(value) ((value).value_type == VALUE_OBJECT)
 
 typedef struct value value_t;
 
+// Enough for every number formatted by format_number()
+#define NUMBER_BUFFER_SIZE 32
+
 struct value_array {
 	int32_t length;
 	int32_t capacity;
 	value_t *values;
 };
 
+struct vm;
+
 void init_value_array(struct value_array *value_array);
-void write_value_array(struct value_array *value_array, value_t value);
-void free_value_array(struct value_array *value_array);
+void write_value_array(struct vm *vm, struct value_array *value_array,
+		       value_t value);
+void free_value_array(struct vm *vm, struct value_array *value_array);
 
+int32_t format_number(double number, char *buffer);
+double parse_number(const char *start, int32_t length);
 void print_value(value_t value);
+void fprint_value(FILE *out, value_t value);
 
 #endif
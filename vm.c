@@ -4,85 +4,503 @@
 #include <time.h>
 
 #include "common.h"
+#include "channel.h"
 #include "compiler.h"
 #include "chunk.h"
 #include "debug.h"
+#include "kernels.h"
 #include "memory.h"
 #include "object.h"
+#include "profile.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-struct vm vm;
-
-static void define_native_fn(const char *name, native_fn function)
+/**
+ * define_native_fn() - Bind @function to the global @name.
+ *
+ * NOTE: Must only be called while the stack is empty.
+ */
+void define_native_fn(struct vm *vm, const char *name, native_fn function)
 {
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wincompatible-pointer-types"
-	push(CONS_OBJECT(copy_string(name, (int32_t)strlen(name))));
-	push(CONS_OBJECT(new_native_fn(function)));
+	push(vm, CONS_OBJECT(copy_string(vm, name, (int32_t)strlen(name))));
+	push(vm, CONS_OBJECT(new_native_fn(vm, function)));
 #pragma clang diagnostic pop
-	table_set(&vm.globals, AS_OBJ_STRING(vm.stack[0]), vm.stack[1]);
-	pop();
-	pop();
+	table_set(vm, &vm->globals, AS_OBJ_STRING(vm->stack[0]), vm->stack[1]);
+	pop(vm);
+	pop(vm);
 }
 
-static value_t clock_native(int arg_count, value_t *args)
+static value_t clock_native(struct vm *vm, int arg_count, value_t *args)
 {
 	return CONS_NUMBER((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void reset_stack(void)
+/**
+ * memstats_native() - Query the memory statistics of the VM.
+ *
+ * Without arguments the number of live bytes is returned. With a string
+ * argument, the live bytes of the category with that name ("code",
+ * "constants", "lines", "tables", "strings", "functions", "natives",
+ * "closures", "upvalues", "channels", "coroutines", "loop", "arrays",
+ * "maps", "classes" or "shapes"), the overall "peak" or the number of
+ * "allocations" and "frees" done so far is returned. Unknown names yield
+ * nil.
+ */
+static value_t memstats_native(struct vm *vm, int arg_count, value_t *args)
+{
+	const char *name;
+	int32_t category;
+
+	if (arg_count == 0)
+		return CONS_NUMBER((double)vm->memory.total_live);
+	if (arg_count != 1 || !IS_STRING(args[0]))
+		return CONS_NIL;
+
+	name = AS_CSTRING(args[0]);
+	if (strcmp(name, "peak") == 0)
+		return CONS_NUMBER((double)vm->memory.total_peak);
+	if (strcmp(name, "allocations") == 0)
+		return CONS_NUMBER((double)vm->memory.allocations);
+	if (strcmp(name, "frees") == 0)
+		return CONS_NUMBER((double)vm->memory.frees);
+
+	category = find_memory_category(name);
+	if (category == -1)
+		return CONS_NIL;
+	return CONS_NUMBER((double)vm->memory.live[category]);
+}
+
+/*
+ * Set as error of a native whose callback failed, the error was reported
+ * when it occurred.
+ */
+static const char error_reported[] = "";
+
+/**
+ * native_error() - Make the native function being called fail.
+ * @message: Reported as runtime error once the native returns, must
+ * outlive the call.
+ *
+ * Return: A placeholder for the native to return.
+ */
+value_t native_error(struct vm *vm, const char *message)
+{
+	vm->error = message;
+	return CONS_NIL;
+}
+
+/**
+ * channel_native() - Open the channel named by the first argument.
+ *
+ * The optional second argument is the number of messages the channel
+ * buffers before send() blocks. Without it the channel is unbounded. The
+ * capacity is fixed by whichever isolate opens the channel first.
+ */
+static value_t channel_native(struct vm *vm, int arg_count, value_t *args)
+{
+	double capacity = CHANNEL_UNBOUNDED;
+	struct object_string *name;
+
+	if (arg_count < 1 || arg_count > 2 || !IS_STRING(args[0]))
+		return native_error(vm, "channel() expects a name and an "
+					"optional capacity.");
+	if (arg_count == 2) {
+		if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1 ||
+		    AS_NUMBER(args[1]) > INT32_MAX ||
+		    AS_NUMBER(args[1]) != (int32_t)AS_NUMBER(args[1]))
+			return native_error(vm, "Channel capacity must be a "
+						"positive integer.");
+		capacity = AS_NUMBER(args[1]);
+	}
+
+	name = AS_OBJ_STRING(args[0]);
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	return CONS_OBJECT(new_channel(
+		vm, open_channel(name->characters, name->length,
+				 (int32_t)capacity)));
+#pragma clang diagnostic pop
+}
+
+/**
+ * send_native() - Send the second argument over the channel given first.
+ *
+ * Only numbers, booleans, nil and strings can be sent since isolates don't
+ * share heaps. Blocks while a bounded channel is full.
+ */
+static value_t send_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct message message;
+
+	if (arg_count != 2 || !IS_CHANNEL(args[0]))
+		return native_error(vm, "send() expects a channel and a "
+					"value.");
+	if (!pack_message(args[1], &message))
+		return native_error(vm, "Only numbers, booleans, nil and "
+					"strings can be sent.");
+	if (!channel_send(AS_OBJ_CHANNEL(args[0]), &message)) {
+		free_message(&message);
+		return native_error(vm, "Send on a closed channel.");
+	}
+	return CONS_NIL;
+}
+
+/**
+ * receive_native() - Receive the next message of a channel.
+ *
+ * Blocks while the channel is empty. Returns nil once the channel is
+ * closed and every message was received.
+ *
+ * NOTE: Blocking holds on to the worker, so a sender queued behind the
+ * receiver on the same worker never runs. Communicating scripts need a
+ * worker each, there is no deadlock detection.
+ */
+static value_t receive_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct message message;
+
+	if (arg_count != 1 || !IS_CHANNEL(args[0]))
+		return native_error(vm, "receive() expects a channel.");
+	if (!channel_receive(AS_OBJ_CHANNEL(args[0]), &message))
+		return CONS_NIL;
+	return unpack_message(vm, &message);
+}
+
+/**
+ * close_native() - Close the channel or file descriptor given as argument.
+ */
+static value_t close_native(struct vm *vm, int arg_count, value_t *args)
+{
+	if (arg_count == 1 && is_fd(args[0]))
+		return loop_close(vm, (int)AS_NUMBER(args[0]));
+	if (arg_count != 1 || !IS_CHANNEL(args[0]))
+		return native_error(vm, "close() expects a channel or a file "
+					"descriptor.");
+	close_channel(AS_OBJ_CHANNEL(args[0]));
+	return CONS_NIL;
+}
+
+/**
+ * coroutine_native() - Wrap the closure given as argument in a coroutine.
+ *
+ * Calling the coroutine the first time calls the closure with the
+ * arguments of the call. Every later call resumes it after the yield it
+ * stopped at, the argument of the call, or nil, becomes the value of that
+ * yield.
+ */
+static value_t coroutine_native(struct vm *vm, int arg_count, value_t *args)
+{
+	if (arg_count != 1 || !IS_CLOSURE(args[0]))
+		return native_error(vm, "coroutine() expects a function.");
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	return CONS_OBJECT(new_coroutine(vm, AS_OBJ_CLOSURE(args[0])));
+#pragma clang diagnostic pop
+}
+
+/**
+ * done_native() - Check whether the coroutine given as argument returned.
+ */
+static value_t done_native(struct vm *vm, int arg_count, value_t *args)
 {
-	vm.stack_top = vm.stack;
-	vm.frame_count = 0;
-	vm.open_upvalues = NULL;
+	if (arg_count != 1 || !IS_COROUTINE(args[0]))
+		return native_error(vm, "done() expects a coroutine.");
+	return CONS_BOOLEAN(AS_OBJ_COROUTINE(args[0])->fiber.state ==
+			    FIBER_DONE);
 }
 
-void init_vm(void)
+/**
+ * append_native() - Add the second argument to the end of the array given
+ * first.
+ */
+static value_t append_native(struct vm *vm, int arg_count, value_t *args)
 {
-	reset_stack();
-	vm.objects = NULL;
-	init_table(&vm.globals);
-	init_table(&vm.strings);
-	define_native_fn("clock", clock_native);
+	if (arg_count != 2 || !IS_ARRAY(args[0]))
+		return native_error(vm, "append() expects an array and a "
+					"value.");
+	array_append(vm, AS_OBJ_ARRAY(args[0]), args[1]);
+	return CONS_NIL;
 }
 
-void free_vm(void)
+/**
+ * len_native() - Number of elements of an array, keys of a map or
+ * characters of a string.
+ */
+static value_t len_native(struct vm *vm, int arg_count, value_t *args)
 {
-	free_objects();
-	free_table(&vm.strings);
+	if (arg_count == 1 && IS_ARRAY(args[0]))
+		return CONS_INTEGER(AS_OBJ_ARRAY(args[0])->values.length);
+	if (arg_count == 1 && IS_FLOAT64_ARRAY(args[0]))
+		return CONS_INTEGER(AS_OBJ_FLOAT64_ARRAY(args[0])->length);
+	if (arg_count == 1 && IS_MAP(args[0]))
+		return CONS_INTEGER(AS_OBJ_MAP(args[0])->map.count);
+	if (arg_count == 1 && IS_STRING(args[0]))
+		return CONS_INTEGER(AS_OBJ_STRING(args[0])->length);
+	return native_error(vm, "len() expects an array, a map or a string.");
+}
+
+static value_t map_native(struct vm *vm, int arg_count, value_t *args)
+{
+	if (arg_count != 0)
+		return native_error(vm, "map() expects no arguments.");
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	return CONS_OBJECT(new_map(vm));
+#pragma clang diagnostic pop
 }
 
-static value_t peek(int32_t distance)
+/**
+ * has_native() - Check whether the map given first has the second argument
+ * as key.
+ */
+static value_t has_native(struct vm *vm, int arg_count, value_t *args)
 {
-	return vm.stack_top[-1 - distance];
+	value_t value;
+
+	if (arg_count != 2 || !IS_MAP(args[0]))
+		return native_error(vm, "has() expects a map and a key.");
+	return CONS_BOOLEAN(map_get(&AS_OBJ_MAP(args[0])->map, args[1],
+				    &value));
 }
 
-static void runtime_error(const char *format, ...)
+/**
+ * delete_native() - Remove the second argument from the keys of the map
+ * given first.
+ *
+ * Return: Whether the key was in the map.
+ */
+static value_t delete_native(struct vm *vm, int arg_count, value_t *args)
+{
+	if (arg_count != 2 || !IS_MAP(args[0]))
+		return native_error(vm, "delete() expects a map and a key.");
+	return CONS_BOOLEAN(map_delete(&AS_OBJ_MAP(args[0])->map, args[1]));
+}
+
+/**
+ * keys_native() - The keys of a map as array, in the order they were
+ * added.
+ */
+static value_t keys_native(struct vm *vm, int arg_count, value_t *args)
+{
+	struct object_array *keys;
+	struct map *map;
+	int32_t i;
+
+	if (arg_count != 1 || !IS_MAP(args[0]))
+		return native_error(vm, "keys() expects a map.");
+	map = &AS_OBJ_MAP(args[0])->map;
+	keys = new_array(vm, map->count);
+	for (i = 0; i < map->length; i++)
+		if (!map->entries[i].deleted)
+			keys->values.values[keys->values.length++] =
+				map->entries[i].key;
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	return CONS_OBJECT(keys);
+#pragma clang diagnostic pop
+}
+
+/**
+ * switch_fiber() - Save the running fiber and load @fiber into the VM.
+ *
+ * Only pointers are exchanged, the stacks stay where they are, so values
+ * and open upvalues of a suspended fiber remain valid.
+ */
+static void switch_fiber(struct vm *vm, struct fiber *fiber)
+{
+	struct fiber *current = vm->fiber;
+
+	current->frames = vm->frames;
+	current->frame_count = vm->frame_count;
+	current->frame_max = vm->frame_max;
+	current->stack = vm->stack;
+	current->stack_top = vm->stack_top;
+	current->open_upvalues = vm->open_upvalues;
+
+	vm->frame_count = 0;
+	vm->frames = fiber->frames;
+	vm->frame_max = fiber->frame_max;
+	vm->stack = fiber->stack;
+	vm->stack_top = fiber->stack_top;
+	vm->open_upvalues = fiber->open_upvalues;
+	vm->frame_count = fiber->frame_count;
+	vm->fiber = fiber;
+}
+
+/**
+ * reset_stack() - Return to an empty root fiber.
+ *
+ * Coroutines that were running when an error occurred can't be resumed
+ * anymore.
+ */
+static void reset_stack(struct vm *vm)
+{
+	struct fiber *fiber;
+
+	for (fiber = vm->fiber; fiber != NULL && fiber != &vm->root;
+	     fiber = fiber->caller)
+		fiber->state = FIBER_DONE;
+	vm->fiber = &vm->root;
+	vm->root.caller = NULL;
+	vm->root.state = FIBER_RUNNING;
+	vm->frames = vm->root_frames;
+	vm->frame_max = FRAME_MAX;
+	vm->stack = vm->root_stack;
+	vm->stack_top = vm->stack;
+	vm->frame_count = 0;
+	vm->open_upvalues = NULL;
+}
+
+void init_vm(struct vm *vm)
+{
+	init_memory_stats(&vm->memory);
+	vm->fiber = NULL;
+	vm->root.native_calls = 0;
+	reset_stack(vm);
+	vm->objects = NULL;
+	vm->lambda_count = 0;
+	init_output(&vm->out, stdout);
+#ifdef DEBUG_TRACE_EXECUTION
+	// Keep printed lines next to the trace of their instructions
+	vm->out.flush_lines = 1;
+#endif
+	vm->err = stderr;
+	vm->error = NULL;
+	init_table(&vm->globals);
+	init_table(&vm->constants);
+	init_table(&vm->strings);
+	vm->init_string = copy_string(vm, "init", 4);
+	define_native_fn(vm, "clock", clock_native);
+	define_native_fn(vm, "memstats", memstats_native);
+	define_native_fn(vm, "channel", channel_native);
+	define_native_fn(vm, "send", send_native);
+	define_native_fn(vm, "receive", receive_native);
+	define_native_fn(vm, "close", close_native);
+	define_native_fn(vm, "coroutine", coroutine_native);
+	define_native_fn(vm, "done", done_native);
+	define_native_fn(vm, "append", append_native);
+	define_native_fn(vm, "len", len_native);
+	define_native_fn(vm, "map", map_native);
+	define_native_fn(vm, "has", has_native);
+	define_native_fn(vm, "delete", delete_native);
+	define_native_fn(vm, "keys", keys_native);
+	init_loop(&vm->loop);
+	define_loop_natives(vm);
+	define_kernel_natives(vm);
+#ifdef PROFILE_EXECUTION
+	init_profile(vm);
+#endif
+	init_table(&vm->natives);
+	table_add_all(vm, &vm->natives, &vm->globals);
+	vm->native_objects = vm->objects;
+	vm->native_memory = vm->memory;
+}
+
+/**
+ * reset_vm() - Prepare @vm for running another script.
+ *
+ * Everything the scripts run so far left behind is freed: their objects,
+ * interned strings, globals, constants and watches. The natives defined by
+ * init_vm() are kept, so the VM behaves as if it was freed and initialized
+ * again without defining them anew.
+ */
+void reset_vm(struct vm *vm)
+{
+	struct object *object;
+
+#ifdef PROFILE_EXECUTION
+	profile_report(vm);
+	init_profile(vm);
+#endif
+	flush_output(&vm->out);
+	free_loop(vm, &vm->loop);
+	reset_stack(vm);
+	vm->root.native_calls = 0;
+
+	// Intern the kept strings anew rather than leave tombstones behind
+	free_table(vm, &vm->strings);
+	free_objects_until(vm, vm->native_objects);
+	for (object = vm->objects; object != NULL; object = object->next)
+		if (object->object_type == OBJECT_STRING)
+			table_set(vm, &vm->strings,
+				  (struct object_string *)object, CONS_NIL);
+
+	free_table(vm, &vm->globals);
+	table_add_all(vm, &vm->globals, &vm->natives);
+	free_table(vm, &vm->constants);
+	vm->lambda_count = 0;
+	vm->error = NULL;
+	restart_memory_stats(&vm->memory, &vm->native_memory);
+}
+
+void free_vm(struct vm *vm)
+{
+#ifdef PROFILE_EXECUTION
+	profile_report(vm);
+#endif
+	flush_output(&vm->out);
+	free_loop(vm, &vm->loop);
+	free_objects(vm);
+	free_table(vm, &vm->globals);
+	free_table(vm, &vm->constants);
+	free_table(vm, &vm->strings);
+	free_table(vm, &vm->natives);
+}
+
+static value_t peek(struct vm *vm, int32_t distance)
+{
+	return vm->stack_top[-1 - distance];
+}
+
+static void runtime_error(struct vm *vm, const char *format, ...)
 {
 	int32_t instruction, i;
 	struct call_frame *frame;
 	struct object_function *function;
 	va_list args;
 
+	flush_output(&vm->out);
 	va_start(args, format);
-	vfprintf(stderr, format, args);
+	vfprintf(vm->err, format, args);
 	va_end(args);
-	fprintf(stderr, "\n");
+	fprintf(vm->err, "\n");
 
-	for (i = vm.frame_count - 1; i >= 0; i--) {
-		frame = &vm.frames[i];
+	for (i = vm->frame_count - 1; i >= 0; i--) {
+		frame = &vm->frames[i];
 		function = frame->closure->function;
 		instruction = frame->ip - function->chunk.code - 1;
-		fprintf(stderr, "[line %d] in ",
+		fprintf(vm->err, "[line %d] in ",
 			read_line(&function->chunk.lines, instruction));
 		if (function->name == NULL)
-			fprintf(stderr, "script\n");
+			fprintf(vm->err, "script\n");
 		else
-			fprintf(stderr, "%s()\n", function->name->characters);
+			fprintf(vm->err, "%s()\n", function->name->characters);
 	}
-	reset_stack();
+	reset_stack(vm);
+}
+
+/**
+ * integer_result() - Box the result of integer arithmetic.
+ *
+ * Sums and differences of integers can't overflow an int64_t, but they may
+ * leave the INTEGER_BITS bits in which integers are exact doubles, such
+ * results become doubles. Rounding the exact result once gives the same
+ * double that adding the operands as doubles would have.
+ *
+ * NOTE: The range is checked by sign extending the low INTEGER_BITS bits,
+ * which is cheaper than comparing against both bounds.
+ */
+static inline value_t integer_result(int64_t result)
+{
+	int64_t extended = (int64_t)((uint64_t)result << (64 - INTEGER_BITS)) >>
+			   (64 - INTEGER_BITS);
+
+	if (likely(extended == result))
+		return CONS_INTEGER(result);
+	return CONS_NUMBER((double)result);
 }
 
 static bool is_false(value_t value)
@@ -92,11 +510,14 @@ static bool is_false(value_t value)
 
 static bool is_equal(value_t a, value_t b)
 {
+	if (IS_NUMBER(a) && IS_NUMBER(b))
+		return AS_NUMBER(a) == AS_NUMBER(b);
 	if (a.value_type != b.value_type)
 		return false;
 
 	switch (a.value_type) {
 	case VALUE_NUMBER:
+	case VALUE_INTEGER:
 		return AS_NUMBER(a) == AS_NUMBER(b);
 	case VALUE_BOOLEAN:
 		return AS_BOOLEAN(a) == AS_BOOLEAN(b);
@@ -109,72 +530,394 @@ static bool is_equal(value_t a, value_t b)
 	}
 }
 
-static void concatenate(void)
+/**
+ * array_index() - Check that @index is a valid index of an array of
+ * @length elements.
+ * @result: Receives the index as integer.
+ *
+ * Return: false if a runtime error was reported.
+ */
+static bool array_index(struct vm *vm, int32_t length, value_t index,
+			int32_t *result)
+{
+	double number;
+
+	if (IS_INTEGER(index)) {
+		if (AS_INTEGER(index) < 0 || AS_INTEGER(index) >= length) {
+			runtime_error(vm, "Array index out of bounds.");
+			return false;
+		}
+		*result = (int32_t)AS_INTEGER(index);
+		return true;
+	}
+	if (!IS_NUMBER(index)) {
+		runtime_error(vm, "Array index must be a number.");
+		return false;
+	}
+	number = AS_NUMBER(index);
+	if (!(number >= 0 && number < length)) {
+		runtime_error(vm, "Array index out of bounds.");
+		return false;
+	}
+	*result = (int32_t)number;
+	if (*result != number) {
+		runtime_error(vm, "Array index must be an integer.");
+		return false;
+	}
+	return true;
+}
+
+static void concatenate(struct vm *vm)
 {
 	struct object_string *a, *b, *result;
 	int32_t length;
 	char *buffer;
 
-	b = AS_OBJ_STRING(pop());
-	a = AS_OBJ_STRING(pop());
+	b = AS_OBJ_STRING(pop(vm));
+	a = AS_OBJ_STRING(pop(vm));
 	length = a->length + b->length;
-	buffer = ALLOCATE(char, length + 1);
+	buffer = ALLOCATE(vm, MEMORY_STRING, char, length + 1);
 	memcpy(buffer, a->characters, a->length);
 	memcpy(buffer + a->length, b->characters, b->length);
 	buffer[length] = '\0';
 
-	result = take_string(buffer, length);
+	result = take_string(vm, buffer, length);
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wincompatible-pointer-types"
-	push(CONS_OBJECT(result));
+	push(vm, CONS_OBJECT(result));
 #pragma clang diagnostic pop
 }
 
-static bool call(struct object_closure *closure, int32_t arg_count)
+/**
+ * push_frame() - Enter @closure, whose arity was checked already.
+ */
+static inline bool push_frame(struct vm *vm, struct object_closure *closure,
+			      int32_t arg_count)
 {
 	struct call_frame *frame;
 
+	if (vm->frame_count == vm->frame_max) {
+		runtime_error(vm, "Stack overflow.");
+		return false;
+	}
+	frame = &vm->frames[vm->frame_count++];
+	frame->closure = closure;
+	frame->ip = closure->function->chunk.code;
+	frame->slots = vm->stack_top - arg_count - 1;
+	return true;
+}
+
+static bool call(struct vm *vm, struct object_closure *closure,
+		 int32_t arg_count)
+{
 	if (closure->function->arity != arg_count) {
-		runtime_error("Expected %d arguments, got %d.",
+		runtime_error(vm, "Expected %d arguments, got %d.",
 			      closure->function->arity, arg_count);
 		return false;
 	}
-	if (vm.frame_count == FRAME_MAX) {
-		runtime_error("Stack overflow.");
+	return push_frame(vm, closure, arg_count);
+}
+
+static inline bool call_native(struct vm *vm, native_fn native,
+			       int32_t arg_count)
+{
+	value_t result = native(vm, arg_count, vm->stack_top - arg_count);
+
+	if (vm->error != NULL) {
+		if (vm->error != error_reported)
+			runtime_error(vm, "%s", vm->error);
+		vm->error = NULL;
 		return false;
 	}
-	frame = &vm.frames[vm.frame_count++];
-	frame->closure = closure;
-	frame->ip = closure->function->chunk.code;
-	frame->slots = vm.stack_top - arg_count - 1;
+	vm->stack_top -= arg_count + 1;
+	push(vm, result);
 	return true;
 }
 
-static bool call_value(value_t value, int32_t arg_count)
+/**
+ * resume() - Continue @coroutine, called with @arg_count arguments.
+ *
+ * The callee and its arguments are moved from the stack of the caller to
+ * the one of the coroutine. When the coroutine starts, they become the
+ * frame of its closure, afterwards the only argument is the value of the
+ * yield the coroutine is suspended at.
+ */
+static bool resume(struct vm *vm, struct object_coroutine *coroutine,
+		   int32_t arg_count)
+{
+	struct fiber *fiber = &coroutine->fiber;
+	value_t *args = vm->stack_top - arg_count;
+	int32_t i;
+
+	if (fiber->state == FIBER_DONE) {
+		runtime_error(vm, "Cannot resume a finished coroutine.");
+		return false;
+	}
+	if (fiber->state == FIBER_RUNNING) {
+		runtime_error(vm, "Cannot resume a running coroutine.");
+		return false;
+	}
+	if (fiber->state == FIBER_SUSPENDED && arg_count > 1) {
+		runtime_error(vm, "Expected at most 1 argument, got %d.",
+			      arg_count);
+		return false;
+	}
+
+	vm->stack_top = args - 1;
+	fiber->caller = vm->fiber;
+	switch_fiber(vm, fiber);
+	if (fiber->state == FIBER_SUSPENDED) {
+		fiber->state = FIBER_RUNNING;
+		push(vm, arg_count == 1 ? args[0] : CONS_NIL);
+		return true;
+	}
+
+	fiber->state = FIBER_RUNNING;
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	push(vm, CONS_OBJECT(coroutine->closure));
+#pragma clang diagnostic pop
+	for (i = 0; i < arg_count; i++)
+		push(vm, args[i]);
+	return call(vm, coroutine->closure, arg_count);
+}
+
+/**
+ * leave_fiber() - Suspend or finish the running coroutine.
+ * @result: Value the call that resumed the coroutine evaluates to.
+ */
+static void leave_fiber(struct vm *vm, value_t result, enum fiber_state state)
+{
+	struct fiber *fiber = vm->fiber;
+
+	switch_fiber(vm, fiber->caller);
+	fiber->caller = NULL;
+	fiber->state = state;
+	if (state == FIBER_DONE)
+		free_fiber_stack(vm, fiber);
+	push(vm, result);
+}
+
+static bool call_value(struct vm *vm, value_t value, int32_t arg_count)
 {
 	if (IS_OBJECT(value)) {
 		switch (OBJECT_TYPE(value)) {
 		case OBJECT_CLOSURE:
-			return call(AS_OBJ_CLOSURE(value), arg_count);
-		case OBJECT_NATIVE_FN: {
-			native_fn native = AS_OBJ_NATIVE_FN(value);
-			value_t result =
-				native(arg_count, vm.stack_top - arg_count);
-			vm.stack_top -= arg_count + 1;
-			push(result);
+			return call(vm, AS_OBJ_CLOSURE(value), arg_count);
+		case OBJECT_COROUTINE:
+			return resume(vm, AS_OBJ_COROUTINE(value), arg_count);
+		case OBJECT_CLASS: {
+			struct object_class *klass = AS_OBJ_CLASS(value);
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+			vm->stack_top[-arg_count - 1] =
+				CONS_OBJECT(new_instance(vm, klass));
+#pragma clang diagnostic pop
+			if (klass->initializer != NULL)
+				return call(vm, klass->initializer, arg_count);
+			if (arg_count != 0) {
+				runtime_error(vm,
+					      "Expected 0 arguments, got %d.",
+					      arg_count);
+				return false;
+			}
 			return true;
 		}
+		case OBJECT_BOUND_METHOD: {
+			struct object_bound_method *bound =
+				AS_OBJ_BOUND_METHOD(value);
+			vm->stack_top[-arg_count - 1] = bound->receiver;
+			return call(vm, bound->method, arg_count);
+		}
+		case OBJECT_NATIVE_FN:
+			return call_native(vm, AS_OBJ_NATIVE_FN(value),
+					   arg_count);
 		default:
 			break;
 		}
 	}
-	runtime_error("Only functions and classes can be called.");
+	runtime_error(vm, "Only functions and classes can be called.");
 	return false;
 }
 
-static struct object_upvalue *capture_upvalue(value_t *value)
+static inline struct property_cache_entry *
+find_cache_entry(struct property_site *site, struct shape *shape)
+{
+	struct property_cache_entry *entry = site->entries,
+				    *end = site->entries + site->count;
+
+	for (; entry < end; entry++)
+		if (entry->shape == shape)
+			return entry;
+	return NULL;
+}
+
+/**
+ * new_cache_entry() - Entry of @site for instances of @shape.
+ * @scratch: Used instead if the cache of @site is full.
+ */
+static struct property_cache_entry *
+new_cache_entry(struct property_site *site, struct shape *shape,
+		struct property_cache_entry *scratch)
 {
-	struct object_upvalue *upvalue = vm.open_upvalues, *prev_upvalue = NULL,
+	struct property_cache_entry *entry = scratch;
+
+	if (site->count < PROPERTY_CACHE_SIZE)
+		entry = &site->entries[site->count++];
+	entry->shape = shape;
+	entry->transition = NULL;
+	entry->slot = -1;
+	entry->method = NULL;
+	return entry;
+}
+
+/**
+ * get_property_miss() - Look up the property of @site on @instance after
+ * the inline cache missed and cache the result.
+ *
+ * Fields shadow methods. The methods of a class are fixed once its
+ * declaration ran, so caching them by the shape is safe.
+ *
+ * Return: The entry to use, or NULL if a runtime error was reported.
+ */
+static struct property_cache_entry *
+get_property_miss(struct vm *vm, struct property_site *site,
+		  struct object_instance *instance,
+		  struct property_cache_entry *scratch)
+{
+	int32_t slot = shape_find(instance->shape, site->name);
+	struct property_cache_entry *entry;
+	value_t method = CONS_NIL;
+
+	if (slot == -1 &&
+	    !table_get(&instance->klass->methods, site->name, &method)) {
+		runtime_error(vm, "Undefined property '%s'.",
+			      site->name->characters);
+		return NULL;
+	}
+	entry = new_cache_entry(site, instance->shape, scratch);
+	entry->slot = slot;
+	if (slot == -1)
+		entry->method = AS_OBJ_CLOSURE(method);
+	return entry;
+}
+
+/**
+ * set_property_miss() - Find the slot of the property of @site on
+ * @instance after the inline cache missed and cache it.
+ *
+ * A new field is added through a shape transition, which is cached along
+ * with the slot, so the next instance of the same shape takes the
+ * transition without a lookup.
+ */
+static struct property_cache_entry *
+set_property_miss(struct vm *vm, struct property_site *site,
+		  struct object_instance *instance,
+		  struct property_cache_entry *scratch)
+{
+	int32_t slot = shape_find(instance->shape, site->name);
+	struct property_cache_entry *entry =
+		new_cache_entry(site, instance->shape, scratch);
+
+	if (slot == -1) {
+		entry->transition =
+			shape_add(vm, instance->shape, site->name);
+		slot = entry->transition->field_count - 1;
+	}
+	entry->slot = slot;
+	return entry;
+}
+
+/**
+ * uncurry() - Start a call that passes two parameter lists of a curried
+ * function at once.
+ * @arg_count: Number of arguments of the first list.
+ * @rest_count: Number of arguments the call of the result passes.
+ *
+ * Instead of calling the callee, this pushes the closure of its uncurried
+ * function on top of the first arguments. The call of the result finds it
+ * as its callee, see call_uncurried().
+ *
+ * Return: false if the callee is no curried function taking these lists.
+ */
+static bool uncurry(struct vm *vm, int32_t arg_count, int32_t rest_count)
+{
+	value_t callee = peek(vm, arg_count);
+	struct object_closure *closure;
+	struct object_function *function;
+	int32_t i;
+
+	if (!IS_CLOSURE(callee))
+		return false;
+	closure = AS_OBJ_CLOSURE(callee);
+	function = closure->function->uncurried;
+	if (function == NULL || closure->function->arity != arg_count ||
+	    function->arity != arg_count + rest_count)
+		return false;
+
+	if (closure->uncurried == NULL && function->upvalue_count == 0) {
+		// Curried lambdas created in a loop share one closure then
+		if (function->closure == NULL)
+			function->closure = new_closure(vm, function);
+		closure->uncurried = function->closure;
+	} else if (closure->uncurried == NULL) {
+		closure->uncurried = new_closure(vm, function);
+		for (i = 0; i < function->upvalue_count; i++)
+			closure->uncurried->upvalues[i] = closure->upvalues[i];
+	}
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	push(vm, CONS_OBJECT(closure->uncurried));
+#pragma clang diagnostic pop
+	return true;
+}
+
+/**
+ * call_uncurried() - Finish the call started by uncurry() with the
+ * @arg_count arguments of the second list.
+ */
+static bool call_uncurried(struct vm *vm, struct object_closure *closure,
+			   int32_t arg_count)
+{
+	value_t *args = vm->stack_top - arg_count;
+
+	// The closure between both lists becomes the callee below them
+	memmove(args - 1, args, arg_count * sizeof(value_t));
+	vm->stack_top--;
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+	vm->stack_top[-closure->function->arity - 1] = CONS_OBJECT(closure);
+#pragma clang diagnostic pop
+	return push_frame(vm, closure, closure->function->arity);
+}
+
+/**
+ * call_site_miss() - Call @callee through call_value() and cache it at
+ * @site if it is a closure or a native.
+ *
+ * The cache is only updated after a successful call, so a cached function
+ * is known to take the number of arguments the site passes. Uncurried
+ * closures are never cached, they take more arguments than the site passes.
+ */
+static bool call_site_miss(struct vm *vm, struct call_site *site,
+			   value_t callee, int32_t arg_count)
+{
+	if (IS_CLOSURE(callee) &&
+	    AS_OBJ_CLOSURE(callee)->function->is_uncurried)
+		return call_uncurried(vm, AS_OBJ_CLOSURE(callee), arg_count);
+	if (!call_value(vm, callee, arg_count))
+		return false;
+	site->function = IS_CLOSURE(callee) ?
+				 AS_OBJ_CLOSURE(callee)->function :
+				 NULL;
+	site->native = IS_NATIVE_FN(callee) ? AS_OBJECT(callee) : NULL;
+	return true;
+}
+
+static struct object_upvalue *capture_upvalue(struct vm *vm, value_t *value)
+{
+	struct object_upvalue *upvalue = vm->open_upvalues,
+			      *prev_upvalue = NULL,
 			      *captured_upvalue = NULL;
 
 	while (upvalue != NULL && upvalue->location > value) {
@@ -185,32 +928,42 @@ static struct object_upvalue *capture_upvalue(value_t *value)
 	if (upvalue != NULL && upvalue->location == value)
 		return upvalue;
 
-	captured_upvalue = new_upvalue(value);
+	captured_upvalue = new_upvalue(vm, value);
 	captured_upvalue->next = upvalue;
 
 	if (prev_upvalue != NULL)
 		prev_upvalue->next = captured_upvalue;
 	else
-		vm.open_upvalues = captured_upvalue;
+		vm->open_upvalues = captured_upvalue;
 
 	return captured_upvalue;
 }
 
-static void close_upvalues(value_t *last)
+static void close_upvalues(struct vm *vm, value_t *last)
 {
 	struct object_upvalue *upvalue;
 
-	while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-		upvalue = vm.open_upvalues;
+	while (vm->open_upvalues != NULL &&
+	       vm->open_upvalues->location >= last) {
+		upvalue = vm->open_upvalues;
 		upvalue->container = *upvalue->location;
 		upvalue->location = &upvalue->container;
-		vm.open_upvalues = upvalue->next;
+		vm->open_upvalues = upvalue->next;
 	}
 }
 
-static enum interpret_result run(void)
+/**
+ * run() - Execute bytecode until the call that was entered last returns.
+ * @base: Number of frames of @base_fiber to leave on the stack.
+ *
+ * The script runs with a @base of 0. Natives calling back into Lox run
+ * with the frames of their callers as @base, so run() returns to the
+ * native as soon as the called function returns or its coroutine yields.
+ */
+static enum interpret_result run(struct vm *vm, int32_t base,
+				 struct fiber *base_fiber)
 {
-	struct call_frame *frame = &vm.frames[vm.frame_count - 1];
+	struct call_frame *frame = &vm->frames[vm->frame_count - 1];
 #define READ_BYTE() (*frame->ip++)
 #define READ_UINT16() \
 	(frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
@@ -218,17 +971,31 @@ static enum interpret_result run(void)
 #define FETCH_CONST(address) \
 	(frame->closure->function->chunk.constants.values[(address)])
 #define READ_STRING(address) (AS_OBJ_STRING(FETCH_CONST((address))))
+#define READ_SITE() (&frame->closure->function->chunk.sites[READ_UINT16()])
+#define READ_CALL_SITE() \
+	(&frame->closure->function->chunk.calls[READ_UINT16()])
 #define BINARY_OP(result_type, op)                                            \
 	do {                                                                  \
 		value_t a, b;                                                 \
-		if (!(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))) {            \
-			runtime_error("Binary %s requires two numbers", #op); \
+		if (!(IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))) {    \
+			runtime_error(vm, "Binary %s requires two numbers",   \
+				      #op);                                   \
 			return INTERPRET_RUNTIME_ERROR;                       \
 		}                                                             \
-		b = pop();                                                    \
-		a = pop();                                                    \
-		push(result_type(AS_NUMBER(a) op AS_NUMBER(b)));              \
+		b = pop(vm);                                                  \
+		a = pop(vm);                                                  \
+		push(vm, result_type(AS_NUMBER(a) op AS_NUMBER(b)));          \
 	} while (0)
+/*
+ * Integer fast path of a binary operator, leaves the opcode if both operands
+ * are integers and falls through to BINARY_OP() otherwise.
+ */
+#define INTEGER_OP(result_type, op)                                           \
+	if (likely(IS_INTEGER(peek(vm, 0)) && IS_INTEGER(peek(vm, 1)))) {     \
+		value_t b = pop(vm), a = pop(vm);                             \
+		push(vm, result_type(AS_INTEGER(a) op AS_INTEGER(b)));        \
+		break;                                                        \
+	}
 
 	uint8_t instruction;
 #ifdef DEBUG_TRACE_EXECUTION
@@ -239,7 +1006,7 @@ static enum interpret_result run(void)
 	for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
 		printf("        ");
-		for (slot = vm.stack; slot < vm.stack_top; slot++) {
+		for (slot = vm->stack; slot < vm->stack_top; slot++) {
 			printf("[ ");
 			print_value(*slot);
 			printf(" ]");
@@ -249,66 +1016,101 @@ static enum interpret_result run(void)
 			&frame->closure->function->chunk,
 			(int32_t)(frame->ip -
 				  frame->closure->function->chunk.code));
+#endif
+#ifdef PROFILE_EXECUTION
+		profile_instruction(vm, frame->closure->function, frame->ip);
 #endif
 		switch (instruction = READ_BYTE()) {
 		case OP_CONSTANT: {
 			int32_t address = READ_BYTE();
 			value_t constant = FETCH_CONST(address);
-			push(constant);
+			push(vm, constant);
 			break;
 		}
 		case OP_CONSTANT_LONG: {
 			int32_t address = READ_LONG_ARG();
 			value_t constant = FETCH_CONST(address);
-			push(constant);
+			push(vm, constant);
 			break;
 		}
 		case OP_NIL: {
-			push(CONS_NIL);
+			push(vm, CONS_NIL);
 			break;
 		}
 		case OP_TRUE: {
-			push(CONS_BOOLEAN(true));
+			push(vm, CONS_BOOLEAN(true));
 			break;
 		}
 		case OP_FALSE: {
-			push(CONS_BOOLEAN(false));
+			push(vm, CONS_BOOLEAN(false));
 			break;
 		}
 		case OP_NOT: {
-			push(CONS_BOOLEAN(is_false(pop())));
+			push(vm, CONS_BOOLEAN(is_false(pop(vm))));
 			break;
 		}
 		case OP_NEGATE: {
-			if (!IS_NUMBER(peek(0))) {
-				runtime_error(
+			if (!IS_NUMBER(peek(vm, 0))) {
+				runtime_error(vm,
 					"Unary negation requires a number.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			AS_NUMBER(vm.stack_top[-1]) *= -1;
+			// -0 is a double, so negating 0 leaves the integers
+			if (IS_INTEGER(peek(vm, 0)) && AS_INTEGER(peek(vm, 0)))
+				vm->stack_top[-1] = integer_result(
+					-AS_INTEGER(peek(vm, 0)));
+			else
+				vm->stack_top[-1] =
+					CONS_NUMBER(-AS_NUMBER(peek(vm, 0)));
 			break;
 		}
 		case OP_ADD: {
 			value_t a, b;
-			if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-				b = pop();
-				a = pop();
-				push(CONS_NUMBER(AS_NUMBER(a) + AS_NUMBER(b)));
-			} else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-				concatenate();
+			if (likely(IS_INTEGER(peek(vm, 0)) &&
+				   IS_INTEGER(peek(vm, 1)))) {
+				b = pop(vm);
+				a = pop(vm);
+				push(vm, integer_result(AS_INTEGER(a) +
+							AS_INTEGER(b)));
+			} else if (IS_NUMBER(peek(vm, 0)) &&
+				   IS_NUMBER(peek(vm, 1))) {
+				b = pop(vm);
+				a = pop(vm);
+				push(vm,
+				     CONS_NUMBER(AS_NUMBER(a) + AS_NUMBER(b)));
+			} else if (IS_STRING(peek(vm, 0)) &&
+				   IS_STRING(peek(vm, 1))) {
+				concatenate(vm);
 			} else {
-				runtime_error(
+				runtime_error(vm,
 					"Binary + requires two numbers or two strings");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
 		}
 		case OP_SUB: {
+			INTEGER_OP(integer_result, -);
 			BINARY_OP(CONS_NUMBER, -);
 			break;
 		}
 		case OP_MUL: {
+			int64_t result;
+			/*
+			 * A product that overflows or is 0 with a negative
+			 * factor, which is -0, is left to the doubles.
+			 */
+			if (likely(IS_INTEGER(peek(vm, 0)) &&
+				   IS_INTEGER(peek(vm, 1))) &&
+			    !__builtin_mul_overflow(AS_INTEGER(peek(vm, 1)),
+						    AS_INTEGER(peek(vm, 0)),
+						    &result) &&
+			    (result != 0 || (AS_INTEGER(peek(vm, 0)) >= 0 &&
+					     AS_INTEGER(peek(vm, 1)) >= 0))) {
+				pop(vm);
+				vm->stack_top[-1] = integer_result(result);
+				break;
+			}
 			BINARY_OP(CONS_NUMBER, *);
 			break;
 		}
@@ -318,81 +1120,94 @@ static enum interpret_result run(void)
 		}
 		case OP_EQUAL: {
 			value_t a, b;
-			b = pop();
-			a = pop();
-			push(CONS_BOOLEAN(is_equal(a, b)));
+			b = pop(vm);
+			a = pop(vm);
+			push(vm, CONS_BOOLEAN(is_equal(a, b)));
 			break;
 		}
 		case OP_LESS: {
+			INTEGER_OP(CONS_BOOLEAN, <);
 			BINARY_OP(CONS_BOOLEAN, <);
 			break;
 		}
 		case OP_GREATER: {
+			INTEGER_OP(CONS_BOOLEAN, >);
 			BINARY_OP(CONS_BOOLEAN, >);
 			break;
 		}
 		case OP_PRINT: {
-			print_value(pop());
-			printf("\n");
+			output_value(&vm->out, pop(vm));
+			output_line(&vm->out);
 			break;
 		}
 		case OP_POP: {
-			pop();
+			pop(vm);
 			break;
 		}
 		case OP_POPN: {
-			vm.stack_top -= READ_BYTE();
+			vm->stack_top -= READ_BYTE();
+			break;
+		}
+		case OP_PICK: {
+			uint8_t distance = READ_BYTE();
+			push(vm, peek(vm, distance));
+			break;
+		}
+		case OP_NIP: {
+			uint8_t count = READ_BYTE();
+			vm->stack_top[-1 - count] = vm->stack_top[-1];
+			vm->stack_top -= count;
 			break;
 		}
 		case OP_DEFINE_GLOBAL: {
 			struct object_string *name;
 			name = READ_STRING(READ_BYTE());
-			table_set(&vm.globals, name, peek(0));
+			table_set(vm, &vm->globals, name, peek(vm, 0));
 			// Garbage collection may trigger, pop after writing
 			// to table is completed
-			pop();
+			pop(vm);
 			break;
 		}
 		case OP_DEFINE_GLOBAL_LONG: {
 			struct object_string *name;
 			name = READ_STRING(READ_LONG_ARG());
-			table_set(&vm.globals, name, peek(0));
+			table_set(vm, &vm->globals, name, peek(vm, 0));
 			// Garbage collection may trigger, pop after writing
 			// to table is completed
-			pop();
+			pop(vm);
 			break;
 		}
 		case OP_GET_GLOBAL: {
 			struct object_string *name;
 			value_t a;
 			name = READ_STRING(READ_BYTE());
-			if (!table_get(&vm.globals, name, &a)) {
-				runtime_error("Undefined variable '%s'.",
+			if (!table_get(&vm->globals, name, &a)) {
+				runtime_error(vm, "Undefined variable '%s'.",
 					      name->characters);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(a);
+			push(vm, a);
 			break;
 		}
 		case OP_GET_GLOBAL_LONG: {
 			struct object_string *name;
 			value_t a;
 			name = READ_STRING(READ_LONG_ARG());
-			if (!table_get(&vm.globals, name, &a)) {
-				runtime_error("Undefined variable '%s'.",
+			if (!table_get(&vm->globals, name, &a)) {
+				runtime_error(vm, "Undefined variable '%s'.",
 					      name->characters);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(a);
+			push(vm, a);
 			break;
 		}
 		case OP_SET_GLOBAL: {
 			struct object_string *name;
 			name = READ_STRING(READ_BYTE());
 			// This disables implicit variable declaration
-			if (table_set(&vm.globals, name, peek(0))) {
-				table_delete(&vm.globals, name);
-				runtime_error("Undefined variable '%s'.",
+			if (table_set(vm, &vm->globals, name, peek(vm, 0))) {
+				table_delete(&vm->globals, name);
+				runtime_error(vm, "Undefined variable '%s'.",
 					      name->characters);
 				return INTERPRET_RUNTIME_ERROR;
 			}
@@ -400,19 +1215,19 @@ static enum interpret_result run(void)
 		}
 		case OP_GET_LOCAL: {
 			uint8_t local = READ_BYTE();
-			push(frame->slots[local]);
+			push(vm, frame->slots[local]);
 			break;
 		}
 		case OP_SET_LOCAL: {
 			uint8_t local = READ_BYTE();
-			frame->slots[local] = peek(0);
+			frame->slots[local] = peek(vm, 0);
 			break;
 		}
 		case OP_JUMP_IF_FALSE: {
 			uint16_t address = READ_UINT16();
-			if (is_false(peek(0)))
+			if (is_false(peek(vm, 0)))
 				frame->ip += address;
-			// frame->ip += is_false(peek(0)) * address;
+			// frame->ip += is_false(peek(vm, 0)) * address;
 			break;
 		}
 		case OP_JUMP: {
@@ -425,26 +1240,55 @@ static enum interpret_result run(void)
 			frame->ip -= address;
 			break;
 		}
+		case OP_CALL_CURRIED: {
+			uint8_t rest_count = READ_BYTE();
+
+			// Skips the operands of OP_CALL, the call of the result
+			// that follows calls the uncurried closure
+			if (uncurry(vm, frame->ip[0], rest_count)) {
+				frame->ip += 3;
+				break;
+			}
+		}
+			/* fall through */
 		case OP_CALL: {
 			uint8_t arg_count = READ_BYTE();
-			if (!call_value(peek(arg_count), arg_count))
+			struct call_site *site = READ_CALL_SITE();
+			value_t callee = peek(vm, arg_count);
+			bool ok;
+
+			// A closure of the cached function or the cached
+			// native goes straight to the call
+			if (IS_OBJECT(callee) &&
+			    OBJECT_TYPE(callee) == OBJECT_CLOSURE &&
+			    AS_OBJ_CLOSURE(callee)->function == site->function)
+				ok = push_frame(vm, AS_OBJ_CLOSURE(callee),
+						arg_count);
+			else if (IS_OBJECT(callee) &&
+				 AS_OBJECT(callee) == site->native)
+				ok = call_native(vm, AS_OBJ_NATIVE_FN(callee),
+						 arg_count);
+			else
+				ok = call_site_miss(vm, site, callee,
+						    arg_count);
+			if (!ok)
 				return INTERPRET_RUNTIME_ERROR;
-			frame = &vm.frames[vm.frame_count - 1];
+			frame = &vm->frames[vm->frame_count - 1];
 			break;
 		}
 		case OP_GET_UPVALUE: {
 			uint8_t slot = READ_BYTE();
-			push(*frame->closure->upvalues[slot]->location);
+			push(vm, *frame->closure->upvalues[slot]->location);
 			break;
 		}
 		case OP_SET_UPVALUE: {
 			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0);
+			*frame->closure->upvalues[slot]->location = peek(vm, 0);
 			break;
 		}
 		case OP_CLOSE_UPVALUE: {
-			close_upvalues(vm.stack_top - 1);
-			pop();
+			close_upvalues(vm, vm->stack_top - 1);
+			pop(vm);
 			break;
 		}
 		case OP_CLOSURE: {
@@ -452,11 +1296,12 @@ static enum interpret_result run(void)
 			value_t value = FETCH_CONST(address);
 			struct object_function *function =
 				AS_OBJ_FUNCTION(value);
-			struct object_closure *closure = new_closure(function);
+			struct object_closure *closure =
+				new_closure(vm, function);
 			int32_t i;
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wincompatible-pointer-types"
-			push(CONS_OBJECT(closure));
+			push(vm, CONS_OBJECT(closure));
 #pragma clang diagnostic pop
 
 			for (i = 0; i < closure->upvalue_count; i++) {
@@ -464,7 +1309,7 @@ static enum interpret_result run(void)
 				uint8_t index = READ_BYTE();
 				if (is_local)
 					closure->upvalues[i] = capture_upvalue(
-						frame->slots + index);
+						vm, frame->slots + index);
 				else
 					closure->upvalues[i] =
 						frame->closure->upvalues[index];
@@ -476,11 +1321,12 @@ static enum interpret_result run(void)
 			value_t value = FETCH_CONST(address);
 			struct object_function *function =
 				AS_OBJ_FUNCTION(value);
-			struct object_closure *closure = new_closure(function);
+			struct object_closure *closure =
+				new_closure(vm, function);
 			int32_t i;
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wincompatible-pointer-types"
-			push(CONS_OBJECT(closure));
+			push(vm, CONS_OBJECT(closure));
 #pragma clang diagnostic pop
 
 			for (i = 0; i < closure->upvalue_count; i++) {
@@ -488,24 +1334,315 @@ static enum interpret_result run(void)
 				uint8_t index = READ_BYTE();
 				if (is_local)
 					closure->upvalues[i] = capture_upvalue(
-						frame->slots + index);
+						vm, frame->slots + index);
 				else
 					closure->upvalues[i] =
 						frame->closure->upvalues[index];
 			}
 			break;
 		}
+		case OP_YIELD: {
+			value_t result = pop(vm);
+			if (vm->fiber == &vm->root) {
+				runtime_error(vm,
+					"Can only yield inside a coroutine.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			// The C frame of the native would be left on the
+			// stack of the caller
+			if (vm->fiber->native_calls > 0) {
+				runtime_error(vm,
+					"Cannot yield across a native call.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			leave_fiber(vm, result, FIBER_SUSPENDED);
+			if (vm->frame_count == base && vm->fiber == base_fiber)
+				return INTERPRET_OK;
+			frame = &vm->frames[vm->frame_count - 1];
+			break;
+		}
+		case OP_ARRAY: {
+			uint8_t length = READ_BYTE();
+			struct object_array *array = new_array(vm, length);
+
+			vm->stack_top -= length;
+			if (length > 0)
+				memcpy(array->values.values, vm->stack_top,
+				       sizeof(value_t) * length);
+			array->values.length = length;
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+			push(vm, CONS_OBJECT(array));
+#pragma clang diagnostic pop
+			break;
+		}
+		case OP_GET_INDEX: {
+			struct object_array *array;
+			struct object_float64_array *floats;
+			value_t value;
+			int32_t index;
+
+			if (IS_MAP(peek(vm, 1))) {
+				if (!map_get(&AS_OBJ_MAP(peek(vm, 1))->map,
+					     peek(vm, 0), &value)) {
+					runtime_error(vm, "Undefined key.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				vm->stack_top -= 2;
+				push(vm, value);
+				break;
+			}
+			if (IS_FLOAT64_ARRAY(peek(vm, 1))) {
+				floats = AS_OBJ_FLOAT64_ARRAY(peek(vm, 1));
+				if (!array_index(vm, floats->length,
+						 peek(vm, 0), &index))
+					return INTERPRET_RUNTIME_ERROR;
+				vm->stack_top -= 2;
+				push(vm, CONS_NUMBER(floats->values[index]));
+				break;
+			}
+			if (!IS_ARRAY(peek(vm, 1))) {
+				runtime_error(vm,
+					"Only arrays and maps can be indexed.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			array = AS_OBJ_ARRAY(peek(vm, 1));
+			if (!array_index(vm, array->values.length, peek(vm, 0),
+					 &index))
+				return INTERPRET_RUNTIME_ERROR;
+			vm->stack_top -= 2;
+			push(vm, array->values.values[index]);
+			break;
+		}
+		case OP_SET_INDEX: {
+			struct object_array *array;
+			struct object_float64_array *floats;
+			value_t value;
+			int32_t index;
+
+			if (IS_MAP(peek(vm, 2))) {
+				value = pop(vm);
+				map_set(vm, &AS_OBJ_MAP(peek(vm, 1))->map,
+					peek(vm, 0), value);
+				vm->stack_top -= 2;
+				push(vm, value);
+				break;
+			}
+			if (IS_FLOAT64_ARRAY(peek(vm, 2))) {
+				floats = AS_OBJ_FLOAT64_ARRAY(peek(vm, 2));
+				if (!array_index(vm, floats->length,
+						 peek(vm, 1), &index))
+					return INTERPRET_RUNTIME_ERROR;
+				if (!IS_NUMBER(peek(vm, 0))) {
+					runtime_error(vm,
+						"Float64 arrays can only hold "
+						"numbers.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				value = pop(vm);
+				floats->values[index] = AS_NUMBER(value);
+				vm->stack_top -= 2;
+				push(vm, value);
+				break;
+			}
+			if (!IS_ARRAY(peek(vm, 2))) {
+				runtime_error(vm,
+					"Only arrays and maps can be indexed.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			array = AS_OBJ_ARRAY(peek(vm, 2));
+			if (!array_index(vm, array->values.length, peek(vm, 1),
+					 &index))
+				return INTERPRET_RUNTIME_ERROR;
+			value = pop(vm);
+			array->values.values[index] = value;
+			vm->stack_top -= 2;
+			push(vm, value);
+			break;
+		}
+		case OP_CLASS: {
+			struct object_string *name =
+				READ_STRING(READ_LONG_ARG());
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+			push(vm, CONS_OBJECT(new_class(vm, name)));
+#pragma clang diagnostic pop
+			break;
+		}
+		case OP_METHOD: {
+			struct object_string *name =
+				READ_STRING(READ_LONG_ARG());
+			struct object_class *klass = AS_OBJ_CLASS(peek(vm, 1));
+			table_set(vm, &klass->methods, name, peek(vm, 0));
+			if (name == vm->init_string)
+				klass->initializer =
+					AS_OBJ_CLOSURE(peek(vm, 0));
+			pop(vm);
+			break;
+		}
+		case OP_INHERIT: {
+			struct object_class *superclass, *subclass;
+			if (!IS_CLASS(peek(vm, 1))) {
+				runtime_error(vm,
+					"Superclass must be a class.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			superclass = AS_OBJ_CLASS(peek(vm, 1));
+			subclass = AS_OBJ_CLASS(peek(vm, 0));
+			// Copied down before the subclass adds its own
+			table_add_all(vm, &subclass->methods,
+				      &superclass->methods);
+			subclass->initializer = superclass->initializer;
+			pop(vm);
+			break;
+		}
+		case OP_GET_PROPERTY: {
+			struct property_site *site = READ_SITE();
+			struct property_cache_entry *entry, scratch;
+			struct object_instance *instance;
+
+			if (!IS_INSTANCE(peek(vm, 0))) {
+				runtime_error(vm,
+					"Only instances have properties.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			instance = AS_OBJ_INSTANCE(peek(vm, 0));
+			entry = find_cache_entry(site, instance->shape);
+			if (entry == NULL)
+				entry = get_property_miss(vm, site, instance,
+							  &scratch);
+			if (entry == NULL)
+				return INTERPRET_RUNTIME_ERROR;
+			if (entry->slot != -1) {
+				vm->stack_top[-1] =
+					instance->fields[entry->slot];
+				break;
+			}
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+			vm->stack_top[-1] = CONS_OBJECT(new_bound_method(
+				vm, peek(vm, 0), entry->method));
+#pragma clang diagnostic pop
+			break;
+		}
+		case OP_SET_PROPERTY: {
+			struct property_site *site = READ_SITE();
+			struct property_cache_entry *entry, scratch;
+			struct object_instance *instance;
+
+			if (!IS_INSTANCE(peek(vm, 1))) {
+				runtime_error(vm,
+					"Only instances have fields.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			instance = AS_OBJ_INSTANCE(peek(vm, 1));
+			entry = find_cache_entry(site, instance->shape);
+			if (entry == NULL)
+				entry = set_property_miss(vm, site, instance,
+							  &scratch);
+			if (entry->transition != NULL) {
+				instance_reserve(vm, instance,
+						 entry->slot + 1);
+				instance->shape = entry->transition;
+			}
+			instance->fields[entry->slot] = peek(vm, 0);
+			vm->stack_top[-2] = vm->stack_top[-1];
+			pop(vm);
+			break;
+		}
+		case OP_INVOKE: {
+			struct property_site *site = READ_SITE();
+			uint8_t arg_count = READ_BYTE();
+			struct property_cache_entry *entry, scratch;
+			struct object_instance *instance;
+
+			if (!IS_INSTANCE(peek(vm, arg_count))) {
+				runtime_error(vm,
+					"Only instances have methods.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			instance = AS_OBJ_INSTANCE(peek(vm, arg_count));
+			entry = find_cache_entry(site, instance->shape);
+			if (entry == NULL)
+				entry = get_property_miss(vm, site, instance,
+							  &scratch);
+			if (entry == NULL)
+				return INTERPRET_RUNTIME_ERROR;
+			if (entry->slot != -1) {
+				// A field holding a function replaces the
+				// receiver, as if read and then called
+				value_t field = instance->fields[entry->slot];
+				vm->stack_top[-arg_count - 1] = field;
+				if (!call_value(vm, field, arg_count))
+					return INTERPRET_RUNTIME_ERROR;
+			} else if (!call(vm, entry->method, arg_count)) {
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			frame = &vm->frames[vm->frame_count - 1];
+			break;
+		}
+		case OP_SUPER_INVOKE: {
+			struct property_site *site = READ_SITE();
+			uint8_t arg_count = READ_BYTE();
+			struct object_class *superclass =
+				AS_OBJ_CLASS(pop(vm));
+			struct property_cache_entry *entry, scratch;
+			value_t method;
+
+			// Cached by the root shape, which identifies the class
+			entry = find_cache_entry(site, superclass->shape);
+			if (entry == NULL) {
+				if (!table_get(&superclass->methods,
+					       site->name, &method)) {
+					runtime_error(vm,
+						"Undefined property '%s'.",
+						site->name->characters);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				entry = new_cache_entry(site, superclass->shape,
+							&scratch);
+				entry->method = AS_OBJ_CLOSURE(method);
+			}
+			if (!call(vm, entry->method, arg_count))
+				return INTERPRET_RUNTIME_ERROR;
+			frame = &vm->frames[vm->frame_count - 1];
+			break;
+		}
+		case OP_GET_SUPER: {
+			struct property_site *site = READ_SITE();
+			struct object_class *superclass =
+				AS_OBJ_CLASS(pop(vm));
+			value_t method;
+
+			if (!table_get(&superclass->methods, site->name,
+				       &method)) {
+				runtime_error(vm, "Undefined property '%s'.",
+					      site->name->characters);
+				return INTERPRET_RUNTIME_ERROR;
+			}
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
+			vm->stack_top[-1] = CONS_OBJECT(new_bound_method(
+				vm, peek(vm, 0), AS_OBJ_CLOSURE(method)));
+#pragma clang diagnostic pop
+			break;
+		}
 		case OP_RETURN: {
-			value_t result = pop();
-			close_upvalues(frame->slots);
-			vm.frame_count--;
-			if (vm.frame_count == 0) {
-				pop();
+			value_t result = pop(vm);
+			close_upvalues(vm, frame->slots);
+			vm->frame_count--;
+			if (vm->frame_count == 0 && vm->fiber != &vm->root) {
+				leave_fiber(vm, result, FIBER_DONE);
+			} else if (vm->frame_count == 0) {
+				pop(vm);
 				return INTERPRET_OK;
+			} else {
+				vm->stack_top = frame->slots;
+				push(vm, result);
 			}
-			vm.stack_top = frame->slots;
-			push(result);
-			frame = &vm.frames[vm.frame_count - 1];
+			if (vm->frame_count == base && vm->fiber == base_fiber)
+				return INTERPRET_OK;
+			frame = &vm->frames[vm->frame_count - 1];
 			break;
 		}
 		}
@@ -515,39 +1652,105 @@ static enum interpret_result run(void)
 #undef READ_LONG_ARG
 #undef FETCH_CONST
 #undef READ_STRING
+#undef READ_SITE
+#undef READ_CALL_SITE
 #undef BINARY_OP
+#undef INTEGER_OP
 }
 
 // TODO: Go through the chunk and resize the stack size of vm accordingly
-enum interpret_result interpret(char *source)
+static enum interpret_result interpret_scanner(struct vm *vm,
+					       struct scanner *scanner)
 {
 	struct object_function *function;
 	struct object_closure *closure;
+	enum interpret_result result;
 
-	function = compile(source);
+	function = compile(vm, scanner);
+	free_scanner(scanner);
 	if (function == NULL)
 		return INTERPRET_COMPILE_ERROR;
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wincompatible-pointer-types"
-	push(CONS_OBJECT(function));
-	closure = new_closure(function);
-	pop();
-	push(CONS_OBJECT(closure));
+	push(vm, CONS_OBJECT(function));
+	closure = new_closure(vm, function);
+	pop(vm);
+	push(vm, CONS_OBJECT(closure));
 #pragma clang diagnostic pop
-	call(closure, 0);
+	call(vm, closure, 0);
+
+	result = run(vm, 0, &vm->root);
+	flush_output(&vm->out);
+	return result;
+}
+
+/**
+ * interpret() - Compile and run the @length bytes at @source.
+ *
+ * @source is not needed anymore once this returns.
+ */
+enum interpret_result interpret(struct vm *vm, const char *source,
+				size_t length)
+{
+	struct scanner scanner;
+
+	init_scanner(&scanner, source, length);
+	return interpret_scanner(vm, &scanner);
+}
 
-	return run();
+/**
+ * interpret_reader() - Compile and run a source that is read in pieces.
+ * @read: Called with @context until it returns 0 at the end of the source.
+ */
+enum interpret_result interpret_reader(struct vm *vm, read_fn read,
+				       void *context)
+{
+	struct scanner scanner;
+
+	init_scanner_reader(&scanner, read, context);
+	return interpret_scanner(vm, &scanner);
+}
+
+/**
+ * call_function() - Call @callee from a native function.
+ * @args: The @arg_count arguments, must not point into the stack.
+ * @result: Receives the return value of @callee.
+ *
+ * Return: false if a runtime error occurred. It was reported already and
+ * the native must return right away.
+ */
+bool call_function(struct vm *vm, value_t callee, int32_t arg_count,
+		   value_t *args, value_t *result)
+{
+	struct fiber *fiber = vm->fiber;
+	int32_t base = vm->frame_count, i;
+	bool ok;
+
+	push(vm, callee);
+	for (i = 0; i < arg_count; i++)
+		push(vm, args[i]);
+	fiber->native_calls++;
+	ok = call_value(vm, callee, arg_count) &&
+	     ((vm->frame_count == base && vm->fiber == fiber) ||
+	      run(vm, base, fiber) == INTERPRET_OK);
+	fiber->native_calls--;
+	if (!ok) {
+		vm->error = error_reported;
+		return false;
+	}
+	*result = pop(vm);
+	return true;
 }
 
-void push(value_t value)
+void push(struct vm *vm, value_t value)
 {
-	*vm.stack_top = value;
-	vm.stack_top++;
+	*vm->stack_top = value;
+	vm->stack_top++;
 }
 
-value_t pop(void)
+value_t pop(struct vm *vm)
 {
-	vm.stack_top--;
-	return *vm.stack_top;
+	vm->stack_top--;
+	return *vm->stack_top;
 }
@@ -2,12 +2,19 @@
 #define clox_vm_h
 
 #include "common.h"
+#include "loop.h"
+#include "memory.h"
 #include "object.h"
+#include "output.h"
+#include "profile.h"
+#include "scanner.h"
 #include "table.h"
 #include "value.h"
 
 #define FRAME_MAX 64
 #define STACK_MAX (FRAME_MAX * (1 << 8))
+#define COROUTINE_FRAME_MAX 16
+#define COROUTINE_STACK_MAX (COROUTINE_FRAME_MAX * (1 << 8))
 
 enum interpret_result {
 	INTERPRET_OK,
@@ -21,24 +28,64 @@ struct call_frame {
 	value_t *slots;
 };
 
+/*
+ * The fields from @frames to @open_upvalues describe the fiber that is
+ * running, they are swapped with the ones saved in @fiber when a coroutine
+ * is resumed or yields. The script itself runs on @root, whose frames and
+ * stack are @root_frames and @root_stack.
+ */
 struct vm {
-	struct call_frame frames[FRAME_MAX];
+	struct call_frame *frames;
 	int32_t frame_count;
-	value_t stack[STACK_MAX];
+	int32_t frame_max;
+	value_t *stack;
 	value_t *stack_top;
+	struct object_upvalue *open_upvalues;
+	struct fiber *fiber;
+	struct fiber root;
+	struct call_frame root_frames[FRAME_MAX];
+	value_t root_stack[STACK_MAX];
 	struct table strings;
 	struct table globals;
+	/*
+	 * The globals bound with let by scripts compiled so far, to their
+	 * value if the compiler knew it and to nil otherwise.
+	 */
+	struct table constants;
+	struct object_string *init_string;
 	struct object *objects;
-	struct object_upvalue *open_upvalues;
+	struct memory_stats memory;
+	/*
+	 * The globals, newest object and memory statistics right after the
+	 * natives were defined, restored by reset_vm().
+	 */
+	struct table natives;
+	struct object *native_objects;
+	struct memory_stats native_memory;
+	uint32_t lambda_count;
+	struct output out;
+	FILE *err;
+	const char *error;
+	struct loop loop;
+#ifdef PROFILE_EXECUTION
+	struct profile profile;
+#endif
 };
 
-extern struct vm vm;
+void init_vm(struct vm *vm);
+void reset_vm(struct vm *vm);
+void free_vm(struct vm *vm);
+enum interpret_result interpret(struct vm *vm, const char *source,
+				size_t length);
+enum interpret_result interpret_reader(struct vm *vm, read_fn read,
+				       void *context);
 
-void init_vm(void);
-void free_vm(void);
-enum interpret_result interpret(char *source);
+void push(struct vm *vm, value_t value);
+value_t pop(struct vm *vm);
 
-void push(value_t value);
-value_t pop(void);
+void define_native_fn(struct vm *vm, const char *name, native_fn function);
+value_t native_error(struct vm *vm, const char *message);
+bool call_function(struct vm *vm, value_t callee, int32_t arg_count,
+		   value_t *args, value_t *result);
 
 #endif